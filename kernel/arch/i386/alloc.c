@@ -171,6 +171,12 @@ extend_heap:
          page_vma < old_ctxt_end + bytes + sizeof(alloc_chunk_desc_t);
          page_vma += PAGE_SIZE) {
         uintptr_t page_pma = get_page_pma();
+        if (!page_pma) {
+            // User memory cannot take the frames kept for the kernel (see
+            // page_new_user()), so the kernel itself used them all up
+            printk("alloc: fatal: out of physical memory\n");
+            die();
+        }
         page_set_entry(page_vma, page_pma | PAGE_WRITE | PAGE_PRESENT);
     }
 
@@ -5,6 +5,7 @@
 #include "alloc.h"
 #include "apic.h"
 #include "asm.h"
+#include "clock.h"
 #include "cpuid.h"
 #include "int.h"
 #include "io.h"
@@ -14,29 +15,120 @@ static void *lapic_base_vma;
 static uintptr_t lapic_base_pma;
 static volatile apic_lvt_reg_t *lapic_reg;
 static bool get_page_first_run = true;
+static uint64_t lapic_tsc_per_count = 1;    // TSC cycles per APIC timer count
+static bool lapic_tsc_deadline;             // Whether the TSC-deadline mode is used
 
-static void lapic_timer_init(uint32_t period)
+// Measure APIC timer frequency against the TSC
+static void lapic_timer_calibrate(void)
 {
-    cpuid_thermal_t thermal_info;
-    cpuid_thermal(&thermal_info);
+    // Count down from the maximum with the interrupt masked
+    lapic_reg[APIC_LVT_TR_IDX] = (apic_lvt_reg_t) {
+        .lvt = {
+            .vector = IDT_VECTOR_TIMER,
+            .masked = 1,
+            .timer_mode = APIC_TIMER_ONE_SHOT,
+        }
+    };
+    lapic_reg[APIC_INIT_COUNT_IDX].raw = UINT32_MAX;
+
+    const uint64_t start = rdtsc();
+    while (rdtsc() - start < APIC_TIMER_CALIBRATE_TSC)
+        ;
+    const uint32_t counts = UINT32_MAX - lapic_reg[APIC_CURR_COUNT_IDX].raw;
+    lapic_reg[APIC_INIT_COUNT_IDX].raw = 0;
+
+    if (counts)
+        lapic_tsc_per_count = APIC_TIMER_CALIBRATE_TSC / counts;
+    if (!lapic_tsc_per_count)
+        lapic_tsc_per_count = 1;
+}
 
-    if (!thermal_info.arat) {
-        printk("lapic_timer_init: WARNING: APIC timer is not persistent\n");
-    }
+// Program the timer of the calling processor in the mode chosen by
+// lapic_timer_init()
+static void lapic_timer_setup(void)
+{
+    // Set divide configuration register
+    lapic_reg[APIC_DIV_CONFIG_IDX].timer.divide = APIC_TIMER_DIV128;
 
+    // The timer stays idle until the scheduler programs it (see proc_next())
     apic_lvt_reg_t timer = {
         .lvt = {
             .vector = IDT_VECTOR_TIMER,
-            .timer_mode = APIC_TIMER_PERIODIC,
+            .timer_mode = lapic_tsc_deadline ? APIC_TIMER_TSC_DEADLINE
+                                             : APIC_TIMER_ONE_SHOT,
         }
     };
     lapic_reg[APIC_LVT_TR_IDX] = timer;
 
+    // The mode switch must complete before a deadline is written
+    mfence();
+}
+
+static void lapic_timer_init(void)
+{
+    cpuid_thermal_t thermal_info;
+    cpuid_thermal(&thermal_info);
+
+    if (!thermal_info.arat) {
+        printk("lapic_timer_init: WARNING: APIC timer is not persistent\n");
+    }
+
     // Set divide configuration register
     lapic_reg[APIC_DIV_CONFIG_IDX].timer.divide = APIC_TIMER_DIV128;
 
-    // Set initial-count register
-    lapic_reg[APIC_INIT_COUNT_IDX].raw = period;
+    lapic_timer_calibrate();
+
+    // In TSC-deadline mode the timer fires when the TSC reaches the value in
+    // IA32_TSC_DEADLINE, so interrupts are armed at an absolute time with TSC
+    // precision. Otherwise the calibrated count is programmed relative to now.
+    cpuid_version_t ver;
+    cpuid_version(&ver);
+    lapic_tsc_deadline = ver.tsc_deadline;
+    printk("lapic_timer_init: mode: %s, frequency: %u kHz\n",
+           lapic_tsc_deadline ? "TSC deadline" : "one-shot",
+           clock_tsc_khz() / lapic_tsc_per_count);
+
+    lapic_timer_setup();
+}
+
+// Raise timer interrupt once when the TSC reaches tsc (right away if it
+// already has)
+void lapic_timer_deadline(uint64_t tsc)
+{
+    if (lapic_tsc_deadline) {
+        // A deadline of zero disarms the timer
+        set_msr(tsc ? tsc : 1, IA32_TSC_DEADLINE_MSR);
+        return;
+    }
+
+    const uint64_t now = rdtsc();
+    lapic_timer_oneshot(tsc > now ? tsc - now : 0);
+}
+
+// Raise timer interrupt once after (at least) cycles TSC cycles
+void lapic_timer_oneshot(uint64_t cycles)
+{
+    if (lapic_tsc_deadline) {
+        set_msr(rdtsc() + cycles, IA32_TSC_DEADLINE_MSR);
+        return;
+    }
+
+    uint64_t counts = cycles / lapic_tsc_per_count;
+    if (counts == 0)
+        counts = 1;
+    else if (counts > UINT32_MAX)
+        counts = UINT32_MAX;
+
+    lapic_reg[APIC_INIT_COUNT_IDX].raw = counts;
+}
+
+// Cancel pending timer interrupt
+void lapic_timer_stop(void)
+{
+    if (lapic_tsc_deadline)
+        set_msr(0, IA32_TSC_DEADLINE_MSR);
+    else
+        lapic_reg[APIC_INIT_COUNT_IDX].raw = 0;
 }
 
 // Disable Intel 8259 PIC
@@ -67,6 +159,47 @@ apic_lvt_reg_t lapic_get_esr(void)
     return lapic_reg[APIC_ESR_IDX];
 }
 
+// Return local APIC ID of the calling processor
+uint8_t lapic_get_id(void)
+{
+    return lapic_reg[APIC_ID_IDX].raw >> 24;
+}
+
+/**
+ * Send inter-processor interrupt
+ *  apic_id: destination (ignored unless icr.icr.shorthand is APIC_DEST_FIELD)
+ * NOTE: returns once the local APIC has sent the IPI
+ */
+void lapic_send_ipi(uint8_t apic_id, apic_lvt_reg_t icr)
+{
+    // Writing the low half sends the IPI
+    lapic_reg[APIC_ICR_HI_IDX].raw = (uint32_t)apic_id << 24;
+    lapic_reg[APIC_ICR_IDX] = icr;
+
+    while (lapic_reg[APIC_ICR_IDX].icr.delivery_status)
+        ;
+}
+
+// Software-enable the local APIC of the calling processor (the enable bit
+// is clear after INIT)
+static void lapic_enable(void)
+{
+    lapic_reg[APIC_SVR_IDX] = (apic_lvt_reg_t) {
+        .svr = {
+            .vector = IDT_VECTOR_SPURIOUS,
+            .enable = 1,
+        }
+    };
+}
+
+// Set up the local APIC of an application processor (after apic_init() has
+// run on the bootstrap processor)
+void lapic_init_ap(void)
+{
+    lapic_enable();
+    lapic_timer_setup();
+}
+
 uintptr_t lvt_get_page_pma(void)
 {
     if (get_page_first_run) {
@@ -98,11 +231,12 @@ void apic_init(void)
 
     get_msr(&msr, IA32_APIC_BASE_MSR);
 
-    // TODO is this the right approach for an MP system? Do this earlier?
-    // Halt processor if we are not on the bootstrap processor
+    // Application processors are started later by smp_init() and share the
+    // mapping below (every processor sees its own local APIC at the same
+    // physical address)
     if (!msr.bsp) {
-        printk("apic_init: Halting core (not bootstrap)\n");
-        halt();
+        printk("apic_init: FATAL: not running on the bootstrap processor\n");
+        die();
     }
 
     // Calculate local APIC register physical base address from MSR
@@ -112,5 +246,6 @@ void apic_init(void)
     lapic_base_vma = kalloc(&lvt_get_page_pma, PAGE_SIZE, PAGE_SIZE);
     lapic_reg = lapic_base_vma;
 
-    lapic_timer_init(0x10000);
+    lapic_enable();
+    lapic_timer_init();
 }
@@ -11,6 +11,7 @@
 enum {
     MAX_PHYS_ADDR       = 32,
     IA32_APIC_BASE_MSR  = 0x1b,
+    IA32_TSC_DEADLINE_MSR = 0x6e0,
 };
 
 // APIC register offsets
@@ -31,6 +32,7 @@ enum {
     APIC_ESR        = 0x280,// (R)   Error status register
     APIC_LVT_CMCI   = 0x2f0,// (R/W) LVT corrected machine check interrupt
     APIC_ICR        = 0x300,// (R/W) Interrupt command register
+    APIC_ICR_HI     = 0x310,// (R/W) Interrupt command register (destination)
     APIC_LVT_TR     = 0x320,// (R/W) LVT timer register
     APIC_LVT_TSR    = 0x330,// (R/W) LVT thermal sensor register
     APIC_LVT_PMCR   = 0x340,// (R/W) LVT performance monitoring counters register
@@ -60,6 +62,7 @@ enum {
     APIC_ESR_IDX        = 0x280 >> 2,// (R)   Error status register
     APIC_LVT_CMCI_IDX   = 0x2f0 >> 2,// (R/W) LVT corrected machine check interrupt
     APIC_ICR_IDX        = 0x300 >> 2,// (R/W) Interrupt command register
+    APIC_ICR_HI_IDX     = 0x310 >> 2,// (R/W) Interrupt command register (destination)
     APIC_LVT_TR_IDX     = 0x320 >> 2,// (R/W) LVT timer register
     APIC_LVT_TSR_IDX    = 0x330 >> 2,// (R/W) LVT thermal sensor register
     APIC_LVT_PMCR_IDX   = 0x340 >> 2,// (R/W) LVT performance monitoring counters register
@@ -87,15 +90,27 @@ enum {
     APIC_TIMER_TSC_DEADLINE = 2, // Use TSC_DEADLINE_MSR for timing
 };
 
+// TSC cycles to measure the APIC timer against during calibration
+#define APIC_TIMER_CALIBRATE_TSC    ((uint64_t)1 << 24)
+
 // APIC interrupt delivery constants
 enum {
     APIC_DELIVER_FIXED  = 0,
     APIC_DELIVER_SMI    = 2,
     APIC_DELIVER_NMI    = 4,
     APIC_DELIVER_INIT   = 5,
+    APIC_DELIVER_STARTUP= 6,
     APIC_DELIVER_EXTINT = 7,
 };
 
+// APIC IPI destination shorthand constants
+enum {
+    APIC_DEST_FIELD     = 0,    // APIC ID in APIC_ICR_HI
+    APIC_DEST_SELF      = 1,
+    APIC_DEST_ALL       = 2,
+    APIC_DEST_OTHERS    = 3,    // All excluding self
+};
+
 typedef struct {
     uint64_t    _reserved0  : 8;
     uint64_t    bsp         : 1;
@@ -152,6 +167,20 @@ typedef union {
         uint32_t    _reserved1      : 13;
     } lvt;
 
+    // Interrupt command register (low half)
+    struct {
+        uint32_t    vector          : 8;
+        uint32_t    delivery        : 3; // See APIC interrupt delivery constants
+        uint32_t    logical         : 1; // Destination mode (0: APIC ID)
+        uint32_t    delivery_status : 1; // Whether the IPI is still being sent
+        uint32_t    _reserved0      : 1;
+        uint32_t    assert          : 1; // Level (0 only for INIT de-assert)
+        uint32_t    trigger_mode    : 1;
+        uint32_t    _reserved1      : 2;
+        uint32_t    shorthand       : 2; // See APIC destination shorthand constants
+        uint32_t    _reserved2      : 12;
+    } icr;
+
     // APIC timer divide register
     struct {
         uint32_t    divide      : 4;
@@ -165,5 +194,11 @@ typedef union {
 void apic_init(void);
 void lapic_send_eoi(void);
 apic_lvt_reg_t lapic_get_esr(void);
+uint8_t lapic_get_id(void);
+void lapic_init_ap(void);
+void lapic_send_ipi(uint8_t apic_id, apic_lvt_reg_t icr);
+void lapic_timer_deadline(uint64_t tsc);
+void lapic_timer_oneshot(uint64_t cycles);
+void lapic_timer_stop(void);
 
 #endif // _KERNEL_APIC_H
@@ -36,6 +36,17 @@ typedef union {
     uint32_t raw;
 } flags_reg_t;
 
+// Control register bits
+enum {
+    CR0_MP          = 1 << 1,   // Monitor coprocessor (wait obeys TS)
+    CR0_EM          = 1 << 2,   // x87 emulation (FPU instructions fault)
+    CR0_TS          = 1 << 3,   // Task switched (FPU instructions fault)
+    CR0_NE          = 1 << 5,   // Native x87 error reporting
+    CR4_PSE         = 1 << 4,   // Page size extension (4 MiB pages)
+    CR4_OSFXSR      = 1 << 9,   // fxsave, fxrstor and SSE enabled
+    CR4_OSXMMEXCPT  = 1 << 10,  // SIMD floating-point exceptions enabled
+};
+
 static inline void die(void)
 {
     // Place system into infinite loop
@@ -81,6 +92,22 @@ static inline reg_t get_cr0(void)
     return val;
 }
 
+static inline void set_cr0(reg_t val)
+{
+    asm volatile (
+        "movl %[val], %%cr0\n\t"
+        : // No outputs
+        : [val] "r" (val)
+        : // No clobbers
+    );
+}
+
+// Clear CR0.TS
+static inline void clts(void)
+{
+    asm volatile ("clts\n\t");
+}
+
 // NOTE: CR1 is reserved and any access throws an exception
 static inline reg_t get_cr1(void)
 {
@@ -140,6 +167,55 @@ static inline reg_t get_cr4(void)
     return val;
 }
 
+static inline void set_cr4(reg_t val)
+{
+    asm volatile (
+        "movl %[val], %%cr4\n\t"
+        : // No outputs
+        : [val] "r" (val)
+        : // No clobbers
+    );
+}
+
+// Save x87, MMX and SSE state to a 16-byte aligned 512-byte area
+static inline void fxsave(void *area)
+{
+    asm volatile (
+        "fxsave %[area]\n\t"
+        : [area] "=m" (*(uint8_t (*)[512])area)
+        : // No inputs
+        : // No clobbers
+    );
+}
+
+// Restore x87, MMX and SSE state from a 16-byte aligned 512-byte area
+static inline void fxrstor(const void *area)
+{
+    asm volatile (
+        "fxrstor %[area]\n\t"
+        : // No outputs
+        : [area] "m" (*(const uint8_t (*)[512])area)
+        : // No clobbers
+    );
+}
+
+// Reset x87 state
+static inline void fninit(void)
+{
+    asm volatile ("fninit\n\t");
+}
+
+// Load SSE control and status register
+static inline void ldmxcsr(uint32_t mxcsr)
+{
+    asm volatile (
+        "ldmxcsr %[mxcsr]\n\t"
+        : // No outputs
+        : [mxcsr] "m" (mxcsr)
+        : // No clobbers
+    );
+}
+
 // Invalidate TLB entry
 static inline void invlpg(uintptr_t vma)
 {
@@ -151,6 +227,25 @@ static inline void invlpg(uintptr_t vma)
     );
 }
 
+// Serialize all preceding loads and stores
+static inline void mfence(void)
+{
+    asm volatile ("mfence\n\t" : : : "memory");
+}
+
+// Read time-stamp counter
+static inline uint64_t rdtsc(void)
+{
+    uint64_t val;
+    asm volatile (
+        "rdtsc\n\t"
+        : [val] "=A" (val)
+        : // No inputs
+        : // No clobbers
+    );
+    return val;
+}
+
 // Get stack pointer
 static inline reg_t get_sp(void)
 {
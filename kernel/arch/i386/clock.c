@@ -0,0 +1,126 @@
+/**
+ * clock.c: Time-stamp counter calibration and monotonic clock
+ *
+ * The TSC frequency is measured once at boot against channel 2 of the PIT,
+ * whose input clock has the same frequency on every PC. Channel 2 is used
+ * because its gate and output can be controlled and polled through port 0x61
+ * without any interrupt. The LAPIC timer is calibrated against the TSC (see
+ * apic.c), so both can be programmed in microseconds.
+ *
+ * The monotonic clock counts nanoseconds since calibration. Cycles are
+ * converted with a multiplication and a shift (ns = cycles * mult >> shift)
+ * rather than a 64-bit division, so reading the clock costs little more than
+ * the rdtsc instruction itself.
+ */
+
+#include "asm.h"
+#include "clock.h"
+#include "io.h"
+
+static uint32_t clock_khz;      // TSC frequency in kHz
+static uint64_t clock_base;     // TSC at time zero of the monotonic clock
+static uint32_t clock_mult;     // Nanoseconds per cycle, scaled by 2^clock_shift
+static uint32_t clock_shift;
+
+// Return TSC cycles elapsed while PIT channel 2 counts down latch periods
+static uint64_t clock_pit_measure(uint16_t latch)
+{
+    // Enable gate of channel 2, disconnect speaker
+    const uint8_t gate = inb(CLOCK_PIT_PORT_GATE);
+    outb(CLOCK_PIT_PORT_GATE, (gate & ~CLOCK_PIT_SPEAKER) | CLOCK_PIT_GATE_CH2);
+
+    // Channel 2, low byte then high byte, mode 0 (the output goes high on
+    // terminal count), binary
+    outb(CLOCK_PIT_PORT_CMD, 0xb0);
+    outb(CLOCK_PIT_PORT_CH2, latch & 0xff);
+    outb(CLOCK_PIT_PORT_CH2, latch >> 8);
+
+    const uint64_t start = rdtsc();
+    while (!(inb(CLOCK_PIT_PORT_GATE) & CLOCK_PIT_OUT_CH2))
+        ;
+    const uint64_t cycles = rdtsc() - start;
+
+    outb(CLOCK_PIT_PORT_GATE, gate);
+    return cycles;
+}
+
+// Calibrate the TSC against the PIT
+// NOTE: must be called with interrupts disabled
+void clock_init(void)
+{
+    const uint16_t latch = CLOCK_PIT_HZ * CLOCK_CALIBRATE_MS / 1000;
+
+    // Interrupts (e.g. SMIs) can only make a run longer
+    uint64_t cycles = UINT64_MAX;
+    for (size_t i = 0; i < CLOCK_CALIBRATE_RUNS; i++) {
+        const uint64_t c = clock_pit_measure(latch);
+        if (c < cycles)
+            cycles = c;
+    }
+
+    clock_khz = cycles * CLOCK_PIT_HZ / ((uint64_t)latch * 1000);
+    if (!clock_khz) {
+        printk("clock_init: FATAL: TSC is not running\n");
+        die();
+    }
+
+    // Use the largest shift (i.e. the most precise factor) that keeps the
+    // factor within 32 bits
+    const uint64_t ns_per_ms = 1000000;
+    clock_shift = 32;
+    while (clock_shift && (ns_per_ms << clock_shift) / clock_khz > UINT32_MAX)
+        clock_shift--;
+    clock_mult = (ns_per_ms << clock_shift) / clock_khz;
+    clock_base = rdtsc();
+
+    printk("clock_init: TSC: %u kHz (mult: %u, shift: %u)\n",
+           clock_khz, clock_mult, clock_shift);
+}
+
+// Convert TSC cycles to nanoseconds
+uint64_t clock_tsc_to_ns(uint64_t cycles)
+{
+    return clock_scale_ns(cycles, clock_mult, clock_shift);
+}
+
+// Return TSC at time zero of the monotonic clock and the factor and shift that
+// convert cycles to nanoseconds (published to processes, see vdso.c)
+void clock_get_params(uint64_t *base, uint32_t *mult, uint32_t *shift)
+{
+    *base = clock_base;
+    *mult = clock_mult;
+    *shift = clock_shift;
+}
+
+// Return nanoseconds since boot (monotonic)
+uint64_t clock_get_ns(void)
+{
+    return clock_tsc_to_ns(rdtsc() - clock_base);
+}
+
+// Busy-wait for (at least) us microseconds
+void clock_delay_us(uint64_t us)
+{
+    const uint64_t start = rdtsc();
+    const uint64_t cycles = clock_us_to_tsc(us);
+    while (rdtsc() - start < cycles)
+        ;
+}
+
+// Return TSC frequency in kHz (TSC cycles per millisecond)
+uint32_t clock_tsc_khz(void)
+{
+    return clock_khz;
+}
+
+// Convert microseconds to TSC cycles
+uint64_t clock_us_to_tsc(uint64_t us)
+{
+    return us * clock_khz / 1000;
+}
+
+// Convert TSC cycles to microseconds
+uint64_t clock_tsc_to_us(uint64_t cycles)
+{
+    return cycles * 1000 / clock_khz;
+}
@@ -0,0 +1,45 @@
+/**
+ * clock.h: Time-stamp counter calibration and monotonic clock
+ */
+
+#ifndef _KERNEL_CLOCK_H
+#define _KERNEL_CLOCK_H
+
+#include "std.h"
+
+// PIT constants
+enum {
+    CLOCK_PIT_HZ            = 1193182,  // PIT input frequency
+    CLOCK_PIT_PORT_CH2      = 0x42,     // Channel 2 data port
+    CLOCK_PIT_PORT_CMD      = 0x43,     // Mode/command register
+    CLOCK_PIT_PORT_GATE     = 0x61,     // Channel 2 gate and output (and speaker)
+    CLOCK_PIT_GATE_CH2      = 0x01,     // Gate input of channel 2
+    CLOCK_PIT_SPEAKER       = 0x02,     // Connect channel 2 to the speaker
+    CLOCK_PIT_OUT_CH2       = 0x20,     // Output of channel 2
+};
+
+// Calibration constants
+enum {
+    CLOCK_CALIBRATE_MS      = 50,   // Length of a calibration run
+    CLOCK_CALIBRATE_RUNS    = 3,    // Number of runs (the shortest one counts)
+};
+
+// Convert TSC cycles to nanoseconds with factor mult and shift (see clock.c)
+static inline uint64_t clock_scale_ns(uint64_t cycles, uint32_t mult, uint32_t shift)
+{
+    // 64 x 32-bit product in two halves, so that it cannot overflow
+    const uint64_t lo = (uint64_t)(uint32_t)cycles * mult;
+    const uint64_t hi = (cycles >> 32) * mult;
+    return (hi << (32 - shift)) + (lo >> shift);
+}
+
+void clock_delay_us(uint64_t us);
+uint64_t clock_get_ns(void);
+void clock_get_params(uint64_t *base, uint32_t *mult, uint32_t *shift);
+void clock_init(void);
+uint32_t clock_tsc_khz(void);
+uint64_t clock_tsc_to_ns(uint64_t cycles);
+uint64_t clock_tsc_to_us(uint64_t cycles);
+uint64_t clock_us_to_tsc(uint64_t us);
+
+#endif // _KERNEL_CLOCK_H
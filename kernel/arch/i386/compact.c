@@ -0,0 +1,233 @@
+/**
+ * compact.c: Physical memory compaction
+ *
+ * Free frames end up scattered over physical memory, so a 4 MiB-aligned block
+ * of free frames (for a large page or a contiguous buffer) may not exist even
+ * when plenty of memory is free. A compaction pass counts the movable frames
+ * of every block, i.e. private user pages that can be copied elsewhere by
+ * rewriting a single page table entry. It then picks the block that needs the
+ * fewest migrations to become entirely free, isolates it so that page_new()
+ * no longer hands out its frames, and moves its user pages to frames outside
+ * of it. Kernel heap frames, page tables, shared (PAGE_COW) and physical
+ * (PAGE_DISABLE_CACHE) mappings are never moved.
+ *
+ * The idle loop keeps one assembled block in reserve while memory is
+ * plentiful (see compact_idle()). Blocks are consumed by large-page mappings
+ * (see vma_mmap()). Passes and the assembled block are serialised by
+ * compact_lock, which is taken before the locks of the address spaces.
+ */
+
+#include "asm.h"
+#include "clock.h"
+#include "compact.h"
+#include "io.h"
+#include "lock.h"
+#include "page.h"
+#include "proc.h"
+#include "smp.h"
+#include "string.h"
+#include "vma.h"
+
+static compact_stats_t compact_stats;
+static lock_ticket_t compact_lock;              // Serialises the state below
+static size_t compact_ready = PAGE_BLOCK_NONE;  // Assembled (isolated) block
+static uint64_t compact_last;                   // TSC at last background pass
+static size_t compact_movable[PAGE_BLOCKS];     // Movable frames per block
+
+// Return whether a page table entry maps a private user frame
+static inline bool compact_is_movable(page_entry_t entry)
+{
+    const page_entry_t mask = PAGE_COW | PAGE_DISABLE_CACHE | PAGE_PUBLIC
+                              | PAGE_PRESENT;
+    return (entry & mask) == (PAGE_PUBLIC | PAGE_PRESENT)
+           && (entry & ~(uintptr_t)0xfff) < PAGE_PHYS_LIMIT;
+}
+
+// Count movable frames per block (proc_for_each_page() callback)
+static void compact_count_page(pid_t pid, uintptr_t vma, page_entry_t *pte, void *arg)
+{
+    (void)pid;
+    (void)vma;
+    (void)arg;
+
+    const page_entry_t entry = *pte;
+    if (compact_is_movable(entry))
+        compact_movable[(entry & ~(uintptr_t)0xfff) / PAGE_BLOCK_SIZE]++;
+}
+
+// Move page out of the isolated block (proc_for_each_page() callback)
+static void compact_migrate_page(pid_t pid, uintptr_t vma, page_entry_t *pte, void *arg)
+{
+    const size_t block = *(size_t*)arg;
+
+    // The entries of pid only change with the lock of its address space held.
+    // The process may still run (and write to the page) whenever it is not
+    // held, so the page is copied and remapped atomically. Pages of a process
+    // running on another processor are left for the next pass.
+    const flags_reg_t flags = get_flags();
+    cli();
+    vma_lock(pid);
+    smp_lock_kernel();
+    if (!proc_hold(pid)) {
+        smp_unlock_kernel(get_flags());
+        vma_unlock(pid);
+        set_flags(flags);
+        return;
+    }
+    const page_entry_t entry = *pte;
+    const uintptr_t old_pma = entry & ~(uintptr_t)0xfff;
+    uintptr_t pma = 0;  // Not moved if memory is short (see page_new_user())
+    if (compact_is_movable(entry) && old_pma / PAGE_BLOCK_SIZE == block)
+        pma = page_new_user();
+    if (pma) {
+        page_copy(pma, old_pma);
+        page_set_pte(pte, vma, pma | (entry & 0xfff));
+        page_free_pma(old_pma);
+        compact_stats.pages_migrated++;
+    }
+    proc_release();
+    smp_unlock_kernel(get_flags());
+    vma_unlock(pid);
+    set_flags(flags);
+}
+
+/**
+ * Assemble a free block by migrating user frames
+ * NOTE: must be called with compact_lock held
+ * RETURN
+ *  true if a free block is ready to be taken by compact_alloc_block()
+ */
+static bool compact_run(void)
+{
+    if (compact_ready != PAGE_BLOCK_NONE)
+        return true;
+
+    compact_stats.passes++;
+
+    memset(compact_movable, 0, sizeof(compact_movable));
+    for (pid_t pid = 1; pid < proc_get_pid_end(); pid++) {
+        if (proc_is_alive(pid))
+            proc_for_each_page(pid, &compact_count_page, NULL);
+    }
+
+    // Pick the block needing the fewest migrations
+    size_t block = PAGE_BLOCK_NONE;
+    for (size_t b = 0; b < PAGE_BLOCKS; b++) {
+        if (page_block_free(b) + compact_movable[b] < PAGE_BLOCK_FRAMES)
+            continue;
+        if (block == PAGE_BLOCK_NONE || compact_movable[b] < compact_movable[block])
+            block = b;
+    }
+    if (block == PAGE_BLOCK_NONE) {
+        compact_stats.passes_failed++;
+        return false;
+    }
+
+    flags_reg_t flags = smp_lock_kernel();
+    page_block_isolate(block);
+    smp_unlock_kernel(flags);
+
+    // Migrated pages need somewhere to go
+    if (page_frames_free() >= compact_movable[block]) {
+        for (pid_t pid = 1; pid < proc_get_pid_end(); pid++) {
+            if (proc_is_alive(pid))
+                proc_for_each_page(pid, &compact_migrate_page, &block);
+        }
+    }
+
+    // Pages may have been mapped into the block (or pinned by sharing) while
+    // the kernel lock was not held
+    flags = smp_lock_kernel();
+    if (page_block_free(block) == PAGE_BLOCK_FRAMES) {
+        compact_ready = block;
+    } else {
+        page_block_unisolate();
+        compact_stats.passes_failed++;
+    }
+    smp_unlock_kernel(flags);
+
+    return compact_ready != PAGE_BLOCK_NONE;
+}
+
+/**
+ * Allocate a free 4 MiB-aligned block of physical frames, compacting memory if
+ * none is available. Free the block with page_free_block().
+ * NOTE: must be called without the lock of any address space (see vma_lock())
+ * or the kernel lock
+ * RETURN
+ *  PMA of the block, or 0 on failure
+ */
+uintptr_t compact_alloc_block(void)
+{
+    uintptr_t pma = 0;
+
+    const flags_reg_t flags = lock_ticket_irqsave(&compact_lock);
+    compact_stats.block_requests++;
+
+    // The assembled block is taken first, so that the other blocks stay free
+    // for a later request
+    if (compact_ready == PAGE_BLOCK_NONE) {
+        smp_lock_kernel();
+        pma = page_new_block();
+        smp_unlock_kernel(get_flags());
+    }
+
+    if (!pma && compact_run()) {
+        smp_lock_kernel();
+        pma = page_block_take(compact_ready);
+        compact_ready = PAGE_BLOCK_NONE;
+        smp_unlock_kernel(get_flags());
+    }
+
+    if (pma)
+        compact_stats.block_success++;
+    lock_ticket_irqrestore(&compact_lock, flags);
+    return pma;
+}
+
+// Keep one free block assembled while memory is plentiful and give it back
+// to the page allocator when memory runs low (called from the idle loop)
+void compact_idle(void)
+{
+    const size_t frames = page_frames_free();
+    bool assembled = false;
+
+    const flags_reg_t flags = lock_ticket_irqsave(&compact_lock);
+    if (compact_ready != PAGE_BLOCK_NONE) {
+        if (frames < COMPACT_MIN_FREE) {
+            smp_lock_kernel();
+            page_block_unisolate();
+            compact_ready = PAGE_BLOCK_NONE;
+            smp_unlock_kernel(get_flags());
+        }
+        goto out;
+    }
+
+    // Nothing to do while untouched memory still holds whole blocks
+    const uint64_t now = rdtsc();
+    if (frames < COMPACT_MIN_FREE || page_blocks_untouched()
+        || now - compact_last < clock_us_to_tsc(COMPACT_INTERVAL_US))
+        goto out;
+
+    compact_last = now;
+    assembled = compact_run();
+
+out:
+    lock_ticket_irqrestore(&compact_lock, flags);
+    if (assembled)
+        compact_info();
+}
+
+// Print compaction statistics
+void compact_info(void)
+{
+    size_t rate = 0;    // Block allocation success rate in percent
+    if (compact_stats.block_requests)
+        rate = compact_stats.block_success * 100 / compact_stats.block_requests;
+
+    printk("compact_info: passes: %u (failed: %u), migrated: %u, "
+           "blocks: %u/%u (%u%%)\n",
+           compact_stats.passes, compact_stats.passes_failed,
+           compact_stats.pages_migrated, compact_stats.block_success,
+           compact_stats.block_requests, rate);
+}
@@ -0,0 +1,33 @@
+/**
+ * compact.h: Physical memory compaction
+ */
+
+#ifndef _KERNEL_COMPACT_H
+#define _KERNEL_COMPACT_H
+
+#include "page.h"
+#include "std.h"
+
+// Compaction constants
+enum {
+    COMPACT_MIN_FREE    = 2 * PAGE_BLOCK_FRAMES,    // Keep a block assembled only
+                                                    // above this many free frames
+};
+
+// Minimum microseconds between two background compaction passes
+#define COMPACT_INTERVAL_US 100000
+
+// Compaction statistics
+typedef struct {
+    size_t passes;              // Number of compaction passes
+    size_t passes_failed;       // Number of passes that did not free a block
+    size_t pages_migrated;      // Number of user frames moved
+    size_t block_requests;      // Number of calls to compact_alloc_block()
+    size_t block_success;       // Number of those that returned a block
+} compact_stats_t;
+
+uintptr_t compact_alloc_block(void);
+void compact_idle(void);
+void compact_info(void);
+
+#endif // _KERNEL_COMPACT_H
@@ -0,0 +1,117 @@
+/**
+ * fpu.c: Lazy x87/SSE context switching
+ *
+ * Processes start every time slice with CR0.TS set, so their first x87, MMX or
+ * SSE instruction raises #NM (see int_handle_device_not_available()). The
+ * handler clears TS and loads the state of the process into the FPU, unless
+ * the FPU of the processor still holds it. A process that used the FPU in its
+ * time slice has its state saved when it is switched out, so the saved copy is
+ * always current when the process is not running and it may resume on any
+ * processor. Processes that never touch the FPU pay for neither the save nor
+ * the restore, and get no save area.
+ */
+
+#include "alloc.h"
+#include "asm.h"
+#include "cpuid.h"
+#include "fpu.h"
+#include "io.h"
+#include "percpu.h"
+#include "proc.h"
+#include "smp.h"
+
+static bool fpu_enabled;            // Whether fxsave and fxrstor are supported
+static fpu_state_t fpu_initial;     // State of a process on its first FPU use
+
+// Enable the FPU and SSE on the calling processor (and leave TS set)
+static bool fpu_enable(void)
+{
+    cpuid_version_t ver;
+    cpuid_version(&ver);
+    if (!ver.fpu || !ver.fxsr)
+        return false;
+
+    set_cr0((get_cr0() & ~CR0_EM) | CR0_MP | CR0_NE);
+    set_cr4(get_cr4() | CR4_OSFXSR | (ver.sse ? CR4_OSXMMEXCPT : 0));
+    clts();
+    fninit();
+    if (ver.sse)
+        ldmxcsr(FPU_MXCSR_DEFAULT);
+    return true;
+}
+
+/**
+ * Enable the FPU on the BSP and record the state processes start with
+ * NOTE: must be called before processes are started
+ */
+void fpu_init(void)
+{
+    fpu_enabled = fpu_enable();
+    if (!fpu_enabled) {
+        // FPU instructions raise #NM, which halts
+        set_cr0(get_cr0() | CR0_EM);
+        printk("fpu_init: fxsave not supported, FPU disabled\n");
+        return;
+    }
+
+    fxsave(&fpu_initial);
+    set_cr0(get_cr0() | CR0_TS);
+}
+
+// Enable the FPU on an application processor
+void fpu_init_ap(void)
+{
+    if (fpu_enabled && fpu_enable())
+        set_cr0(get_cr0() | CR0_TS);
+    else
+        set_cr0(get_cr0() | CR0_EM);
+}
+
+/**
+ * Save the FPU state of prev if it used the FPU in its time slice, so that the
+ * next process traps on its first FPU instruction
+ * NOTE: called by the scheduler while switching prev out
+ */
+void fpu_switch(struct proc *prev)
+{
+    // TS is only cleared by fpu_fault(), i.e. for a process that used the FPU
+    const reg_t cr0 = get_cr0();
+    if (!fpu_enabled || cr0 & CR0_TS)
+        return;
+
+    fxsave(prev->fpu);
+    set_cr0(cr0 | CR0_TS);
+}
+
+/**
+ * Give the FPU to the current process (handles #NM)
+ * NOTE: must be called with interrupts disabled and the per-CPU segment loaded
+ * RETURN
+ *  false if the FPU is disabled
+ */
+bool fpu_fault(void)
+{
+    if (!fpu_enabled)
+        return false;
+
+    proc_t *curr = percpu_get(curr);
+    const size_t cpu = smp_cpu_id();
+    clts();
+
+    // The FPU still holds the state if no other process used it since
+    if (curr->fpu && curr->fpu_cpu == cpu && percpu_get(fpu_owner) == curr)
+        return true;
+
+    if (!curr->fpu) {
+        const flags_reg_t flags = smp_lock_kernel();
+        curr->fpu = kalloc(PAGE_GET_DEFAULT, _Alignof(fpu_state_t),
+                           sizeof(fpu_state_t));
+        smp_unlock_kernel(flags);
+        *curr->fpu = fpu_initial;
+    }
+
+    fxrstor(curr->fpu);
+    curr->fpu_cpu = cpu;
+    percpu_set(fpu_owner, curr);
+    return true;
+}
@@ -0,0 +1,27 @@
+/**
+ * fpu.h: Lazy x87/SSE context switching
+ */
+
+#ifndef _KERNEL_FPU_H
+#define _KERNEL_FPU_H
+
+#include "std.h"
+
+// FPU constants
+enum {
+    FPU_MXCSR_DEFAULT   = 0x1f80,   // All SIMD exceptions masked
+};
+
+// x87, MMX and SSE state saved by fxsave
+typedef struct __attribute__((aligned(16))) fpu_state {
+    uint8_t area[512];
+} fpu_state_t;
+
+struct proc;
+
+bool fpu_fault(void);
+void fpu_init(void);
+void fpu_init_ap(void);
+void fpu_switch(struct proc *prev);
+
+#endif // _KERNEL_FPU_H
@@ -15,14 +15,21 @@
  *
  * For official documentation on segment selectors, see Intel Software
  * Development Manual, Vol. 3A, section 3.4.1.
+ *
+ * Every processor has a GDT of its own. They only differ in the TSS, per-CPU
+ * data and processor index descriptors, so the same selectors work on every
+ * processor: a task register cannot share a TSS (loading it marks the TSS busy),
+ * GS selects the per-CPU data block of the processor (see percpu.h), and the
+ * limit of GDT_SEL_CPU tells user mode where it runs (see vdso.h).
  */
 
 #include "asm.h"
 #include "gdt.h"
+#include "percpu.h"
 
-static gdt_t GDT[GDT_IDX_LIMIT];    // Global Descriptor Table
-tss_t TSS = { 0 };                  // Task State Segment
-static uint64_t gdt_sel;
+static gdt_t GDT[SMP_CPUS_MAX][GDT_IDX_LIMIT];  // Global Descriptor Tables
+static tss_t TSS[SMP_CPUS_MAX];     // Task State Segment of each processor
+static uint64_t gdt_sel[SMP_CPUS_MAX];
 
 // Returns gdt descriptor
 static uint64_t gdt_descriptor(uint32_t base, uint32_t limit, uint16_t flags)
@@ -40,33 +47,67 @@ static uint64_t gdt_descriptor(uint32_t base, uint32_t limit, uint16_t flags)
     return descriptor;
 }
 
-/**
- * Initialize GDT
- */
-void gdt_init(void)
+// Load GDT, TSS, flat kernel segments and the per-CPU segment of cpu
+static void gdt_load(size_t cpu)
 {
-    // Create null descriptor
-    GDT[GDT_IDX_NULL] = gdt_descriptor(0, 0, 0);
-
-    // Open up entire 4GiB address space to rings 0 and 3
-    GDT[GDT_IDX_CODE_PL0] = gdt_descriptor(0, 0xfffff, GDT_CODE_PL0);
-    GDT[GDT_IDX_DATA_PL0] = gdt_descriptor(0, 0xfffff, GDT_DATA_PL0);
-    GDT[GDT_IDX_TSS_PL0]  = gdt_descriptor((uintptr_t)&TSS, sizeof(TSS), GDT_TSS_PL0);
-    GDT[GDT_IDX_CODE_PL3] = gdt_descriptor(0, 0xfffff, GDT_CODE_PL3);
-    GDT[GDT_IDX_DATA_PL3] = gdt_descriptor(0, 0xfffff, GDT_DATA_PL3);
-    GDT[GDT_IDX_TSS_PL3]  = gdt_descriptor((uintptr_t)&TSS, sizeof(TSS), GDT_TSS_PL3);
-
-    TSS.ss0  = GDT_SEL_DATA_PL0;
-    TSS.esp0 = (uintptr_t)0;
-
-    gdt_sel = ((uint64_t)(uintptr_t)&GDT << 16) | (uint64_t)sizeof(GDT);
-    load_gdt(&gdt_sel);
+    load_gdt(&gdt_sel[cpu]);
 
     set_cs(GDT_SEL_CODE_PL0);
     set_ds(GDT_SEL_DATA_PL0);
     set_es(GDT_SEL_DATA_PL0);
     set_fs(GDT_SEL_DATA_PL0);
-    set_gs(GDT_SEL_DATA_PL0);
+    set_gs(GDT_SEL_PERCPU);
     set_ss(GDT_SEL_DATA_PL0);
     set_tr(GDT_SEL_TSS_PL3);
 }
+
+/**
+ * Initialize GDT of every processor and load that of the BSP
+ * NOTE: must be called after percpu_init()
+ */
+void gdt_init(void)
+{
+    for (size_t cpu = 0; cpu < SMP_CPUS_MAX; cpu++) {
+        gdt_t *gdt = GDT[cpu];
+        const uintptr_t tss = (uintptr_t)&TSS[cpu];
+
+        // Create null descriptor
+        gdt[GDT_IDX_NULL] = gdt_descriptor(0, 0, 0);
+
+        // Open up entire 4GiB address space to rings 0 and 3
+        gdt[GDT_IDX_CODE_PL0] = gdt_descriptor(0, 0xfffff, GDT_CODE_PL0);
+        gdt[GDT_IDX_DATA_PL0] = gdt_descriptor(0, 0xfffff, GDT_DATA_PL0);
+        gdt[GDT_IDX_TSS_PL0]  = gdt_descriptor(tss, sizeof(TSS[cpu]), GDT_TSS_PL0);
+        gdt[GDT_IDX_CODE_PL3] = gdt_descriptor(0, 0xfffff, GDT_CODE_PL3);
+        gdt[GDT_IDX_DATA_PL3] = gdt_descriptor(0, 0xfffff, GDT_DATA_PL3);
+        gdt[GDT_IDX_TSS_PL3]  = gdt_descriptor(tss, sizeof(TSS[cpu]), GDT_TSS_PL3);
+        gdt[GDT_IDX_PERCPU]   = gdt_descriptor((uintptr_t)percpu_of(cpu),
+                                               sizeof(percpu_t) - 1, GDT_PERCPU);
+        gdt[GDT_IDX_CPU]      = gdt_descriptor(0, cpu, GDT_CPU);
+
+        TSS[cpu].ss0  = GDT_SEL_DATA_PL0;
+        TSS[cpu].esp0 = (uintptr_t)0;
+
+        gdt_sel[cpu] = ((uint64_t)(uintptr_t)gdt << 16) | (uint64_t)sizeof(GDT[cpu]);
+    }
+
+    gdt_load(0);
+}
+
+// Load GDT and TSS on an application processor (cpu > 0)
+void gdt_init_ap(size_t cpu)
+{
+    gdt_load(cpu);
+}
+
+// Return where the stack used by cpu for interrupts from user mode is kept
+uintptr_t * gdt_kernel_stack(size_t cpu)
+{
+    return (uintptr_t*)&TSS[cpu].esp0;
+}
+
+// Set stack used by cpu for interrupts from user mode
+void gdt_set_kernel_stack(size_t cpu, uintptr_t esp0)
+{
+    TSS[cpu].esp0 = esp0;
+}
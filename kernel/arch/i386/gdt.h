@@ -7,6 +7,7 @@
 #ifndef _KERNEL_GDT_H
 #define _KERNEL_GDT_H
 
+#include "smp.h"
 #include "std.h"
 
 /**
@@ -58,18 +59,23 @@ enum {
 };
 
 // Indexes into GDT
+// NOTE: sysexit derives the user code and stack selectors from the kernel code
+// selector, so the user descriptors must directly follow the kernel ones
 enum {
     GDT_IDX_NULL = 0,
     GDT_IDX_CODE_PL0,
     GDT_IDX_DATA_PL0,
-    GDT_IDX_TSS_PL0,
     GDT_IDX_CODE_PL3,
     GDT_IDX_DATA_PL3,
+    GDT_IDX_TSS_PL0,
     GDT_IDX_TSS_PL3,
+    GDT_IDX_PERCPU,     // Per-CPU data block (see percpu.h)
+    GDT_IDX_CPU,        // Processor index for user mode (see vdso.h)
     GDT_IDX_LIMIT,
 };
 
 // GDT selector constants
+// NOTE: GDT_SEL_PERCPU is repeated in int_asm.s
 enum {
     GDT_SEL_CODE_PL0 = (GDT_IDX_CODE_PL0 << 3) | 0,
     GDT_SEL_DATA_PL0 = (GDT_IDX_DATA_PL0 << 3) | 0,
@@ -77,6 +83,8 @@ enum {
     GDT_SEL_CODE_PL3 = (GDT_IDX_CODE_PL3 << 3) | 3,
     GDT_SEL_DATA_PL3 = (GDT_IDX_DATA_PL3 << 3) | 3,
     GDT_SEL_TSS_PL3  = (GDT_IDX_TSS_PL3  << 3) | 3,
+    GDT_SEL_PERCPU   = (GDT_IDX_PERCPU   << 3) | 0,
+    GDT_SEL_CPU      = (GDT_IDX_CPU      << 3) | 3,
 };
 
 // Constants for segment descriptor bits 43:40
@@ -127,6 +135,17 @@ enum {
                         SEG_SIZE(1) | SEG_GRAN(1) | SEG_PRIV(3) | \
                         SEG_DATA_W
 
+// Byte-granular, so that the limit is the size of the per-CPU data block
+#define GDT_PERCPU      SEG_PRES(1) | SEG_AVLS(0) | SEG_LONG(0) | \
+                        SEG_SIZE(1) | SEG_GRAN(0) | SEG_PRIV(0) | \
+                        SEG_DATA_W
+
+// Byte-granular and visible to user mode, whose lsl instruction reads the limit
+// (the processor index) without a system call
+#define GDT_CPU         SEG_PRES(1) | SEG_AVLS(0) | SEG_LONG(0) | \
+                        SEG_SIZE(1) | SEG_GRAN(0) | SEG_PRIV(3) | \
+                        SEG_DATA_
+
 #define GDT_TSS_PL0     SEG_PRES(1) | SEG_AVLS(0) | SEG_LONG(0) | \
                         SEG_SIZE(0) | SEG_GRAN(1) | SEG_PRIV(0) | \
                         SEG_SYS_TSS
@@ -186,9 +205,9 @@ typedef union {
     uint32_t raw;
 } gdt_sel_t;
 
-// TODO make this static and add routines to modify esp0, etc.
-extern tss_t TSS;       // Task State Segment
-
 void gdt_init(void);
+void gdt_init_ap(size_t cpu);
+uintptr_t * gdt_kernel_stack(size_t cpu);
+void gdt_set_kernel_stack(size_t cpu, uintptr_t esp0);
 
 #endif // _KERNEL_GDT_H
@@ -4,10 +4,18 @@
 
 #include "apic.h"
 #include "asm.h"
+#include "fpu.h"
 #include "gdt.h"
 #include "int.h"
 #include "io.h"
+#include "ksm.h"
+#include "mem.h"
+#include "percpu.h"
 #include "proc.h"
+#include "smp.h"
+#include "tlb.h"
+#include "vma.h"
+#include "zram.h"
 
 static idt_descriptor_t idt[IDT_SIZE];
 
@@ -114,8 +122,15 @@ INTERRUPT int_handle_invalid_opcode(interrupt_frame_t *frame)
 }
 
 // Interrupt 7
+// Raised by the first FPU instruction of a time slice (see fpu.c)
 INTERRUPT int_handle_device_not_available(interrupt_frame_t *frame)
 {
+    const uint16_t gs = percpu_enter();
+    const bool handled = fpu_fault();
+    percpu_leave(gs);
+    if (handled)
+        return;
+
     printk("Device Not Available Exception: ip: %p\n", frame->ip);
     halt();
 }
@@ -164,12 +179,53 @@ INTERRUPT int_handle_general_protection(interrupt_frame_t *frame, uintptr_t erro
 }
 
 // Interrupt 14
+// Resolve a user page fault that is part of normal operation
+static bool int_resolve_page_fault(error_code_page_t error, reg_t cr2)
+{
+    // Break copy-on-write sharing of merged pages
+    if (error.violation && error.write && ksm_cow_fault(cr2))
+        return true;
+
+    // Bring back pages swapped out to zram
+    if (!error.violation && zram_fault(cr2))
+        return true;
+
+    // Map pages of virtual memory areas on first access
+    return !error.violation && vma_fault(cr2, error.write);
+}
+
 INTERRUPT int_handle_page_fault(interrupt_frame_t *ctxt, uintptr_t error_raw)
 {
     error_code_page_t error = { .raw = error_raw };
 
     reg_t cr2 = get_cr2();
 
+    // Faults of a process are serialised by the lock of its address space
+    // (interrupts are already disabled). Faults of the kernel on user addresses
+    // (system calls reading memory checked by vma_access_ok()) are resolved
+    // alike. User mode runs with a flat GS, which the handlers need to find
+    // per-CPU data.
+    const bool user_space = error.user_mode || cr2 < KERNEL_START_VMA;
+    if (user_space) {
+        const uint16_t gs = percpu_enter();
+        const pid_t pid = proc_get_pid();
+        bool resolved = false;
+        if (proc_get_vmas(pid)) {
+            // Busy processors never run the idle loop that reclaims memory,
+            // so the fault reclaims it before it allocates a frame
+            if (page_frames_free() < ZRAM_LOW_WATERMARK)
+                zram_reclaim_direct();
+            vma_lock(pid);
+            resolved = int_resolve_page_fault(error, cr2);
+            vma_unlock(pid);
+        }
+        percpu_leave(gs);
+        if (resolved)
+            return;
+    }
+
+    if (user_space && page_frames_free() <= PAGE_RESERVE)
+        printk("PAGE FAULT: out of memory\n");
     if (error.user_mode) {
         printk("USER PAGE FAULT (%p): ip: %p, error: %p\n", cr2, ctxt->ip, error);
     } else {
@@ -184,6 +240,22 @@ INTERRUPT int_handle_page_fault(interrupt_frame_t *ctxt, uintptr_t error_raw)
     halt();
 }
 
+// Handle the TLB shootdown requests sent to this processor
+INTERRUPT int_handle_tlb(interrupt_frame_t *frame)
+{
+    (void)frame;
+    const uint16_t gs = percpu_enter();
+    tlb_poll();
+    lapic_send_eoi();
+    percpu_leave(gs);
+}
+
+// Spurious local APIC interrupts need no EOI and are ignored
+INTERRUPT int_handle_spurious(interrupt_frame_t *frame)
+{
+    (void)frame;
+}
+
 INTERRUPT int_handle_unknown(interrupt_frame_t *frame)
 {
     printk("UNKNOWN INTERRUPT! %p", frame);
@@ -204,6 +276,8 @@ idt_descriptor(void (*handler)(), reg_t sel, int type, int dpl)
 }
 
 void int_handle_proc_switch(void);  // See int_asm.s for implementation
+void int_handle_proc_yield(void);   // See int_asm.s for implementation
+void int_handle_syscall(void);      // See syscall_asm.s for implementation
 
 static void int_init_vectors(void)
 {
@@ -284,6 +358,23 @@ static void int_init_vectors(void)
             idt[i] = idt_descriptor(&int_handle_proc_switch, GDT_SEL_CODE_PL0,
                                     IDT_GATE_INTERRUPT32, RING0);
             break;
+        case IDT_VECTOR_YIELD:
+            idt[i] = idt_descriptor(&int_handle_proc_yield, GDT_SEL_CODE_PL0,
+                                    IDT_GATE_INTERRUPT32, RING0);
+            break;
+        case IDT_VECTOR_TLB:
+            idt[i] = idt_descriptor(&int_handle_tlb, GDT_SEL_CODE_PL0,
+                                    IDT_GATE_INTERRUPT32, RING0);
+            break;
+        case IDT_VECTOR_SYSCALL:
+            // Processes may raise it with int 0x80
+            idt[i] = idt_descriptor(&int_handle_syscall, GDT_SEL_CODE_PL0,
+                                    IDT_GATE_INTERRUPT32, RING3);
+            break;
+        case IDT_VECTOR_SPURIOUS:
+            idt[i] = idt_descriptor(&int_handle_spurious, GDT_SEL_CODE_PL0,
+                                    IDT_GATE_INTERRUPT32, RING0);
+            break;
         default:
             idt[i] = idt_descriptor(&int_handle_unknown, GDT_SEL_CODE_PL0,
                                     IDT_GATE_INTERRUPT32, RING0);
@@ -315,3 +406,9 @@ void int_init(void)
     int_init_vectors();
     int_load_idt();
 }
+
+// Load the IDT built by int_init() on an application processor
+void int_init_ap(void)
+{
+    int_load_idt();
+}
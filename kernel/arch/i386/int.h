@@ -15,7 +15,11 @@ enum {
 
 // IDT vector constants
 enum {
-    IDT_VECTOR_TIMER = 65,
+    IDT_VECTOR_TIMER = 65,      // Local APIC timer and rescheduling IPI
+    IDT_VECTOR_TLB = 66,        // TLB shootdown request (see tlb.c)
+    IDT_VECTOR_YIELD = 67,      // Scheduler entry by int (see proc_schedule())
+    IDT_VECTOR_SYSCALL = 0x80,  // System call (see syscall.h)
+    IDT_VECTOR_SPURIOUS = 255,  // Local APIC spurious interrupt
 };
 
 // Interrupt descriptor type constants
@@ -146,5 +150,6 @@ typedef union
 } error_code_page_t;
 
 void int_init(void);
+void int_init_ap(void);
 
 #endif // _KERNEL_INTERRUPT_H
@@ -1,61 +1,105 @@
 # int.s: ASM routines for interrupt handling
 
+# NOTE: must match GDT_SEL_PERCPU in gdt.h
+.set PERCPU_SEL, 0x38
+
+# Save the interrupted context as a proc_ctxt_t on the kernel stack of the
+# current process (which the processor switched to through TSS.esp0 if the
+# process was interrupted in user mode), where it stays while the process is
+# switched out, and load the per-CPU segment (user mode runs with a flat GS)
+.macro int_save_ctxt
+    # Save context (in reverse order of proc_ctxt_t)
+    pushl   %edi
+    pushl   %esi
+    pushl   %ebp
+    pushl   %ebx
+    pushl   %edx
+    pushl   %ecx
+    pushl   %eax
+    xorl    %eax, %eax
+    movw    %gs, %ax
+    pushl   %eax
+    movw    %fs, %ax
+    pushl   %eax
+    movw    %es, %ax
+    pushl   %eax
+    movw    %ds, %ax
+    pushl   %eax
+
+    movw    $PERCPU_SEL, %ax
+    movw    %ax, %gs
+.endm
+
+# Enter the scheduler from the local APIC timer or a rescheduling IPI. Both are
+# acknowledged right away: the processor may leave on the stack of another
+# process, and interrupts stay disabled until the iret anyway.
 .globl  int_handle_proc_switch
 .type   int_handle_proc_switch, @function
 int_handle_proc_switch:
-
-    # Save context
-    movl    %edi,  -4(%esp)
-    movl    %esi,  -8(%esp)
-    movl    %ebp, -12(%esp)
-    movl    %ebx, -16(%esp)
-    movl    %edx, -20(%esp)
-    movl    %ecx, -24(%esp)
-    movl    %eax, -28(%esp)
-    movl    $0,   -32(%esp)
-    movl    $0,   -36(%esp)
-    movl    $0,   -40(%esp)
-    movl    $0,   -44(%esp)
-    movw    %gs,  -32(%esp)
-    movw    %fs,  -36(%esp)
-    movw    %es,  -40(%esp)
-    movw    %ds,  -44(%esp)
-
-    # Setup function parameter (pointer to above proc_frame_t)
-    leal    -44(%esp), %eax
-    movl    %eax, -48(%esp)
-
-    # Update stack pointer
-    subl    $48, %esp
-
-    # TODO move proc_store_ctxt() and proc_load_ctxt() inside proc_next()?
-    # Store current process context
-    call proc_store_ctxt
-
-    # Switch to next process
-    call proc_next
-
-    # Load next process context
-    call proc_load_ctxt
+    int_save_ctxt
 
     # Signal End Of Interrupt
-    call lapic_send_eoi
-
-    # Restore stack pointer
-    addl    $48, %esp
-
-    # Load new process context
-    movl    -4(%esp), %edi
-    movl    -8(%esp), %esi
-    movl   -12(%esp), %ebp
-    movl   -16(%esp), %ebx
-    movl   -20(%esp), %edx
-    movl   -24(%esp), %ecx
-    movl   -28(%esp), %eax
-    movw   -32(%esp),  %gs
-    movw   -36(%esp),  %fs
-    movw   -40(%esp),  %es
-    movw   -44(%esp),  %ds
+    call    lapic_send_eoi
+    jmp     int_proc_next
+
+# Enter the scheduler from the kernel (see proc_schedule()). The software
+# interrupt does not go through the local APIC, so it must not be acknowledged:
+# an EOI would retire the highest priority interrupt in service instead.
+.globl  int_handle_proc_yield
+.type   int_handle_proc_yield, @function
+int_handle_proc_yield:
+    int_save_ctxt
+
+int_proc_next:
+    # Switch to next process (pointer to above proc_ctxt_t as parameter). It
+    # returns on the kernel stack of the next process.
+    pushl   %esp
+    call    proc_next
+    addl    $4, %esp
+
+int_return_proc:
+    # Load context of the (next) process
+    popl    %ds
+    popl    %es
+    popl    %fs
+    popl    %gs
+    popl    %eax
+    popl    %ecx
+    popl    %edx
+    popl    %ebx
+    popl    %ebp
+    popl    %esi
+    popl    %edi
 
     # Return from interrupt
     iret
+
+# First code run on the kernel stack of a new process (see proc_stack_init()),
+# which holds the proc_ctxt_t to start the process with
+.globl  proc_start
+.type   proc_start, @function
+proc_start:
+    call    proc_finish_switch
+    jmp     int_return_proc
+
+# void proc_switch_stack(uintptr_t *prev_sp, uintptr_t next_sp)
+# Save callee-saved registers and the stack pointer to *prev_sp and continue
+# where next_sp was saved (or at proc_start)
+.globl  proc_switch_stack
+.type   proc_switch_stack, @function
+proc_switch_stack:
+    movl    4(%esp), %eax
+    movl    8(%esp), %edx
+
+    pushl   %ebp
+    pushl   %ebx
+    pushl   %esi
+    pushl   %edi
+    movl    %esp, (%eax)
+
+    movl    %edx, %esp
+    popl    %edi
+    popl    %esi
+    popl    %ebx
+    popl    %ebp
+    ret
@@ -20,6 +20,8 @@
 ssize_t printk(const char *format, ... );
 // Variant for init section
 ssize_t init_printk(const char *format, ... );
+// Variant for the serial console (see serial.c)
+ssize_t serial_printk(const char *format, ... );
 
 static inline void outb(uint16_t port, uint8_t byte)
 {
@@ -32,6 +34,18 @@ static inline void outb(uint16_t port, uint8_t byte)
     );
 }
 
+static inline uint8_t inb(uint16_t port)
+{
+    uint8_t byte;
+    asm volatile (
+        "inb %1, %0\n\t"
+        : "=a" (byte)   // Use al
+        : "Nd" (port)   // Use 8-bit immediate or dx
+        : // No clobbers
+    );
+    return byte;
+}
+
 // TODO will this work in general?
 static inline void io_wait(void)
 {
@@ -5,14 +5,23 @@
 #include "alloc.h"
 #include "apic.h"
 #include "asm.h"
+#include "clock.h"
 #include "cpuid.h"
+#include "fpu.h"
 #include "gdt.h"
 #include "int.h"
 #include "io.h"
+#include "lock.h"
 #include "page.h"
+#include "percpu.h"
 #include "proc.h"
+#include "serial.h"
+#include "smp.h"
 #include "std.h"
+#include "syscall.h"
+#include "vdso.h"
 #include "vga.h"
+#include "zram.h"
 
 // Run unit tests
 // TODO generate / return return error codes
@@ -21,6 +30,27 @@ static void kernel_test(void)
     kmalloc_test();
 }
 
+// Run the benchmark selected with BENCH in make.config (results are printed
+// while the scheduler runs)
+static void kernel_bench(void)
+{
+#ifdef CONFIG_BENCH_SCHED
+    proc_bench_sched(PROC_BENCH_PROCS);
+#endif
+#ifdef CONFIG_BENCH_LOCK
+    lock_bench();
+#endif
+#ifdef CONFIG_BENCH_PINGPONG
+    proc_bench_pingpong();
+#endif
+#ifdef CONFIG_BENCH_SYSCALL
+    syscall_bench();
+#endif
+#ifdef CONFIG_BENCH_VDSO
+    vdso_bench();
+#endif
+}
+
 /**
  * Kernel main method
  */
@@ -32,11 +62,20 @@ void kernel_main(void)
      * must be configured and loaded before the IDT
      */
     vga_clear();
+    serial_init();
+    percpu_init();
     gdt_init();
     int_init();
+    syscall_init();
+    fpu_init();
     page_init_cleanup();
+    zram_init();
+    clock_init();
+    vdso_init();
     apic_init();
+    smp_init();
     proc_init();
+    kernel_bench();
     proc_loop();
 
     char id_str[3 * sizeof(reg_t) + 1];
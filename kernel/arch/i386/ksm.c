@@ -0,0 +1,353 @@
+/**
+ * ksm.c: Kernel same-page merging
+ *
+ * The scanner runs from the idle loop (PID 0) and visits one process per call.
+ * Each eligible user page is hashed and compared against frames that are
+ * already shared (stable) and against pages hashed earlier in the same pass
+ * (candidates). Identical pages are collapsed onto a single read-only frame
+ * flagged PAGE_COW; a write fault on such a page gives the writer a private
+ * copy again (see ksm_cow_fault()).
+ *
+ * Hashing and comparing run without locks. Only pages that match take the
+ * lock of the address space, the kernel lock and the run queues (see
+ * ksm_merge_locked()) to be rechecked and merged.
+ */
+
+#include "alloc.h"
+#include "asm.h"
+#include "io.h"
+#include "ksm.h"
+#include "page.h"
+#include "proc.h"
+#include "smp.h"
+#include "string.h"
+#include "vma.h"
+
+static ksm_frame_t *ksm_by_hash[KSM_BUCKETS];           // Frames by content hash
+static ksm_frame_t *ksm_by_pma[KSM_BUCKETS];            // Frames by PMA
+static ksm_candidate_t ksm_candidates[KSM_CANDIDATES];  // Unmerged pages
+static ksm_stats_t ksm_stats;
+static pid_t ksm_cursor = 1;                            // Next PID to scan
+static size_t ksm_reported_sharing;                     // Last reported sharing
+
+// FNV-1a hash of page contents (32-bit words)
+static uint32_t ksm_hash(const uint32_t *page)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(*page); i++) {
+        hash ^= page[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline size_t ksm_pma_bucket(uintptr_t pma)
+{
+    return (pma >> 12) & (KSM_BUCKETS - 1);
+}
+
+// Return shared frame at pma, or NULL if pma is not shared
+static ksm_frame_t * ksm_frame_find(uintptr_t pma)
+{
+    ksm_frame_t *f = ksm_by_pma[ksm_pma_bucket(pma)];
+    while (f && f->pma != pma)
+        f = f->next_pma;
+    return f;
+}
+
+static void ksm_frame_insert(ksm_frame_t *frame)
+{
+    ksm_frame_t **hash_head = &ksm_by_hash[frame->hash & (KSM_BUCKETS - 1)];
+    ksm_frame_t **pma_head = &ksm_by_pma[ksm_pma_bucket(frame->pma)];
+    frame->next_hash = *hash_head;
+    frame->next_pma = *pma_head;
+    *hash_head = frame;
+    *pma_head = frame;
+    ksm_stats.pages_shared++;
+}
+
+static void ksm_frame_remove(ksm_frame_t *frame)
+{
+    ksm_frame_t **f = &ksm_by_hash[frame->hash & (KSM_BUCKETS - 1)];
+    while (*f != frame)
+        f = &(*f)->next_hash;
+    *f = frame->next_hash;
+
+    f = &ksm_by_pma[ksm_pma_bucket(frame->pma)];
+    while (*f != frame)
+        f = &(*f)->next_pma;
+    *f = frame->next_pma;
+
+    kfree(frame);
+    ksm_stats.pages_shared--;
+}
+
+// Return whether two physical pages have identical contents
+// NOTE: must be called with interrupts disabled
+static bool ksm_same(uintptr_t pma_a, uintptr_t pma_b)
+{
+    const void *a = page_map_window(PAGE_WINDOW_SRC, pma_a);
+    const void *b = page_map_window(PAGE_WINDOW_DST, pma_b);
+    bool same = !memcmp(a, b, PAGE_SIZE);
+    page_unmap_window(PAGE_WINDOW_DST);
+    page_unmap_window(PAGE_WINDOW_SRC);
+    return same;
+}
+
+// Return whether a page table entry maps a private, writable user page
+// (physical mappings are uncached, see vma.c)
+static inline bool ksm_mergeable(page_entry_t entry)
+{
+    const page_entry_t mask = PAGE_COW | PAGE_DISABLE_CACHE | PAGE_PUBLIC
+                              | PAGE_WRITE | PAGE_PRESENT;
+    return (entry & mask) == (PAGE_PUBLIC | PAGE_WRITE | PAGE_PRESENT);
+}
+
+// Turn page table entry into a read-only copy-on-write mapping of frame
+static void ksm_share(page_entry_t *pte, uintptr_t vma, ksm_frame_t *frame)
+{
+    const page_entry_t flags = (*pte & 0xfff & ~PAGE_WRITE) | PAGE_COW;
+    page_set_pte(pte, vma, frame->pma | flags);
+    frame->refs++;
+}
+
+// Compare two physical pages without holding any lock (see ksm_merge_page())
+static bool ksm_same_unlocked(uintptr_t pma_a, uintptr_t pma_b)
+{
+    const flags_reg_t flags = get_flags();
+    cli();
+    const bool same = ksm_same(pma_a, pma_b);
+    set_flags(flags);
+    return same;
+}
+
+/**
+ * Merge the page of pid at vma (frame pma with contents hash) with the shared
+ * frame at stable or, if stable is 0, with candidate c. The entries of pid only
+ * change with the lock of its address space held, and the process may write to
+ * the page whenever it runs, so the entry and contents are rechecked with the
+ * process held (see proc_hold()). Pages of a process running on another
+ * processor are left for the next pass.
+ * RETURN
+ *  true if the page was merged
+ */
+static bool ksm_merge_locked(pid_t pid, uintptr_t vma, page_entry_t *pte,
+                             uintptr_t pma, uint32_t hash, uintptr_t stable,
+                             const ksm_candidate_t *c)
+{
+    bool merged = false;
+
+    const flags_reg_t flags = get_flags();
+    cli();
+    vma_lock(pid);
+    smp_lock_kernel();
+    if (!proc_hold(pid))
+        goto unlock;
+
+    if (!ksm_mergeable(*pte) || (*pte & ~(uintptr_t)0xfff) != pma)
+        goto out;
+
+    ksm_frame_t *frame;
+    if (stable) {
+        frame = ksm_frame_find(stable);
+        if (frame && frame->hash == hash && ksm_same(stable, pma)) {
+            ksm_share(pte, vma, frame);
+            page_free_pma(pma);
+            ksm_stats.pages_sharing++;
+            merged = true;
+        }
+        goto out;
+    }
+
+    // The address space of another process is only tried, since its lock is
+    // taken after ours
+    if (proc_is_running(c->pid) || (c->pid != pid && !vma_lock_try(c->pid)))
+        goto out;
+    if (ksm_mergeable(*c->pte) && (*c->pte & ~(uintptr_t)0xfff) == c->pma
+        && ksm_same(c->pma, pma)) {
+        frame = kmalloc(sizeof(*frame));
+        *frame = (ksm_frame_t) {
+            .hash = hash,
+            .pma = c->pma,
+            .refs = 0,
+        };
+        ksm_frame_insert(frame);
+        ksm_share(c->pte, c->vma, frame);
+        ksm_share(pte, vma, frame);
+        page_free_pma(pma);
+        ksm_stats.pages_sharing++;
+        merged = true;
+    }
+    if (c->pid != pid)
+        vma_unlock(c->pid);
+
+out:
+    proc_release();
+unlock:
+    smp_unlock_kernel(get_flags());
+    vma_unlock(pid);
+    set_flags(flags);
+    return merged;
+}
+
+// Try to merge a single user page (proc_for_each_page() callback)
+static void ksm_merge_page(pid_t pid, uintptr_t vma, page_entry_t *pte, void *arg)
+{
+    (void)arg;
+
+    const page_entry_t entry = __atomic_load_n(pte, __ATOMIC_RELAXED);
+    if (!ksm_mergeable(entry))
+        return;
+
+    // The page is hashed and compared without locks (interrupts are only
+    // disabled while the windows of the processor are in use). It may be
+    // written to or unmapped meanwhile, which at worst gives a wrong match, so
+    // only matches take the locks to be rechecked and merged. The frame is
+    // still readable after it has been freed.
+    const uintptr_t pma = entry & ~(uintptr_t)0xfff;
+    flags_reg_t flags = get_flags();
+    cli();
+    const uint32_t hash = ksm_hash(page_map_window(PAGE_WINDOW_SRC, pma));
+    page_unmap_window(PAGE_WINDOW_SRC);
+    set_flags(flags);
+    ksm_stats.pages_scanned++;
+
+    // Look for an identical shared frame. Shared frames are removed with the
+    // kernel lock held, so only the address of the frame is taken.
+    uintptr_t stable = 0;
+    flags = smp_lock_kernel();
+    for (const ksm_frame_t *f = ksm_by_hash[hash & (KSM_BUCKETS - 1)]; f;
+         f = f->next_hash) {
+        if (f->hash == hash) {
+            stable = f->pma;
+            break;
+        }
+    }
+    smp_unlock_kernel(flags);
+    if (stable && ksm_same_unlocked(stable, pma)) {
+        ksm_merge_locked(pid, vma, pte, pma, hash, stable, NULL);
+        return;
+    }
+
+    // Look for an identical page seen earlier in this pass (candidates are
+    // only used by the scanner). The candidate may have been remapped or
+    // written to since, which ksm_merge_locked() rechecks.
+    ksm_candidate_t *c = &ksm_candidates[hash & (KSM_CANDIDATES - 1)];
+    if (c->pte && c->pte != pte && c->hash == hash
+        && ksm_same_unlocked(c->pma, pma)
+        && ksm_merge_locked(pid, vma, pte, pma, hash, 0, c)) {
+        c->pte = NULL;
+        return;
+    }
+
+    *c = (ksm_candidate_t) {
+        .pte = pte,
+        .vma = vma,
+        .pma = pma,
+        .hash = hash,
+        .pid = pid,
+    };
+}
+
+// Scan the pages of the next user process
+void ksm_scan(void)
+{
+    if (ksm_cursor >= proc_get_pid_end()) {
+        ksm_cursor = 1;
+        ksm_stats.full_scans++;
+
+        // Candidates only live for a single pass
+        const flags_reg_t flags = smp_lock_kernel();
+        memset(ksm_candidates, 0, sizeof(ksm_candidates));
+        smp_unlock_kernel(flags);
+
+        if (ksm_stats.pages_sharing != ksm_reported_sharing) {
+            ksm_reported_sharing = ksm_stats.pages_sharing;
+            ksm_info();
+        }
+    }
+
+    const pid_t pid = ksm_cursor++;
+    if (proc_is_alive(pid))
+        proc_for_each_page(pid, &ksm_merge_page, NULL);
+}
+
+/**
+ * Handle write fault on a copy-on-write page of the current process
+ * NOTE: called from the page fault handler with the lock of the address space
+ * held (see vma_lock())
+ * RETURN
+ *  true if the fault was resolved, false if vma is not a KSM page
+ */
+bool ksm_cow_fault(uintptr_t vma)
+{
+    vma &= ~(uintptr_t)(PAGE_SIZE - 1);
+
+    if (!page_table_is_present(vma))
+        return false;
+
+    const page_entry_t entry = page_get_entry(vma);
+    if (!(entry & PAGE_PRESENT) || !(entry & PAGE_COW))
+        return false;
+
+    const uintptr_t shared_pma = entry & ~(uintptr_t)0xfff;
+    const page_entry_t flags = (entry & 0xfff & ~PAGE_COW) | PAGE_WRITE;
+
+    // Shared frames are mapped by other processes as well, so the frame table
+    // is only used with the kernel lock held
+    const flags_reg_t kernel = smp_lock_kernel();
+    ksm_frame_t *frame = ksm_frame_find(shared_pma);
+
+    if (frame && frame->refs > 1) {
+        // Give the writer a private copy
+        const uintptr_t pma = page_new_user();
+        if (!pma) {
+            smp_unlock_kernel(kernel);
+            return false;
+        }
+        page_copy(pma, shared_pma);
+        frame->refs--;
+        ksm_stats.pages_sharing--;
+        page_set_entry(vma, pma | flags);
+    } else {
+        // Last mapping of the frame takes it over
+        if (frame)
+            ksm_frame_remove(frame);
+        page_set_entry(vma, shared_pma | flags);
+    }
+    invlpg(vma);
+
+    ksm_stats.cow_breaks++;
+    smp_unlock_kernel(kernel);
+    return true;
+}
+
+/**
+ * Drop a user mapping of frame pma (e.g. on munmap) and free the frame once no
+ * other page table entry refers to it
+ * NOTE: must be called with interrupts disabled
+ */
+void ksm_release(uintptr_t pma)
+{
+    ksm_frame_t *frame = ksm_frame_find(pma);
+
+    if (frame && frame->refs > 1) {
+        frame->refs--;
+        ksm_stats.pages_sharing--;
+        return;
+    }
+    if (frame)
+        ksm_frame_remove(frame);
+    page_free_pma(pma);
+}
+
+// Print KSM statistics
+void ksm_info(void)
+{
+    printk("ksm_info: shared: %u, sharing: %u, saved: %u KiB, scanned: %u, "
+           "full scans: %u, cow breaks: %u\n",
+           ksm_stats.pages_shared, ksm_stats.pages_sharing,
+           ksm_stats.pages_sharing * (PAGE_SIZE / 1024),
+           ksm_stats.pages_scanned, ksm_stats.full_scans,
+           ksm_stats.cow_breaks);
+}
@@ -0,0 +1,50 @@
+/**
+ * ksm.h: Kernel same-page merging
+ */
+
+#ifndef _KERNEL_KSM_H
+#define _KERNEL_KSM_H
+
+#include "page.h"
+#include "proc.h"
+#include "std.h"
+
+// KSM constants
+enum {
+    KSM_BUCKETS     = 256,  // Hash buckets for merged (stable) frames
+    KSM_CANDIDATES  = 1024, // Slots for unmerged (unstable) candidate pages
+};
+
+// Shared read-only frame backing several copy-on-write user pages
+typedef struct ksm_frame {
+    struct ksm_frame *next_hash;    // Next frame in content hash bucket
+    struct ksm_frame *next_pma;     // Next frame in PMA bucket
+    uint32_t hash;                  // Hash of frame contents
+    uintptr_t pma;                  // Physical address of frame
+    size_t refs;                    // Number of page table entries mapping frame
+} ksm_frame_t;
+
+// Page seen once during the current scan pass (not yet merged)
+typedef struct {
+    page_entry_t *pte;              // Page table entry mapping the page
+    uintptr_t vma;                  // VMA of the page
+    uintptr_t pma;                  // PMA of the page when it was hashed
+    uint32_t hash;                  // Hash of page contents
+    pid_t pid;                      // Process the page belongs to
+} ksm_candidate_t;
+
+// KSM statistics
+typedef struct {
+    size_t pages_shared;            // Number of shared frames
+    size_t pages_sharing;           // Number of extra mappings to shared frames
+    size_t pages_scanned;           // Number of user pages hashed
+    size_t full_scans;              // Number of completed scan passes
+    size_t cow_breaks;              // Number of copy-on-write faults
+} ksm_stats_t;
+
+bool ksm_cow_fault(uintptr_t vma);
+void ksm_info(void);
+void ksm_release(uintptr_t pma);
+void ksm_scan(void);
+
+#endif // _KERNEL_KSM_H
@@ -0,0 +1,466 @@
+/**
+ * lock.c: Spinlocks
+ */
+
+#include "clock.h"
+#include "io.h"
+#include "lock.h"
+#include "proc.h"
+#include "smp.h"
+
+// Locks measured by lock_bench()
+enum {
+    LOCK_BENCH_TICKET = 0,
+    LOCK_BENCH_MCS,
+    LOCK_BENCH_READ,
+    LOCK_BENCH_WRITE,
+    LOCK_BENCH_KINDS,
+};
+
+static const char * const lock_bench_names[LOCK_BENCH_KINDS] = {
+    [LOCK_BENCH_TICKET] = "ticket",
+    [LOCK_BENCH_MCS] = "mcs",
+    [LOCK_BENCH_READ] = "rw (read)",
+    [LOCK_BENCH_WRITE] = "rw (write)",
+};
+
+// State of lock_bench()
+static size_t lock_bench_procs;             // Number of benchmark processes
+static atomic_uint lock_bench_next;         // Next index claimed by a process
+static atomic_uint lock_bench_arrived;      // Processes waiting at the barrier
+static atomic_uint lock_bench_phase;        // Incremented when all have arrived
+static lock_ticket_t lock_bench_ticket;
+static lock_mcs_t lock_bench_mcs;
+static lock_rw_t lock_bench_rw;
+static volatile uint32_t lock_bench_counter;    // Protected by the lock measured
+static uint64_t lock_bench_cycles[SMP_CPUS_MAX]; // Cycles taken by each process
+
+// Results of lock_bench() per lock, printed by lock_bench_report()
+static struct {
+    uint32_t alone;             // Cycles per acquisition by one process
+    uint32_t shared;            // Cycles per acquisition by all processes
+    uint32_t contended;         // Percentage of contended acquisitions
+    bool broken;                // Whether mutual exclusion failed
+} lock_bench_results[LOCK_BENCH_KINDS];
+static bool lock_bench_done;    // Whether the results are ready
+
+#ifdef CONFIG_LOCK_PROF
+static lock_stats_t *lock_prof_list;        // Locks named with lock_prof_add()
+static uint64_t lock_prof_last;             // TSC of last lock_prof_report()
+#endif
+
+/**
+ * Take MCS lock on behalf of call site (e.g. in a wrapper such as
+ * smp_lock_kernel()), queueing node (which must stay valid until the lock is
+ * released with the same node)
+ */
+void lock_mcs_at(lock_mcs_t *lock, lock_mcs_node_t *node, const void *site)
+{
+    const uint64_t start = lock_prof_begin();
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&node->locked, true, memory_order_relaxed);
+
+    lock_mcs_node_t *prev = atomic_exchange_explicit(&lock->tail, node,
+                                                     memory_order_acq_rel);
+    if (prev) {
+        // Wait for the previous waiter to hand over the lock
+        atomic_store_explicit(&prev->next, node, memory_order_release);
+        while (atomic_load_explicit(&node->locked, memory_order_acquire))
+            lock_relax();
+    }
+    lock_stats_acquired(&lock->stats, prev, start, site);
+}
+
+void lock_mcs(lock_mcs_t *lock, lock_mcs_node_t *node)
+{
+    lock_mcs_at(lock, node, LOCK_SITE);
+}
+
+void lock_mcs_unlock(lock_mcs_t *lock, lock_mcs_node_t *node)
+{
+    lock_stats_released(&lock->stats);
+
+    lock_mcs_node_t *next = atomic_load_explicit(&node->next, memory_order_acquire);
+    if (!next) {
+        // Nobody is waiting unless a waiter has queued itself in the meantime
+        lock_mcs_node_t *expected = node;
+        if (atomic_compare_exchange_strong_explicit(&lock->tail, &expected, NULL,
+                                                    memory_order_release,
+                                                    memory_order_relaxed))
+            return;
+
+        // Wait for that waiter to link itself to node
+        while (!(next = atomic_load_explicit(&node->next, memory_order_acquire)))
+            lock_relax();
+    }
+    atomic_store_explicit(&next->locked, false, memory_order_release);
+}
+
+// Disable interrupts and take MCS lock
+flags_reg_t lock_mcs_irqsave(lock_mcs_t *lock, lock_mcs_node_t *node)
+{
+    const flags_reg_t flags = get_flags();
+    cli();
+    lock_mcs_at(lock, node, LOCK_SITE);
+    return flags;
+}
+
+// Release MCS lock and restore the interrupt flag
+void lock_mcs_irqrestore(lock_mcs_t *lock, lock_mcs_node_t *node, flags_reg_t flags)
+{
+    lock_mcs_unlock(lock, node);
+    set_flags(flags);
+}
+
+// Take reader-writer lock for reading (readers wait while a writer holds the
+// lock or waits for it)
+void lock_read(lock_rw_t *lock)
+{
+    bool contended = false;
+    unsigned int state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    while (1) {
+        if (!(state & (LOCK_RW_WRITER | LOCK_RW_WAITING))) {
+            if (atomic_compare_exchange_weak_explicit(&lock->state, &state, state + 1,
+                                                      memory_order_acquire,
+                                                      memory_order_relaxed))
+                break;
+            continue;
+        }
+        contended = true;
+        lock_relax();
+        state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    }
+
+    // Readers share the lock, so they cannot count with plain increments
+    if (contended)
+        atomic_fetch_add_explicit(&lock->read_contended, 1, memory_order_relaxed);
+}
+
+void lock_read_unlock(lock_rw_t *lock)
+{
+    atomic_fetch_sub_explicit(&lock->state, 1, memory_order_release);
+}
+
+// Take reader-writer lock for writing on behalf of call site
+static void lock_write_at(lock_rw_t *lock, const void *site)
+{
+    const uint64_t start = lock_prof_begin();
+    bool contended = false;
+    unsigned int state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    while (1) {
+        // Take the lock once the readers and any other writer have left (which
+        // clears LOCK_RW_WAITING, so other waiting writers set it again)
+        if (!(state & ~LOCK_RW_WAITING)) {
+            if (atomic_compare_exchange_weak_explicit(&lock->state, &state,
+                                                      LOCK_RW_WRITER,
+                                                      memory_order_acquire,
+                                                      memory_order_relaxed))
+                break;
+            continue;
+        }
+        if (!(state & LOCK_RW_WAITING))
+            atomic_fetch_or_explicit(&lock->state, LOCK_RW_WAITING, memory_order_relaxed);
+        contended = true;
+        lock_relax();
+        state = atomic_load_explicit(&lock->state, memory_order_relaxed);
+    }
+
+    lock_stats_acquired(&lock->stats, contended, start, site);
+}
+
+void lock_write(lock_rw_t *lock)
+{
+    lock_write_at(lock, LOCK_SITE);
+}
+
+// Return whether reader-writer lock was taken for writing (without waiting
+// for it)
+bool lock_write_try(lock_rw_t *lock)
+{
+    const uint64_t start = lock_prof_begin();
+    unsigned int state = 0;
+    if (!atomic_compare_exchange_strong_explicit(&lock->state, &state,
+                                                 LOCK_RW_WRITER,
+                                                 memory_order_acquire,
+                                                 memory_order_relaxed))
+        return false;
+
+    lock_stats_acquired(&lock->stats, false, start, LOCK_SITE);
+    return true;
+}
+
+void lock_write_unlock(lock_rw_t *lock)
+{
+    lock_stats_released(&lock->stats);
+
+    // Keep LOCK_RW_WAITING of writers that queued up in the meantime
+    atomic_fetch_and_explicit(&lock->state, ~LOCK_RW_WRITER, memory_order_release);
+}
+
+// Disable interrupts and take reader-writer lock for reading
+flags_reg_t lock_read_irqsave(lock_rw_t *lock)
+{
+    const flags_reg_t flags = get_flags();
+    cli();
+    lock_read(lock);
+    return flags;
+}
+
+void lock_read_irqrestore(lock_rw_t *lock, flags_reg_t flags)
+{
+    lock_read_unlock(lock);
+    set_flags(flags);
+}
+
+// Disable interrupts and take reader-writer lock for writing
+flags_reg_t lock_write_irqsave(lock_rw_t *lock)
+{
+    const flags_reg_t flags = get_flags();
+    cli();
+    lock_write_at(lock, LOCK_SITE);
+    return flags;
+}
+
+void lock_write_irqrestore(lock_rw_t *lock, flags_reg_t flags)
+{
+    lock_write_unlock(lock);
+    set_flags(flags);
+}
+
+/**
+ * Name lock (given by its counters) for lock_prof_dump()
+ * NOTE: must be called before the lock is used by other processors
+ */
+void lock_prof_add(lock_stats_t *stats, const char *name)
+{
+#ifdef CONFIG_LOCK_PROF
+    stats->name = name;
+    stats->prof_next = lock_prof_list;
+    lock_prof_list = stats;
+#else
+    (void)stats;
+    (void)name;
+#endif
+}
+
+#ifdef CONFIG_LOCK_PROF
+// Return whether lock a ranks before lock b (more cycles spent waiting)
+static inline bool lock_prof_before(const lock_stats_t *a, const lock_stats_t *b)
+{
+    return a->wait > b->wait || (a->wait == b->wait && a > b);
+}
+#endif
+
+/**
+ * Print the n named locks with the most cycles spent waiting for them to the
+ * serial console, with the call site of the longest wait and the wait time
+ * histogram of each
+ * NOTE: counters of locks held elsewhere may be caught mid-update
+ */
+void lock_prof_dump(size_t n)
+{
+#ifdef CONFIG_LOCK_PROF
+    serial_printk("lock_prof_dump: wait and hold times in cycles (avg/max)\n");
+
+    // Select the next lock ranking after the previous one n times
+    const lock_stats_t *prev = NULL;
+    for (size_t i = 0; i < n; i++) {
+        const lock_stats_t *top = NULL;
+        for (const lock_stats_t *s = lock_prof_list; s; s = s->prof_next) {
+            if ((!prev || lock_prof_before(prev, s))
+                && (!top || lock_prof_before(s, top)))
+                top = s;
+        }
+        if (!top || !top->acquired)
+            break;
+
+        serial_printk("%u. %s (%p): %u acquired, %u contended, wait %u/%u at %p, "
+                      "hold %u/%u\n", i + 1, top->name, top, top->acquired,
+                      top->contended, (uint32_t)(top->wait / top->acquired),
+                      (uint32_t)top->wait_max, top->wait_max_site,
+                      (uint32_t)(top->hold / top->acquired), (uint32_t)top->hold_max);
+
+        // Wait time histogram (upper bound of each non-empty bucket)
+        serial_printk("   waits:");
+        for (size_t b = 0; b < LOCK_PROF_BUCKETS; b++) {
+            if (!top->wait_hist[b])
+                continue;
+            if (b == LOCK_PROF_BUCKETS - 1)
+                serial_printk(" more: %u", top->wait_hist[b]);
+            else
+                serial_printk(" <%u: %u", 2u << (b + LOCK_PROF_SHIFT), top->wait_hist[b]);
+        }
+        serial_printk("\n");
+        prev = top;
+    }
+#else
+    (void)n;
+    serial_printk("lock_prof_dump: lock profiling is disabled (see LOCKPROF)\n");
+#endif
+}
+
+// Dump the most contended locks every LOCK_PROF_DUMP_US (called by PID 0)
+void lock_prof_report(void)
+{
+#ifdef CONFIG_LOCK_PROF
+    const uint64_t now = rdtsc();
+    if (now - lock_prof_last < clock_us_to_tsc(LOCK_PROF_DUMP_US))
+        return;
+    lock_prof_last = now;
+    lock_prof_dump(LOCK_PROF_TOP);
+#endif
+}
+
+// Wait until every benchmark process has arrived
+static void lock_bench_barrier(void)
+{
+    const unsigned int phase = atomic_load_explicit(&lock_bench_phase,
+                                                    memory_order_acquire);
+    if (atomic_fetch_add_explicit(&lock_bench_arrived, 1, memory_order_acq_rel) + 1
+        == lock_bench_procs) {
+        atomic_store_explicit(&lock_bench_arrived, 0, memory_order_relaxed);
+        atomic_fetch_add_explicit(&lock_bench_phase, 1, memory_order_release);
+        return;
+    }
+    while (atomic_load_explicit(&lock_bench_phase, memory_order_acquire) == phase)
+        asm volatile ("pause\n\t");
+}
+
+// Acquire and release lock of kind LOCK_BENCH_ITERS times and return the
+// cycles it took
+static uint64_t lock_bench_run(size_t kind)
+{
+    lock_mcs_node_t node;
+    uint32_t value = 0;
+
+    const uint64_t start = rdtsc();
+    for (size_t i = 0; i < LOCK_BENCH_ITERS; i++) {
+        switch (kind) {
+        case LOCK_BENCH_TICKET:
+            lock_ticket(&lock_bench_ticket);
+            lock_bench_counter++;
+            lock_ticket_unlock(&lock_bench_ticket);
+            break;
+        case LOCK_BENCH_MCS:
+            lock_mcs(&lock_bench_mcs, &node);
+            lock_bench_counter++;
+            lock_mcs_unlock(&lock_bench_mcs, &node);
+            break;
+        case LOCK_BENCH_READ:
+            lock_read(&lock_bench_rw);
+            value += lock_bench_counter;
+            lock_read_unlock(&lock_bench_rw);
+            break;
+        case LOCK_BENCH_WRITE:
+            lock_write(&lock_bench_rw);
+            lock_bench_counter++;
+            lock_write_unlock(&lock_bench_rw);
+            break;
+        }
+    }
+    const uint64_t cycles = rdtsc() - start;
+
+    asm volatile ("" : : "r" (value));
+    return cycles;
+}
+
+// Return number of acquisitions of the lock of kind that had to wait
+static uint32_t lock_bench_contended(size_t kind)
+{
+    switch (kind) {
+    case LOCK_BENCH_TICKET:
+        return lock_bench_ticket.stats.contended;
+    case LOCK_BENCH_MCS:
+        return lock_bench_mcs.stats.contended;
+    case LOCK_BENCH_READ:
+        return atomic_load_explicit(&lock_bench_rw.read_contended, memory_order_relaxed);
+    default:
+        return lock_bench_rw.stats.contended;
+    }
+}
+
+// Benchmark process of lock_bench(): every lock is measured by the first
+// process alone and then by all of them at once. The processes run in user
+// mode, so the results are left for the idle loop to print (see
+// lock_bench_report()).
+static void lock_bench_proc(void)
+{
+    const size_t idx = atomic_fetch_add_explicit(&lock_bench_next, 1,
+                                                 memory_order_relaxed);
+
+    for (size_t kind = 0; kind < LOCK_BENCH_KINDS; kind++) {
+        if (!idx) {
+            lock_bench_counter = 0;
+            lock_bench_ticket.stats.contended = 0;
+            lock_bench_mcs.stats.contended = 0;
+            lock_bench_rw.stats.contended = 0;
+            atomic_store_explicit(&lock_bench_rw.read_contended, 0, memory_order_relaxed);
+        }
+        lock_bench_barrier();
+
+        uint64_t alone = 0;
+        if (!idx)
+            alone = lock_bench_run(kind);
+        lock_bench_barrier();
+
+        lock_bench_cycles[idx] = lock_bench_run(kind);
+        lock_bench_barrier();
+
+        if (idx)
+            continue;
+
+        uint64_t total = 0;
+        for (size_t i = 0; i < lock_bench_procs; i++)
+            total += lock_bench_cycles[i];
+
+        // Every write incremented the counter once
+        const uint32_t acquired = (lock_bench_procs + 1) * LOCK_BENCH_ITERS;
+        const uint32_t expected = kind == LOCK_BENCH_READ ? 0 : acquired;
+        lock_bench_results[kind].alone = alone / LOCK_BENCH_ITERS;
+        lock_bench_results[kind].shared = total / lock_bench_procs / LOCK_BENCH_ITERS;
+        lock_bench_results[kind].contended =
+            (uint64_t)lock_bench_contended(kind) * 100 / acquired;
+        lock_bench_results[kind].broken = lock_bench_counter != expected;
+    }
+    if (!idx)
+        __atomic_store_n(&lock_bench_done, true, __ATOMIC_RELEASE);
+
+    while (1) {
+        asm volatile ("pause\n\t");
+    }
+}
+
+/**
+ * Benchmark the cost of acquiring and releasing each kind of lock, without
+ * contention and with one process per processor contending for it. Results are
+ * printed by the idle loop once all of the processes are done.
+ */
+void lock_bench(void)
+{
+    lock_bench_procs = smp_cpu_count();
+    lock_prof_add(&lock_bench_ticket.stats, "lock_bench ticket");
+    lock_prof_add(&lock_bench_mcs.stats, "lock_bench mcs");
+    lock_prof_add(&lock_bench_rw.stats, "lock_bench rw");
+
+    printk("lock_bench: %u processes on %u processor(s), %u iterations\n",
+           lock_bench_procs, smp_cpu_count(), LOCK_BENCH_ITERS);
+
+    for (size_t i = 0; i < lock_bench_procs; i++)
+        proc_register(&lock_bench_proc, 10, PROC_LEVEL_DEFAULT);
+}
+
+// Print results of lock_bench() once its processes are done
+void lock_bench_report(void)
+{
+    if (!__atomic_load_n(&lock_bench_done, __ATOMIC_ACQUIRE))
+        return;
+
+    for (size_t kind = 0; kind < LOCK_BENCH_KINDS; kind++) {
+        printk("lock_bench: %s: %u cycles alone, %u cycles with %u processes "
+               "(%u%% contended)%s\n", lock_bench_names[kind],
+               lock_bench_results[kind].alone, lock_bench_results[kind].shared,
+               lock_bench_procs, lock_bench_results[kind].contended,
+               lock_bench_results[kind].broken ? " MUTUAL EXCLUSION BROKEN" : "");
+    }
+    lock_bench_done = false;
+}
@@ -0,0 +1,243 @@
+/**
+ * lock.h: Spinlocks
+ *
+ * Ticket locks hand the lock over in FIFO order, so no processor starves, and
+ * are the default for short critical sections. MCS locks also hand over in FIFO
+ * order but let every waiter spin on a node of its own instead of on the lock,
+ * so a contended lock does not bounce its cache line between all waiters.
+ * Reader-writer locks let readers share the lock (writers are preferred, so a
+ * stream of readers cannot starve them).
+ *
+ * A lock that is also taken in interrupt handlers must only be held with
+ * interrupts disabled, i.e. with the _irqsave variants, which return the flags
+ * register to pass to the matching _irqrestore function.
+ *
+ * Waiters spin with lock_relax(), which also handles TLB shootdown requests
+ * while interrupts are disabled (see tlb.c).
+ *
+ * Every lock counts its acquisitions and how many of them had to wait. The
+ * counters are updated by the holder, so they cost no extra atomic operation.
+ * With LOCKPROF in make.config (CONFIG_LOCK_PROF), locks also measure their
+ * wait and hold times, keep a log2 histogram of wait times and remember the
+ * call site of the longest wait. Locks
+ * named with lock_prof_add() are then listed by lock_prof_dump().
+ */
+
+#ifndef _KERNEL_LOCK_H
+#define _KERNEL_LOCK_H
+
+#include <stdatomic.h>
+
+#include "asm.h"
+#include "std.h"
+#include "tlb.h"
+
+// Lock constants
+enum {
+    LOCK_BENCH_ITERS    = 100000,   // Acquisitions per process in lock_bench()
+    LOCK_PROF_DUMP_US   = 5000000,  // Interval of lock_prof_report()
+    LOCK_PROF_TOP       = 8,        // Locks listed by lock_prof_report()
+    LOCK_PROF_BUCKETS   = 12,       // Buckets of the wait time histogram
+    LOCK_PROF_SHIFT     = 6,        // Bucket i counts waits of less than
+                                    // 2^(i + LOCK_PROF_SHIFT + 1) cycles
+};
+
+// Reader-writer lock state flags (beside the number of readers)
+#define LOCK_RW_WRITER  (1u << 31)  // A writer holds the lock
+#define LOCK_RW_WAITING (1u << 30)  // A writer waits for the lock
+
+#ifdef CONFIG_LOCK_PROF
+// Call site of a lock function (called from the site itself, which is why
+// profiled lock functions are not inlined)
+#define LOCK_SITE       __builtin_return_address(0)
+#define LOCK_INLINE     __attribute__((noinline, unused))
+#else
+#define LOCK_SITE       NULL
+#define LOCK_INLINE     inline
+#endif
+
+// Contention counters (and profile, updated by the holder as well)
+typedef struct lock_stats {
+    uint32_t acquired;      // Number of acquisitions
+    uint32_t contended;     // Number of acquisitions that had to wait
+#ifdef CONFIG_LOCK_PROF
+    const char *name;               // Name (see lock_prof_add())
+    struct lock_stats *prof_next;   // Next named lock
+    uint64_t wait;                  // Cycles spent acquiring the lock
+    uint64_t wait_max;              // Longest acquisition
+    const void *wait_max_site;      // Call site of the longest acquisition
+    uint32_t wait_hist[LOCK_PROF_BUCKETS];  // Acquisitions by wait time
+    uint64_t hold;                  // Cycles the lock was held
+    uint64_t hold_max;              // Longest time the lock was held
+    uint64_t hold_start;            // TSC of the last acquisition
+#endif
+} lock_stats_t;
+
+// Ticket lock
+typedef struct {
+    atomic_uint next;       // Next ticket to hand out
+    atomic_uint owner;      // Ticket that holds the lock
+    lock_stats_t stats;
+} lock_ticket_t;
+
+// MCS lock queue node of a waiter (held until the lock is released)
+typedef struct __attribute__((aligned(64))) lock_mcs_node {
+    struct lock_mcs_node * _Atomic next;    // Next waiter
+    atomic_bool locked;                     // Whether the waiter must wait
+} lock_mcs_node_t;
+
+// MCS lock
+typedef struct {
+    lock_mcs_node_t * _Atomic tail;         // Last waiter (or holder)
+    lock_stats_t stats;
+} lock_mcs_t;
+
+// Reader-writer lock
+typedef struct {
+    atomic_uint state;          // Number of readers, LOCK_RW_WRITER and
+                                // LOCK_RW_WAITING
+    lock_stats_t stats;         // Counters of writers
+    atomic_uint read_contended; // Number of read acquisitions that had to wait
+} lock_rw_t;
+
+// Return TSC at the start of an acquisition (if it is profiled)
+static inline uint64_t lock_prof_begin(void)
+{
+#ifdef CONFIG_LOCK_PROF
+    return rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Count acquisition that started at TSC start (by the new holder)
+static inline void lock_stats_acquired(lock_stats_t *stats, bool contended,
+                                       uint64_t start, const void *site)
+{
+    stats->acquired++;
+    stats->contended += contended;
+#ifdef CONFIG_LOCK_PROF
+    const uint64_t now = rdtsc();
+    const uint64_t wait = now - start;
+    stats->wait += wait;
+    if (wait > stats->wait_max) {
+        stats->wait_max = wait;
+        stats->wait_max_site = site;
+    }
+
+    const uint32_t wait32 = wait < UINT32_MAX ? wait : UINT32_MAX;
+    const int log2 = 31 - __builtin_clz(wait32 | 1);
+    const int bucket = log2 - LOCK_PROF_SHIFT;
+    stats->wait_hist[bucket < 0 ? 0 : bucket < LOCK_PROF_BUCKETS ? bucket
+                     : LOCK_PROF_BUCKETS - 1]++;
+
+    stats->hold_start = now;
+#else
+    (void)start;
+    (void)site;
+#endif
+}
+
+// Account for the time the lock was held (by the holder, before releasing it)
+static inline void lock_stats_released(lock_stats_t *stats)
+{
+#ifdef CONFIG_LOCK_PROF
+    const uint64_t hold = rdtsc() - stats->hold_start;
+    stats->hold += hold;
+    if (hold > stats->hold_max)
+        stats->hold_max = hold;
+#else
+    (void)stats;
+#endif
+}
+
+// Pause in a spin loop. With interrupts disabled, the shootdown interrupt
+// cannot reach the processor, so pending shootdown requests are handled here
+// (their initiator may hold the lock being waited for).
+static inline void lock_relax(void)
+{
+    asm volatile ("pause\n\t");
+    if (!get_flags().ief)
+        tlb_poll();
+}
+
+// Take ticket lock on behalf of call site
+static inline void lock_ticket_at(lock_ticket_t *lock, const void *site)
+{
+    const uint64_t start = lock_prof_begin();
+    const unsigned int ticket = atomic_fetch_add_explicit(&lock->next, 1,
+                                                          memory_order_relaxed);
+    bool contended = false;
+    while (atomic_load_explicit(&lock->owner, memory_order_acquire) != ticket) {
+        contended = true;
+        lock_relax();
+    }
+
+    lock_stats_acquired(&lock->stats, contended, start, site);
+}
+
+static LOCK_INLINE void lock_ticket(lock_ticket_t *lock)
+{
+    lock_ticket_at(lock, LOCK_SITE);
+}
+
+// Return whether lock was taken (without waiting for it)
+static LOCK_INLINE bool lock_ticket_try(lock_ticket_t *lock)
+{
+    const uint64_t start = lock_prof_begin();
+    unsigned int owner = atomic_load_explicit(&lock->owner, memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&lock->next, &owner, owner + 1,
+                                                 memory_order_acquire,
+                                                 memory_order_relaxed))
+        return false;
+
+    lock_stats_acquired(&lock->stats, false, start, LOCK_SITE);
+    return true;
+}
+
+static inline void lock_ticket_unlock(lock_ticket_t *lock)
+{
+    lock_stats_released(&lock->stats);
+
+    // Only the holder writes owner
+    const unsigned int owner = atomic_load_explicit(&lock->owner, memory_order_relaxed);
+    atomic_store_explicit(&lock->owner, owner + 1, memory_order_release);
+}
+
+// Disable interrupts and take lock
+static LOCK_INLINE flags_reg_t lock_ticket_irqsave(lock_ticket_t *lock)
+{
+    const flags_reg_t flags = get_flags();
+    cli();
+    lock_ticket_at(lock, LOCK_SITE);
+    return flags;
+}
+
+// Release lock and restore the interrupt flag
+static inline void lock_ticket_irqrestore(lock_ticket_t *lock, flags_reg_t flags)
+{
+    lock_ticket_unlock(lock);
+    set_flags(flags);
+}
+
+void lock_bench(void);
+void lock_bench_report(void);
+void lock_mcs(lock_mcs_t *lock, lock_mcs_node_t *node);
+void lock_mcs_at(lock_mcs_t *lock, lock_mcs_node_t *node, const void *site);
+flags_reg_t lock_mcs_irqsave(lock_mcs_t *lock, lock_mcs_node_t *node);
+void lock_mcs_irqrestore(lock_mcs_t *lock, lock_mcs_node_t *node, flags_reg_t flags);
+void lock_mcs_unlock(lock_mcs_t *lock, lock_mcs_node_t *node);
+void lock_prof_add(lock_stats_t *stats, const char *name);
+void lock_prof_dump(size_t n);
+void lock_prof_report(void);
+void lock_read(lock_rw_t *lock);
+flags_reg_t lock_read_irqsave(lock_rw_t *lock);
+void lock_read_irqrestore(lock_rw_t *lock, flags_reg_t flags);
+void lock_read_unlock(lock_rw_t *lock);
+void lock_write(lock_rw_t *lock);
+flags_reg_t lock_write_irqsave(lock_rw_t *lock);
+void lock_write_irqrestore(lock_rw_t *lock, flags_reg_t flags);
+bool lock_write_try(lock_rw_t *lock);
+void lock_write_unlock(lock_rw_t *lock);
+
+#endif // _KERNEL_LOCK_H
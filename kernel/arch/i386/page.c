@@ -4,9 +4,15 @@
 
 #include "alloc.h"
 #include "asm.h"
+#include "cpuid.h"
 #include "page.h"
 #include "mem.h"
+#include "io.h"
+#include "percpu.h"
+#include "smp.h"
 #include "std.h"
+#include "string.h"
+#include "tlb.h"
 
 uintptr_t *page_dir;
 uintptr_t *page_table_lookup;
@@ -14,11 +20,33 @@ uintptr_t kernel_heap_end_pma;
 uintptr_t kernel_heap_end_vma;
 
 static page_free_node_t *page_free_list = NULL;
+static size_t page_free_count = 0;      // Number of pages in page_free_list
+static uint32_t page_free_map[PAGE_PHYS_LIMIT / PAGE_SIZE / 32];    // Free frames
+static uint16_t page_block_free_count[PAGE_BLOCKS]; // Free frames per block
+static size_t page_isolated = PAGE_BLOCK_NONE;      // Block kept off the free list
+static uintptr_t page_window_vma;       // Start of temporary mapping windows
+                                        // (PAGE_WINDOWS per processor)
+static bool page_large_ok = false;      // Whether large pages are enabled
 
 // Static functions
 static inline uintptr_t page_get_dir_idx(uintptr_t vma);
 static inline uintptr_t page_get_table_idx(uintptr_t vma);
 static void * page_get_table(uintptr_t vma);
+static uintptr_t page_block_alloc(size_t block);
+static void page_block_unlink(size_t block);
+static inline void page_mark_used(uintptr_t pma);
+
+// Return page directory of the calling processor
+static inline page_entry_t * page_this_dir(void)
+{
+    return percpu_get(page_dir);
+}
+
+// Return page table lookup of the calling processor
+static inline uintptr_t * page_this_lookup(void)
+{
+    return percpu_get(page_table_lookup);
+}
 
 // Erase page (overwrite with zeros)
 void page_clear(uintptr_t vma)
@@ -29,34 +57,90 @@ void page_clear(uintptr_t vma)
     }
 }
 
+// Copy contents of physical page src_pma to physical page dst_pma
+// NOTE: must be called with interrupts disabled
+void page_copy(uintptr_t dst_pma, uintptr_t src_pma)
+{
+    void *dst = page_map_window(PAGE_WINDOW_DST, dst_pma);
+    void *src = page_map_window(PAGE_WINDOW_SRC, src_pma);
+    memcpy(dst, src, PAGE_SIZE);
+    page_unmap_window(PAGE_WINDOW_SRC);
+    page_unmap_window(PAGE_WINDOW_DST);
+}
+
+// Return VMA of window of the current processor
+static inline uintptr_t page_window(size_t window)
+{
+    return page_window_vma + (smp_cpu_id() * PAGE_WINDOWS + window) * PAGE_SIZE;
+}
+
+// Map physical page into a temporary kernel window and return its VMA
+// NOTE: must be called with interrupts disabled
+void * page_map_window(size_t window, uintptr_t pma)
+{
+    const uintptr_t vma = page_window(window);
+    page_set_entry(vma, pma | PAGE_WRITE | PAGE_PRESENT);
+    invlpg(vma);
+    return (void*)vma;
+}
+
+/**
+ * Map a read-only view of the kernel page at vma that user mode may read (the
+ * page itself stays writable by the kernel only)
+ * NOTE: must be called before smp_init(), since the other processors copy the
+ * kernel half of page_dir (see page_init_cpu())
+ * RETURN
+ *  VMA of the view
+ */
+uintptr_t page_map_public(uintptr_t vma)
+{
+    // Reserve kernel address space (its backing page goes to the free list)
+    const uintptr_t view = (uintptr_t)kalloc(PAGE_GET_DEFAULT, PAGE_SIZE, PAGE_SIZE);
+    page_free(view);
+
+    page_set_entry(view, page_get_pma(vma) | PAGE_PUBLIC | PAGE_PRESENT);
+    page_dir[page_get_dir_idx(view)] |= PAGE_PUBLIC;
+    invlpg(view);
+    return view;
+}
+
+// Release temporary kernel window. Other processors need no shootdown, since
+// every processor has windows of its own.
+void page_unmap_window(size_t window)
+{
+    const uintptr_t vma = page_window(window);
+    page_set_entry(vma, (page_entry_t)0);
+    invlpg(vma);
+}
+
 // Map page table
 void page_table_map(uintptr_t table_vma, uintptr_t vma, uintptr_t flags)
 {
     const uintptr_t idx = page_get_dir_idx(vma);
-    page_table_lookup[idx] = table_vma;
-    page_dir[idx] = page_get_pma(table_vma) | flags;
+    page_this_lookup()[idx] = table_vma;
+    page_this_dir()[idx] = page_get_pma(table_vma) | flags;
 }
 
 // Set page directory entry directly by directory index
 void page_set_dir_entry(uintptr_t idx, uintptr_t table_vma, page_entry_t entry)
 {
-    page_table_lookup[idx] = table_vma;
-    page_dir[idx] = entry;
+    page_this_lookup()[idx] = table_vma;
+    page_this_dir()[idx] = entry;
 }
 
 // Unmap page table (zero out page directory entry)
 void page_table_unmap(uintptr_t vma)
 {
     const uintptr_t idx = page_get_dir_idx(vma);
-    page_table_lookup[idx] = (page_entry_t)0;
-    page_dir[idx] = (page_entry_t)0;
+    page_this_lookup()[idx] = (page_entry_t)0;
+    page_this_dir()[idx] = (page_entry_t)0;
 }
 
 // Unmap page table by directory index
 void page_table_unmap_idx(uintptr_t idx)
 {
-    page_table_lookup[idx] = (page_entry_t)0;
-    page_dir[idx] = (page_entry_t)0;
+    page_this_lookup()[idx] = (page_entry_t)0;
+    page_this_dir()[idx] = (page_entry_t)0;
 }
 
 static inline uintptr_t page_get_dir_idx(uintptr_t vma)
@@ -71,8 +155,21 @@ static inline uintptr_t page_get_table_idx(uintptr_t vma)
 
 static void * page_get_table(uintptr_t vma)
 {
+    // The kernel half is the same for every processor
     const uintptr_t idx = page_get_dir_idx(vma);
-    return (void*)page_table_lookup[idx];
+    if (vma >= KERNEL_START_VMA)
+        return (void*)page_table_lookup[idx];
+    return (void*)page_this_lookup()[idx];
+}
+
+// Invalidate TLB entry of vma on every processor that may cache it. Kernel
+// mappings are shared by every processor, user mappings belong to the current
+// process, which runs on this processor only.
+static void page_invalidate(uintptr_t vma)
+{
+    invlpg(vma);
+    if (vma >= KERNEL_START_VMA)
+        tlb_shootdown(tlb_cpus_others(), vma, 1);
 }
 
 // Remap page VMA to different PMA without modifying flags
@@ -81,7 +178,7 @@ void page_remap(uintptr_t vma, uintptr_t pma)
     const uintptr_t table_idx = page_get_table_idx(vma);
     page_entry_t *table = page_get_table(vma);
     table[table_idx] = (table[table_idx] & 0xfff) | pma;
-    invlpg(vma);
+    page_invalidate(vma);
 }
 
 // Set page table entry for VMA
@@ -91,13 +188,27 @@ void page_set_entry(uintptr_t vma, page_entry_t entry)
     table[page_get_table_idx(vma)] = entry;
 }
 
+// Set page table entry through a direct pointer (e.g. to the page table of a
+// process that is not currently mapped) and invalidate its TLB entry
+void page_set_pte(page_entry_t *pte, uintptr_t vma, page_entry_t entry)
+{
+    *pte = entry;
+    invlpg(vma);
+}
+
+// Return whether a page table is mapped for vma
+bool page_table_is_present(uintptr_t vma)
+{
+    return (bool)(page_this_dir()[page_get_dir_idx(vma)] & PAGE_PRESENT);
+}
+
 // Unmap page by clearing Present flag
 void page_unmap(uintptr_t vma)
 {
     const uintptr_t table_idx = page_get_table_idx(vma);
     page_entry_t *table = page_get_table(vma);
     table[table_idx] = table[table_idx] & ~PAGE_PRESENT;
-    invlpg(vma);
+    page_invalidate(vma);
 }
 
 // Unmap page by clearing entire page table entry
@@ -105,7 +216,7 @@ void page_delete(uintptr_t vma)
 {
     page_entry_t *table = page_get_table(vma);
     table[page_get_table_idx(vma)] = (page_entry_t)0;
-    invlpg(vma);
+    page_invalidate(vma);
 }
 
 void page_set_flags(uintptr_t vma, uintptr_t flags)
@@ -135,8 +246,12 @@ uintptr_t page_get_flags(uintptr_t vma)
     return page_get_entry(vma) & 0xfff;
 }
 
-// TODO handle error conditions, e.g. no more physical pages
-// Return PMA of new page from the free page list or at the end of page heap
+/**
+ * Return PMA of a new frame from the free list or from untouched memory
+ * NOTE: must be called with the kernel lock held
+ * RETURN
+ *  0 if physical memory is exhausted
+ */
 uintptr_t page_new(void)
 {
     uintptr_t pma = 0;  // PMA of new page
@@ -146,8 +261,10 @@ uintptr_t page_new(void)
         pma = page_free_list->pma;
         void *old_node = page_free_list;
         page_free_list = page_free_list->next;
+        page_free_count--;
+        page_mark_used(pma);
         kfree(old_node);
-    } else {
+    } else if (kernel_heap_end_pma < PAGE_PHYS_LIMIT) {
         // If nothing is free, add a new page at kernel_heap_end_pma
         pma = kernel_heap_end_pma;
         kernel_heap_end_pma += PAGE_SIZE;
@@ -155,27 +272,235 @@ uintptr_t page_new(void)
     return pma;
 }
 
+/**
+ * Return PMA of a new frame for a user page. The last PAGE_RESERVE free frames
+ * are left to the kernel heap and page tables, so that user memory cannot
+ * exhaust them; callers reclaim memory first (see zram_reclaim_direct()).
+ * NOTE: must be called with the kernel lock held
+ * RETURN
+ *  0 if no more than PAGE_RESERVE frames are free
+ */
+uintptr_t page_new_user(void)
+{
+    if (page_frames_free() <= PAGE_RESERVE)
+        return 0;
+    return page_new();
+}
+
 bool page_is_present(uintptr_t vma)
 {
     return (bool)(page_get_entry(vma) & PAGE_PRESENT);
 }
 
-// Unmap page and add its PMA to the free list
-void page_free(uintptr_t vma)
+// Track frame as free in the bitmap and per-block counters
+static inline void page_mark_free(uintptr_t pma)
+{
+    const uintptr_t frame = pma / PAGE_SIZE;
+    if (pma < PAGE_PHYS_LIMIT) {
+        page_free_map[frame / 32] |= (uint32_t)1 << (frame % 32);
+        page_block_free_count[pma / PAGE_BLOCK_SIZE]++;
+    }
+}
+
+// Track frame as used in the bitmap and per-block counters
+static inline void page_mark_used(uintptr_t pma)
 {
+    const uintptr_t frame = pma / PAGE_SIZE;
+    if (pma < PAGE_PHYS_LIMIT) {
+        page_free_map[frame / 32] &= ~((uint32_t)1 << (frame % 32));
+        page_block_free_count[pma / PAGE_BLOCK_SIZE]--;
+    }
+}
+
+static inline bool page_frame_is_free(uintptr_t pma)
+{
+    const uintptr_t frame = pma / PAGE_SIZE;
+    return page_free_map[frame / 32] & (uint32_t)1 << (frame % 32);
+}
+
+// Add physical page to the free list
+void page_free_pma(uintptr_t pma)
+{
+    page_mark_free(pma);
+
+    // Frames of an isolated block are kept off the free list
+    if (pma / PAGE_BLOCK_SIZE == page_isolated)
+        return;
+
     page_free_node_t *new_node = kmalloc(sizeof(page_free_node_t));
 
     *new_node = (page_free_node_t){
-        .pma = page_get_pma(vma),
+        .pma = pma,
         .next = page_free_list,
     };
 
-    page_unmap(vma);
     page_free_list = new_node;
+    page_free_count++;
+}
+
+// Return number of free physical pages (free list and untouched memory)
+size_t page_frames_free(void)
+{
+    size_t untouched = 0;
+    if (kernel_heap_end_pma < PAGE_PHYS_LIMIT)
+        untouched = (PAGE_PHYS_LIMIT - kernel_heap_end_pma) / PAGE_SIZE;
+    return page_free_count + untouched;
+}
+
+// Return number of free frames in block (including frames of an isolated block)
+size_t page_block_free(size_t block)
+{
+    return page_block_free_count[block];
+}
+
+/**
+ * Remove the free frames of block from the free list so that page_new() does
+ * not hand them out. Frames of the block freed later are held back as well
+ * until the block is taken or unisolated. Only one block can be isolated.
+ * NOTE: must be called with interrupts disabled
+ */
+void page_block_isolate(size_t block)
+{
+    page_isolated = block;
+    page_block_unlink(block);
+}
+
+// Remove all free-list nodes of frames in block
+// NOTE: must be called with interrupts disabled
+static void page_block_unlink(size_t block)
+{
+    page_free_node_t **node = &page_free_list;
+    while (*node) {
+        if ((*node)->pma / PAGE_BLOCK_SIZE == block) {
+            page_free_node_t *old_node = *node;
+            *node = old_node->next;
+            page_free_count--;
+            kfree(old_node);
+        } else {
+            node = &(*node)->next;
+        }
+    }
+}
+
+// Return the free frames of the isolated block to the free list
+// NOTE: must be called with interrupts disabled
+void page_block_unisolate(void)
+{
+    const size_t block = page_isolated;
+    if (block == PAGE_BLOCK_NONE)
+        return;
+
+    page_isolated = PAGE_BLOCK_NONE;
+    for (size_t i = 0; i < PAGE_BLOCK_FRAMES; i++) {
+        const uintptr_t pma = block * PAGE_BLOCK_SIZE + i * PAGE_SIZE;
+        if (page_frame_is_free(pma)) {
+            page_mark_used(pma);
+            page_free_pma(pma);
+        }
+    }
+}
+
+/**
+ * Allocate the isolated block if all of its frames are free
+ * NOTE: must be called with interrupts disabled
+ * RETURN
+ *  PMA of the block, or 0 if block is not isolated or not entirely free
+ */
+uintptr_t page_block_take(size_t block)
+{
+    if (block != page_isolated || page_block_free_count[block] != PAGE_BLOCK_FRAMES)
+        return 0;
+
+    page_isolated = PAGE_BLOCK_NONE;
+    return page_block_alloc(block);
+}
+
+// Mark all frames of block used and return its PMA
+static uintptr_t page_block_alloc(size_t block)
+{
+    const uintptr_t pma = block * PAGE_BLOCK_SIZE;
+    for (size_t i = 0; i < PAGE_BLOCK_FRAMES; i++)
+        page_mark_used(pma + i * PAGE_SIZE);
+    return pma;
+}
+
+/**
+ * Allocate a free 4 MiB-aligned block of physical frames, either one made up
+ * entirely of frames on the free list or one from untouched memory
+ * NOTE: must be called with interrupts disabled
+ * RETURN
+ *  PMA of the block, or 0 if no block is entirely free (see compact.c)
+ */
+uintptr_t page_new_block(void)
+{
+    for (size_t block = 0; block < PAGE_BLOCKS; block++) {
+        if (block != page_isolated
+            && page_block_free_count[block] == PAGE_BLOCK_FRAMES) {
+            page_block_unlink(block);
+            return page_block_alloc(block);
+        }
+    }
+
+    // Skip to the next block boundary in untouched memory; the frames skipped
+    // over go to the free list
+    const uintptr_t pma = (kernel_heap_end_pma + PAGE_BLOCK_SIZE - 1)
+                          & ~(uintptr_t)(PAGE_BLOCK_SIZE - 1);
+    if (pma + PAGE_BLOCK_SIZE > PAGE_PHYS_LIMIT)
+        return 0;
+
+    uintptr_t gap = kernel_heap_end_pma;
+    kernel_heap_end_pma = pma + PAGE_BLOCK_SIZE;
+    for ( ; gap < pma; gap += PAGE_SIZE)
+        page_free_pma(gap);
+
+    return pma;
+}
+
+// Return number of blocks page_new_block() can take from untouched memory
+size_t page_blocks_untouched(void)
+{
+    const uintptr_t pma = (kernel_heap_end_pma + PAGE_BLOCK_SIZE - 1)
+                          & ~(uintptr_t)(PAGE_BLOCK_SIZE - 1);
+    if (pma >= PAGE_PHYS_LIMIT)
+        return 0;
+    return (PAGE_PHYS_LIMIT - pma) / PAGE_BLOCK_SIZE;
+}
+
+// Return block allocated by page_new_block() to the free list
+void page_free_block(uintptr_t pma)
+{
+    for (size_t i = 0; i < PAGE_BLOCK_FRAMES; i++)
+        page_free_pma(pma + i * PAGE_SIZE);
+}
+
+// Unmap page and add its PMA to the free list
+void page_free(uintptr_t vma)
+{
+    page_free_pma(page_get_pma(vma));
+    page_unmap(vma);
+}
+
+// Enable large pages on the calling processor if supported
+static void page_enable_large(void)
+{
+    cpuid_version_t ver;
+    cpuid_version(&ver);
+    page_large_ok = ver.pse;
+    if (ver.pse)
+        set_cr4(get_cr4() | CR4_PSE);
+}
+
+// Return whether page directory entries may map large (4 MiB) pages
+bool page_large_supported(void)
+{
+    return page_large_ok;
 }
 
 void page_init_cleanup(void)
 {
+    percpu_of(0)->page_dir = page_dir;
+    percpu_of(0)->page_table_lookup = page_table_lookup;
+
     kmalloc_init(kernel_heap_end_vma);
 
     // Zero out and free all init pages (except for init_page_dir and
@@ -206,4 +531,44 @@ void page_init_cleanup(void)
             page_dir[i] = page_get_pma((uintptr_t)table) | PAGE_PRESENT | PAGE_WRITE;
         }
     }
+
+    // Reserve kernel address space for the temporary mapping windows of every
+    // processor. The backing pages are returned to the free list; windows are
+    // remapped on demand.
+    page_window_vma = (uintptr_t)kalloc(PAGE_GET_DEFAULT, PAGE_SIZE,
+                                        SMP_CPUS_MAX * PAGE_WINDOWS * PAGE_SIZE);
+    for (i = 0; i < SMP_CPUS_MAX * PAGE_WINDOWS; i++) {
+        page_free(page_window_vma + i * PAGE_SIZE);
+    }
+
+    page_enable_large();
+}
+
+/**
+ * Set up page directory of a processor: the kernel half is copied from the
+ * boot page directory, which is shared with the BSP (kernel page tables are
+ * all allocated by page_init_cleanup() and never change afterwards)
+ */
+void page_init_cpu(size_t cpu)
+{
+    percpu_t *pcpu = percpu_of(cpu);
+    if (pcpu->page_dir)
+        return;
+
+    pcpu->page_dir = kalloc(PAGE_GET_DEFAULT, PAGE_SIZE, PAGE_SIZE);
+    pcpu->page_table_lookup = kalloc(PAGE_GET_DEFAULT, PAGE_SIZE, PAGE_SIZE);
+    memset(pcpu->page_dir, 0, PAGE_SIZE);
+    memset(pcpu->page_table_lookup, 0, PAGE_SIZE);
+
+    for (uintptr_t i = page_get_dir_idx(KERNEL_START_VMA); i < PAGE_ENTRIES; i++) {
+        pcpu->page_dir[i] = page_dir[i];
+        pcpu->page_table_lookup[i] = page_table_lookup[i];
+    }
+}
+
+// Switch the calling processor to its own page directory
+void page_load_cpu_dir(void)
+{
+    page_enable_large();
+    page_load_dir((void*)page_get_pma((uintptr_t)page_this_dir()));
 }
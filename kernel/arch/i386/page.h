@@ -63,6 +63,27 @@
 #define PAGE_SIZE           4096
 #define PAGE_ENTRIES        1024
 
+// Amount of physical memory available to the page allocator, set with MEM in
+// make.config (the memory map of the boot loader is not read, so it must not
+// exceed the RAM of the machine)
+#ifndef CONFIG_MEM_MB
+#define CONFIG_MEM_MB       128
+#endif
+#define PAGE_PHYS_LIMIT     ((uintptr_t)CONFIG_MEM_MB << 20)
+
+// Free frames that only the kernel may allocate (see page_new_user())
+#define PAGE_RESERVE        64
+
+// Physical memory is divided into blocks the size of a large (4 MiB) page for
+// contiguous allocations (see page_new_block() and compact.c)
+#define PAGE_BLOCK_SIZE     (PAGE_SIZE * PAGE_ENTRIES)
+#define PAGE_BLOCK_FRAMES   PAGE_ENTRIES
+#define PAGE_BLOCKS         (PAGE_PHYS_LIMIT / PAGE_BLOCK_SIZE)
+#define PAGE_BLOCK_NONE     PAGE_BLOCKS
+
+_Static_assert(CONFIG_MEM_MB % 4 == 0 && CONFIG_MEM_MB > 0 && CONFIG_MEM_MB < 4096,
+               "MEM must be a multiple of 4 MiB below 4 GiB");
+
 // Flag bits for paging
 #define PAGE_IGNORE         ((uintptr_t)1 << 8) // Only for Page Directory
 #define PAGE_GLOBAL         ((uintptr_t)1 << 8) // Only for Page Table
@@ -75,6 +96,20 @@
 #define PAGE_WRITE          ((uintptr_t)1 << 1)
 #define PAGE_PRESENT        ((uintptr_t)1 << 0)
 
+// Flag bits available for OS use (bits 11:9 of page table entries)
+#define PAGE_COW            ((uintptr_t)1 << 9) // Copy-on-write (read-only shared)
+#define PAGE_IDLE           ((uintptr_t)1 << 10)// Not accessed during last WSS sample
+#define PAGE_SWAPPED        ((uintptr_t)1 << 11)// Not present, bits 31:12 hold zram slot
+
+// Temporary kernel mappings for accessing arbitrary physical pages (each
+// processor has a set of its own, so they need no lock)
+// NOTE: windows may only be used while interrupts are disabled
+enum {
+    PAGE_WINDOW_SRC = 0,
+    PAGE_WINDOW_DST,
+    PAGE_WINDOWS,
+};
+
 // Type for page entries
 typedef uintptr_t page_entry_t;
 
@@ -118,22 +153,41 @@ static inline void page_enable(void)
     );
 }
 
+size_t page_block_free(size_t block);
+void page_block_isolate(size_t block);
+uintptr_t page_block_take(size_t block);
+size_t page_blocks_untouched(void);
+void page_block_unisolate(void);
 void page_clear(uintptr_t pma);
+void page_copy(uintptr_t dst_pma, uintptr_t src_pma);
 void page_delete(uintptr_t vma);
 void page_init_cleanup(void);
+void page_init_cpu(size_t cpu);
 void page_free(uintptr_t vma);
+void page_free_block(uintptr_t pma);
+void page_free_pma(uintptr_t pma);
+size_t page_frames_free(void);
 uintptr_t page_get_entry(uintptr_t vma);
 uintptr_t page_get_flags(uintptr_t vma);
 uintptr_t page_get_pma(uintptr_t vma);
 bool page_is_present(uintptr_t vma);
+bool page_large_supported(void);
+void page_load_cpu_dir(void);
+uintptr_t page_map_public(uintptr_t vma);
+void * page_map_window(size_t window, uintptr_t pma);
 uintptr_t page_new(void);
+uintptr_t page_new_block(void);
+uintptr_t page_new_user(void);
 void page_remap(uintptr_t vma, uintptr_t pma);
 void page_set_entry(uintptr_t vma, page_entry_t entry);
 void page_set_flags(uintptr_t vma, uintptr_t flags);
+void page_set_pte(page_entry_t *pte, uintptr_t vma, page_entry_t entry);
+bool page_table_is_present(uintptr_t vma);
 void page_table_map(uintptr_t table_vma, uintptr_t vma, uintptr_t flags);
 void page_table_unmap(uintptr_t vma);
 void page_set_dir_entry(uintptr_t idx, uintptr_t table_vma, page_entry_t entry);
 void page_unmap(uintptr_t vma);
+void page_unmap_window(size_t window);
 
 // This is the default function for obtaining new pages
 #define PAGE_GET_DEFAULT (&page_new)
@@ -0,0 +1,23 @@
+/**
+ * percpu.c: Per-processor data
+ */
+
+#include "percpu.h"
+
+static percpu_t percpu_blocks[SMP_CPUS_MAX];
+
+// Set up per-CPU data blocks (before gdt_init() points descriptors at them)
+void percpu_init(void)
+{
+    for (size_t cpu = 0; cpu < SMP_CPUS_MAX; cpu++) {
+        percpu_blocks[cpu].self = &percpu_blocks[cpu];
+        percpu_blocks[cpu].cpu = cpu;
+    }
+}
+
+// Return per-CPU data block of a processor (e.g. to look at its state from
+// another one)
+percpu_t * percpu_of(size_t cpu)
+{
+    return &percpu_blocks[cpu];
+}
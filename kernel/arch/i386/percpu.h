@@ -0,0 +1,82 @@
+/**
+ * percpu.h: Per-processor data
+ *
+ * Every processor has a GDT of its own (see gdt.c), in which the descriptor at
+ * GDT_IDX_PERCPU covers the per-CPU data block of that processor. The kernel
+ * keeps its selector in GS, so a field of the block of the calling processor
+ * is read or written with a single GS-relative move, which needs no lock and
+ * cannot observe another processor's block even if the caller migrates right
+ * afterwards. Entry points from user mode load GS (see int_asm.s and
+ * percpu_enter()), since user processes run with a flat GS.
+ */
+
+#ifndef _KERNEL_PERCPU_H
+#define _KERNEL_PERCPU_H
+
+#include "asm.h"
+#include "gdt.h"
+#include "page.h"
+#include "smp.h"
+#include "std.h"
+
+struct proc;
+struct proc_cpu;
+
+// Per-CPU data block (accessed with percpu_get() and percpu_set(), whose
+// fields must be 4 bytes wide). Blocks are cache-line aligned, so that writes
+// by one processor do not invalidate the block of another.
+typedef struct __attribute__((aligned(64))) percpu {
+    struct percpu *self;            // Linear address of this block
+    size_t cpu;                     // Processor index (0 is the BSP)
+    struct proc *curr;              // Current process (see proc.c)
+    struct proc_cpu *sched;         // Scheduler state (see proc.c)
+    page_entry_t *page_dir;         // Page directory (see page_init_cpu())
+    uintptr_t *page_table_lookup;   // Page table lookup of page_dir
+    struct proc *fpu_owner;         // Last process to use the FPU (see fpu.c)
+} percpu_t;
+
+// Read field of the per-CPU data block of the calling processor
+#define percpu_get(field) __extension__ ({                                  \
+    __typeof__(((percpu_t*)0)->field) _val;                                 \
+    _Static_assert(sizeof(_val) == 4, "per-CPU field must be 4 bytes");     \
+    asm volatile ("movl %%gs:%c1, %0\n\t"                                   \
+                  : "=r" (_val)                                             \
+                  : "i" (offsetof(percpu_t, field)));                       \
+    _val;                                                                   \
+})
+
+// Write field of the per-CPU data block of the calling processor
+#define percpu_set(field, val) __extension__ ({                             \
+    __typeof__(((percpu_t*)0)->field) _val = (val);                         \
+    _Static_assert(sizeof(_val) == 4, "per-CPU field must be 4 bytes");     \
+    asm volatile ("movl %0, %%gs:%c1\n\t"                                   \
+                  : /* No outputs */                                        \
+                  : "r" (_val), "i" (offsetof(percpu_t, field))             \
+                  : "memory");                                              \
+})
+
+// Return the per-CPU data block of the calling processor
+#define percpu_this() percpu_get(self)
+
+/**
+ * Load the per-CPU segment in an interrupt handler that uses per-CPU data
+ * (the interrupted code may run with any GS)
+ * RETURN
+ *  GS to restore with percpu_leave()
+ */
+static inline uint16_t percpu_enter(void)
+{
+    const uint16_t gs = get_gs();
+    set_gs(GDT_SEL_PERCPU);
+    return gs;
+}
+
+static inline void percpu_leave(uint16_t gs)
+{
+    set_gs(gs);
+}
+
+void percpu_init(void);
+percpu_t * percpu_of(size_t cpu);
+
+#endif // _KERNEL_PERCPU_H
@@ -9,7 +9,9 @@ ssize_t printk(const char *format, ... )
 {
     va_list args;
     va_start(args, format);
+    const flags_reg_t flags = vga_lock();
     ssize_t bytes = _print(format, &args);
+    vga_unlock(flags);
     va_end(args);
     return bytes;
 }
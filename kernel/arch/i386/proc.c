@@ -5,84 +5,614 @@
 #include "asm.h"
 #include "alloc.h"
 #include "apic.h"
+#include "clock.h"
+#include "compact.h"
+#include "fpu.h"
 #include "gdt.h"
+#include "int.h"
 #include "io.h"
+#include "ksm.h"
+#include "lock.h"
 #include "mem.h"
 #include "page.h"
+#include "percpu.h"
 #include "proc.h"
+#include "sched.h"
+#include "smp.h"
+#include "string.h"
+#include "syscall.h"
+#include "tlb.h"
+#include "vdso.h"
+#include "vma.h"
+#include "wss.h"
+#include "zram.h"
+
+// Scheduler state of a processor (its current process is per-CPU data, which
+// is only written by the processor itself with its run queue lock held)
+typedef struct proc_cpu {
+    lock_ticket_t lock;         // Run queue lock: protects the run queues and
+                                // sleepers of the processor and percpu curr
+    proc_t idle;                // Idle context (runs when no process is runnable)
+    rb_tree_t sleepers;         // Processes in a timed sleep by wake time
+    uint64_t exec_start;        // TSC when curr was last charged
+    size_t nr_running;          // Number of runnable processes in the run queues
+    uint64_t busy;              // Cycles spent running processes since balancing
+    uint64_t balance_last;      // TSC of last periodic balancing
+    uint32_t load;              // Average load (see proc_balance())
+    size_t idle_stops;          // Number of times the timer was stopped
+    size_t steals;              // Processes taken while idle
+    size_t pulls;               // Processes taken by periodic balancing
+} proc_cpu_t;
 
 static proc_t *proc_table;              // Process table
 static pid_t proc_num;                  // Number of registered processes
-static pid_t PID = 0;                   // Current PID
-static pid_node_t *proc_queue_start;    // Process scheduling queue (start)
-static pid_node_t *proc_queue_end;      // Process scheduling queue (end)
+static pid_t proc_pid_end = 1;          // One past the highest PID in use
+static proc_cpu_t proc_cpus[SMP_CPUS_MAX];  // Scheduler state by processor
+
+// Busy processes of proc_bench_sched()
+static pid_t proc_bench_first;
+static size_t proc_bench_n;
+static uint64_t proc_bench_start;
+
+// Processes of proc_bench_pingpong(), which take turns on one processor
+static volatile size_t proc_pingpong_turn = 2;      // Index of the last to run
+static volatile uint64_t proc_pingpong_last[2];     // Last TSC read by each
+static uint64_t proc_pingpong_switches;
+static uint64_t proc_pingpong_cycles;
+static uint64_t proc_pingpong_min = UINT64_MAX;
+static uint64_t proc_pingpong_start;
+static bool proc_pingpong_running;
+
+#ifdef CONFIG_SCHED_CFS
+static const proc_sched_t proc_sched_default = PROC_SCHED_CFS;
+#else
+static const proc_sched_t proc_sched_default = PROC_SCHED_RR;
+#endif
+
+// Scheduling classes in order of precedence
+static const sched_class_t * const proc_classes[PROC_SCHED_CLASSES] = {
+    [PROC_SCHED_EDF] = &sched_edf,
+    [PROC_SCHED_RR] = &sched_rr,
+    [PROC_SCHED_CFS] = &sched_cfs,
+};
 
 // Static functions
-static void proc_mem_map(pid_t pid);
-static void proc_mem_unmap(pid_t pid);
+static void proc_mem_map(const proc_t *proc);
+static void proc_mem_unmap(const proc_t *proc);
 static pid_t proc_new_pid(void);
 static inline bool proc_pid_taken(pid_t pid);
 static void proc_print_ctxt(proc_ctxt_t *ctxt);
-static pid_t proc_register(void (*entry_point)(void), pc_t priority);
 static void proc1(void);
 static void proc2(void);
 static void proc3(void);
+static void proc4(void);
+static void proc5(void);
+static void proc6(void);
+static void proc7(void);
+static void proc8(void);
+
+// Return scheduler state of the calling processor
+static inline proc_cpu_t * proc_this_cpu(void)
+{
+    return percpu_get(sched);
+}
 
 pid_t proc_get_pid(void)
 {
-    return PID;
+    return percpu_get(curr)->pid;
+}
+
+void proc_start(void);                                  // See int_asm.s
+void proc_switch_stack(uintptr_t *prev_sp, uintptr_t next_sp);  // See int_asm.s
+
+/**
+ * Set up the kernel stack of proc to start it at entry_point (in user mode if
+ * user), as if it had been switched out by proc_next()
+ */
+static void proc_stack_init(proc_t *proc, void (*entry_point)(void), bool user)
+{
+    proc->kstack = kalloc(PAGE_GET_DEFAULT, PAGE_SIZE, PROC_KSTACK_SIZE);
+
+    // The stack pointer and segment are only popped by iret to user mode
+    const size_t ctxt_size = user ? sizeof(proc_ctxt_t)
+                                  : offsetof(proc_ctxt_t, esp);
+    const uintptr_t top = (uintptr_t)proc->kstack + PROC_KSTACK_SIZE;
+    proc_ctxt_t *ctxt = (proc_ctxt_t*)(top - ctxt_size);
+    memset(ctxt, 0, ctxt_size);
+    const reg_t data = user ? GDT_SEL_DATA_PL3 : GDT_SEL_DATA_PL0;
+    ctxt->ds = data;
+    ctxt->es = data;
+    ctxt->fs = data;
+    ctxt->gs = user ? GDT_SEL_DATA_PL3 : GDT_SEL_PERCPU;
+    ctxt->eip = (uintptr_t)entry_point;
+    ctxt->cs = user ? GDT_SEL_CODE_PL3 : GDT_SEL_CODE_PL0;
+    ctxt->eflags = user ? 0x3202 : 0x202;   // Set IF flag (and IOPL = 3)
+    if (user) {
+        ctxt->esp = KERNEL_START_VMA;
+        ctxt->ss = GDT_SEL_DATA_PL3;
+    }
+    proc->ctxt = ctxt;
+
+    // Registers popped by proc_switch_stack(), which returns to proc_start
+    uintptr_t *sp = (uintptr_t*)ctxt;
+    *--sp = (uintptr_t)&proc_start;
+    for (size_t i = 0; i < 4; i++)
+        *--sp = 0;
+    proc->ksp = (uintptr_t)sp;
+}
+
+// Lock the run queues of the processor of proc (which may change until the
+// lock is held)
+static proc_cpu_t * proc_lock_rq(const proc_t *proc)
+{
+    while (1) {
+        proc_cpu_t *c = &proc_cpus[proc->cpu];
+        lock_ticket(&c->lock);
+        if (c == &proc_cpus[proc->cpu])
+            return c;
+        lock_ticket_unlock(&c->lock);
+    }
+}
+
+// Add runnable process to the run queue of its class on its processor
+static void proc_enqueue(proc_t *proc)
+{
+    proc_classes[proc->sched]->enqueue(proc);
+    proc_cpus[proc->cpu].nr_running++;
+}
+
+// Remove process that is no longer runnable from its run queue
+static void proc_dequeue(proc_t *proc)
+{
+    proc_classes[proc->sched]->dequeue(proc);
+    proc_cpus[proc->cpu].nr_running--;
+}
+
+// Program the timer for the earliest event a class needs a scheduling
+// decision for on cpu, the end of a timed sleep, or the next periodic balancing
+// while there is anything to balance. Without such an event (e.g. when only the
+// idle loop of PID 0 is runnable) the timer is stopped.
+static void proc_timer_program(size_t cpu, uint64_t now, const proc_t *next)
+{
+    proc_cpu_t *c = &proc_cpus[cpu];
+
+    uint64_t event = UINT64_MAX;
+    for (size_t i = 0; i < PROC_SCHED_CLASSES; i++) {
+        const proc_t *curr = next != &c->idle && next->sched == i ? next : NULL;
+        const uint64_t e = proc_classes[i]->next_event(cpu, curr, now);
+        if (e < event)
+            event = e;
+    }
+
+    const rb_node_t *sleeper = rb_first(&c->sleepers);
+    if (sleeper && rb_entry(sleeper, proc_t, rq_node)->wake_time < event)
+        event = rb_entry(sleeper, proc_t, rq_node)->wake_time;
+
+    if (c->nr_running && smp_cpu_count() > 1) {
+        const uint64_t balance = c->balance_last + clock_us_to_tsc(PROC_BALANCE_US);
+        if (balance < event)
+            event = balance;
+    }
+
+    if (event == UINT64_MAX) {
+        lapic_timer_stop();
+        c->idle_stops++;
+    } else {
+        lapic_timer_deadline(event);
+    }
+}
+
+/**
+ * Have the scheduler of cpu run as soon as possible, e.g. because a process
+ * became runnable there while its timer is stopped or armed for a later event
+ * NOTE: must be called with interrupts disabled
+ */
+static void proc_resched(size_t cpu)
+{
+    if (cpu == smp_cpu_id())
+        lapic_timer_oneshot(0);
+    else
+        smp_send_ipi(cpu, IDT_VECTOR_TIMER);
+}
+
+// Wake up an idle processor to take a process from cpu if it has several
+// runnable ones (idle processors do not balance periodically)
+static void proc_kick_idle(size_t cpu)
+{
+    if (proc_cpus[cpu].nr_running < 2)
+        return;
+
+    for (size_t i = 0; i < smp_cpu_count(); i++) {
+        if (i != cpu && percpu_of(i)->curr == &proc_cpus[i].idle) {
+            proc_resched(i);
+            return;
+        }
+    }
+}
+
+// Switch the calling processor to the address space and context of next
+static void proc_switch(proc_t *next, uint64_t now)
+{
+    proc_t *prev = percpu_get(curr);
+
+    // A process woken up right after going to sleep keeps running
+    if (next == prev) {
+        next->state = PROC_RUNNING;
+        return;
+    }
+
+    // Update process state (unless it went to sleep)
+    if (prev->state == PROC_RUNNING) {
+        prev->state = PROC_ACTIVE;
+        prev->ready_since = now;
+    }
+    prev->on_cpu = false;
+    fpu_switch(prev);
+
+    // Clean current process memory map
+    proc_mem_unmap(prev);
+
+    percpu_set(curr, next);
+    next->on_cpu = true;
+    vdso_update_cpu(smp_cpu_id(), next->pid, proc_this_cpu()->nr_running);
+
+    // Setup next process memory map
+    proc_mem_map(next);
+
+    // Invalidate TLB cache
+    set_cr3(get_cr3());
+
+    // Set next process to RUNNING
+    next->state = PROC_RUNNING;
+    next->wait_time += now - next->ready_since;
+
+    // Interrupts from user mode enter on the kernel stack of next
+    if (next->kstack)
+        gdt_set_kernel_stack(smp_cpu_id(), (uintptr_t)next->kstack + PROC_KSTACK_SIZE);
+
+    // Continue on the kernel stack of next. prev returns from here once it is
+    // switched back in (possibly on another processor).
+    proc_switch_stack(&prev->ksp, next->ksp);
+}
+
+/**
+ * Release the run queue lock taken by proc_next() (called on the kernel stack
+ * of the process switched to, see proc_switch())
+ */
+void proc_finish_switch(void)
+{
+    lock_ticket_unlock(&proc_this_cpu()->lock);
+}
+
+// Make a sleeping process runnable again (with the run queue lock of its
+// processor held)
+static void proc_unblock(proc_t *proc)
+{
+    proc->state = PROC_ACTIVE;
+    proc->ready_since = rdtsc();
+    proc_enqueue(proc);
+    proc_resched(proc->cpu);
+    proc_kick_idle(proc->cpu);
+}
+
+// Wake up processes on c whose timed sleep has ended
+static void proc_wake_sleepers(proc_cpu_t *c, uint64_t now)
+{
+    rb_node_t *node;
+    while ((node = rb_first(&c->sleepers))) {
+        proc_t *proc = rb_entry(node, proc_t, rq_node);
+        if (proc->wake_time > now)
+            break;
+        rb_erase(&c->sleepers, node);
+        proc_unblock(proc);
+    }
+}
+
+// Return the process picked by the first class with a runnable one on cpu
+static proc_t * proc_pick_next(size_t cpu, proc_t *curr, uint64_t now)
+{
+    proc_t *next = NULL;
+    for (size_t i = 0; !next && i < PROC_SCHED_CLASSES; i++) {
+        proc_t *class_curr = curr && curr->sched == i ? curr : NULL;
+        next = proc_classes[i]->pick_next(cpu, class_curr, now);
+    }
+    return next;
+}
+
+// Return the processor with the highest load among those with at least two
+// runnable processes more than cpu, or cpu if there is none
+static size_t proc_busiest(size_t cpu)
+{
+    size_t busiest = cpu;
+    for (size_t i = 0; i < smp_cpu_count(); i++) {
+        const proc_cpu_t *c = &proc_cpus[i];
+        if (c->nr_running < proc_cpus[cpu].nr_running + 2)
+            continue;
+        if (busiest == cpu || c->load > proc_cpus[busiest].load)
+            busiest = i;
+    }
+    return busiest;
+}
+
+/**
+ * Move a process from the run queues of from to those of cpu, whose run queue
+ * lock is held. The lock of from is only tried: every processor takes its own
+ * lock first, so waiting for it could deadlock.
+ * RETURN
+ *  false if no process was moved
+ */
+static bool proc_pull(size_t cpu, size_t from)
+{
+    proc_cpu_t *src = &proc_cpus[from];
+    if (!lock_ticket_try(&src->lock))
+        return false;
+
+    proc_t *proc = NULL;
+    for (size_t i = 0; !proc && i < PROC_SCHED_CLASSES; i++)
+        proc = proc_classes[i]->steal(from, cpu);
+    if (proc) {
+        src->nr_running--;
+        proc_cpus[cpu].nr_running++;
+    }
+
+    lock_ticket_unlock(&src->lock);
+    return proc != NULL;
+}
+
+// Update the load of cpu and pull a process from the busiest processor. The
+// load is the number of runnable processes scaled by the fraction of the last
+// interval the processor was busy, averaged with the previous load so that a
+// short burst does not trigger migrations.
+static void proc_balance(size_t cpu, uint64_t now)
+{
+    proc_cpu_t *c = &proc_cpus[cpu];
+
+    const uint64_t interval = now - c->balance_last;
+    const uint64_t busy = c->busy < interval ? c->busy : interval;
+    const uint32_t sample = c->nr_running * PROC_LOAD_SCALE * busy / interval;
+    c->load = (c->load + sample) / 2;
+    c->busy = 0;
+    c->balance_last = now;
+
+    const size_t busiest = proc_busiest(cpu);
+    if (busiest != cpu && proc_pull(cpu, busiest))
+        c->pulls++;
+}
+
+/**
+ * Schedule the next process (called on every timer interrupt with the context
+ * of the interrupted process on its kernel stack)
+ * NOTE: returns on the kernel stack of the next process
+ */
+void proc_next(proc_ctxt_t *ctxt)
+{
+    const size_t cpu = smp_cpu_id();
+    proc_cpu_t *c = &proc_cpus[cpu];
+    lock_ticket(&c->lock);
+
+    const uint64_t now = rdtsc();
+    const uint64_t delta = now - c->exec_start;
+    c->exec_start = now;
+
+    // Charge the current process for the time since it was last charged, by
+    // the privilege level it was interrupted at (a process that just went to
+    // sleep has already left its run queue)
+    proc_t *curr = percpu_get(curr);
+    curr->ctxt = ctxt;
+    if (ctxt->cs & 3)
+        curr->utime += delta;
+    else
+        curr->stime += delta;
+    if (curr != &c->idle)
+        c->busy += delta;
+    if (curr->state != PROC_RUNNING || curr == &c->idle)
+        curr = NULL;
+    else
+        proc_classes[curr->sched]->tick(curr, delta, now);
+
+    proc_wake_sleepers(c, now);
+
+    if (now - c->balance_last >= clock_us_to_tsc(PROC_BALANCE_US))
+        proc_balance(cpu, now);
+
+    // An idle processor takes a process from the busiest one
+    proc_t *next = proc_pick_next(cpu, curr, now);
+    if (!next) {
+        const size_t busiest = proc_busiest(cpu);
+        if (busiest != cpu && proc_pull(cpu, busiest)) {
+            c->steals++;
+            next = proc_pick_next(cpu, NULL, now);
+        }
+    }
+    if (!next)
+        next = &c->idle;
+
+    proc_timer_program(cpu, now, next);
+    proc_switch(next, now);
+
+    // The processor may differ from the one that switched this process out
+    proc_finish_switch();
+}
+
+// Enter the scheduler as if the timer had fired (but without acknowledging an
+// interrupt at the local APIC)
+static inline void proc_schedule(void)
+{
+    asm volatile ("int %0\n\t" : : "i" (IDT_VECTOR_YIELD));
+}
+
+// Give up the rest of the time slice of the current process (the interrupt
+// flag is restored, e.g. it stays clear on the system call path)
+void proc_yield(void)
+{
+    const flags_reg_t flags = get_flags();
+    cli();
+    proc_cpu_t *c = proc_this_cpu();
+    lock_ticket(&c->lock);
+    proc_t *curr = percpu_get(curr);
+    proc_classes[curr->sched]->yield(curr);
+    lock_ticket_unlock(&c->lock);
+    proc_schedule();
+    set_flags(flags);
 }
 
-void proc_store_ctxt(proc_ctxt_t *ctxt)
+// Take the current process off its run queue (with the run queue lock of the
+// calling processor held)
+static proc_t * proc_block(void)
 {
-    proc_table[PID].ctxt = *ctxt;
+    proc_t *curr = percpu_get(curr);
+    proc_dequeue(curr);
+    curr->state = PROC_SLEEPING;
+    return curr;
 }
 
-void proc_load_ctxt(proc_ctxt_t *ctxt)
+/**
+ * Put the current process to sleep until it is woken up by proc_wake_up() or
+ * proc_wake_up_one() on queue
+ * NOTE: must be called with the kernel lock held (see smp_lock_kernel()),
+ * after checking the condition waited for so that no wakeup is lost. The lock
+ * is released while the process sleeps and held again on return. PID 0 must
+ * never sleep.
+ */
+void proc_sleep_on(proc_wait_queue_t *queue)
 {
-    *ctxt = proc_table[PID].ctxt;
+    proc_cpu_t *c = proc_this_cpu();
+    lock_ticket(&c->lock);
+    proc_t *curr = proc_block();
+    lock_ticket_unlock(&c->lock);
+
+    curr->rq_next = NULL;
+    curr->rq_prev = queue->end;
+    if (queue->end)
+        queue->end->rq_next = curr;
+    else
+        queue->start = curr;
+    queue->end = curr;
+
+    // Wakers hold the kernel lock, so it is released only once the process is
+    // on queue (interrupts stay disabled)
+    smp_unlock_kernel(get_flags());
+    proc_schedule();
+    smp_lock_kernel();
 }
 
-// Schedule the next process
-void proc_next(void)
+/**
+ * Wake up the process that has been sleeping on queue the longest
+ * NOTE: must be called with the kernel lock held
+ * RETURN
+ *  false if no process was sleeping on queue
+ */
+bool proc_wake_up_one(proc_wait_queue_t *queue)
 {
-    // Perform context switch if necessary
-    if (--proc_table[PID].exec_count == 0) {
+    proc_t *proc = queue->start;
+    if (!proc)
+        return false;
 
-        // Reset execution count
-        proc_table[PID].exec_count = proc_table[PID].priority;
+    queue->start = proc->rq_next;
+    if (queue->start)
+        queue->start->rq_prev = NULL;
+    else
+        queue->end = NULL;
 
-        // Place current pid to end of queue
-        proc_queue_end->next = proc_queue_start;
-        proc_queue_end = proc_queue_start;
-        proc_queue_start = proc_queue_end->next;
-        proc_queue_end->next = NULL;
+    proc_cpu_t *c = proc_lock_rq(proc);
+    proc_unblock(proc);
+    lock_ticket_unlock(&c->lock);
+    return true;
+}
+
+/**
+ * Wake up all processes sleeping on queue
+ * NOTE: must be called with the kernel lock held
+ * RETURN
+ *  number of processes woken up
+ */
+size_t proc_wake_up(proc_wait_queue_t *queue)
+{
+    size_t woken = 0;
+    while (proc_wake_up_one(queue))
+        woken++;
+    return woken;
+}
 
-        // Update process state
-        proc_table[PID].state = PROC_ACTIVE;
+/**
+ * Put the current process to sleep for (at least) us microseconds
+ * NOTE: must be called with interrupts disabled and returns with interrupts
+ * disabled. PID 0 must never sleep.
+ */
+void proc_sleep(uint64_t us)
+{
+    proc_cpu_t *c = proc_this_cpu();
+    lock_ticket(&c->lock);
 
-        // Clean current process memory map
-        proc_mem_unmap(PID);
+    proc_t *curr = proc_block();
+    curr->wake_time = rdtsc() + clock_us_to_tsc(us);
 
-        // Get next PID from start of the queue
-        PID = proc_queue_start->pid;
+    rb_node_t **link = &c->sleepers.root;
+    rb_node_t *parent = NULL;
+    while (*link) {
+        parent = *link;
+        if (curr->wake_time < rb_entry(parent, proc_t, rq_node)->wake_time)
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+    rb_insert(&c->sleepers, &curr->rq_node, parent, link);
 
-        // Setup next process memory map
-        proc_mem_map(PID);
+    lock_ticket_unlock(&c->lock);
+    proc_schedule();
+}
 
-        // Invalidate TLB cache
-        set_cr3(get_cr3());
+/**
+ * Keep every processor from switching processes, so that page table entries
+ * of pid can be changed without leaving stale TLB entries on another processor
+ * (which would need a TLB shootdown). Release with proc_release().
+ * NOTE: must be called with interrupts disabled (e.g. with the kernel lock
+ * held). Use proc_is_running() to check other processes while holding.
+ * RETURN
+ *  false (without holding) if pid is running on another processor
+ */
+bool proc_hold(pid_t pid)
+{
+    for (size_t cpu = 0; cpu < smp_cpu_count(); cpu++)
+        lock_ticket(&proc_cpus[cpu].lock);
 
-        // Set next process to RUNNING
-        proc_table[PID].state = PROC_RUNNING;
+    if (proc_is_running(pid)) {
+        proc_release();
+        return false;
     }
+    return true;
+}
+
+// Let processors switch processes again (see proc_hold())
+void proc_release(void)
+{
+    for (size_t cpu = 0; cpu < smp_cpu_count(); cpu++)
+        lock_ticket_unlock(&proc_cpus[cpu].lock);
+}
+
+// Return whether pid is the current process of another processor
+bool proc_is_running(pid_t pid)
+{
+    const proc_t *proc = &proc_table[pid];
+    return proc->on_cpu && proc->cpu != smp_cpu_id();
+}
+
+/**
+ * Return the other processors whose TLB may cache user mappings of pid
+ * NOTE: read after changing the page table entries of pid, since a processor
+ * that switches to pid afterwards flushes its TLB anyway (see proc_switch())
+ */
+tlb_cpus_t proc_tlb_cpus(pid_t pid)
+{
+    const proc_t *proc = &proc_table[pid];
+    return proc_is_running(pid) ? (tlb_cpus_t)1 << proc->cpu : 0;
 }
 
 // Map process memory space
-static void proc_mem_map(pid_t pid)
+static void proc_mem_map(const proc_t *proc)
 {
     // Map process page tables
-    proc_page_node_t *n = proc_table[pid].page_tables;
+    proc_page_node_t *n = proc->page_tables;
     while (n) {
         page_set_dir_entry(n->page_dir_idx, n->page_table_vma, n->page_dir_entry);
         n = n->next;
@@ -90,10 +620,10 @@ static void proc_mem_map(pid_t pid)
 }
 
 // Unmap process memory space
-static void proc_mem_unmap(pid_t pid)
+static void proc_mem_unmap(const proc_t *proc)
 {
     // Unmap process page tables
-    proc_page_node_t *n = proc_table[pid].page_tables;
+    proc_page_node_t *n = proc->page_tables;
     while (n) {
         // Wipe page directory entry
         page_set_dir_entry(n->page_dir_idx, (page_entry_t)0, (page_entry_t)0);
@@ -107,6 +637,43 @@ static inline bool proc_pid_taken(pid_t pid)
     return (bool)proc_table[pid].state;
 }
 
+// Return whether pid belongs to a registered process
+bool proc_is_alive(pid_t pid)
+{
+    return proc_pid_taken(pid);
+}
+
+// Return one past the highest PID in use (for iterating over the table)
+pid_t proc_get_pid_end(void)
+{
+    return proc_pid_end;
+}
+
+// Return working-set statistics of a process
+wss_proc_t * proc_get_wss(pid_t pid)
+{
+    return proc_table[pid].wss;
+}
+
+// Return virtual memory areas of a process
+vma_space_t * proc_get_vmas(pid_t pid)
+{
+    return proc_table[pid].vmas;
+}
+
+// Invoke fn on every non-empty page table entry of a process
+void proc_for_each_page(pid_t pid, proc_page_fn_t fn, void *arg)
+{
+    proc_page_node_t *n = __atomic_load_n(&proc_table[pid].page_tables, __ATOMIC_ACQUIRE);
+    for ( ; n; n = n->next) {
+        page_entry_t *table = (void*)n->page_table_vma;
+        for (uintptr_t i = 0; i < PAGE_ENTRIES; i++) {
+            if (table[i])
+                fn(pid, n->page_dir_idx << 22 | i << 12, &table[i], arg);
+        }
+    }
+}
+
 // Return next available PID
 static pid_t proc_new_pid(void)
 {
@@ -119,7 +686,8 @@ static pid_t proc_new_pid(void)
 static void proc_page_table_register(
                 pid_t pid, uintptr_t table_vma, uintptr_t space_vma, uintptr_t flags)
 {
-    // Prepend new node to page_tables linked list
+    // Prepend new node to page_tables linked list. Nodes are never removed, so
+    // the list is walked without locks once the node is published.
     proc_page_node_t *table_node = kmalloc(sizeof(*table_node));
     *table_node = (proc_page_node_t) {
         .next = proc_table[pid].page_tables,
@@ -127,114 +695,561 @@ static void proc_page_table_register(
         .page_dir_entry = page_get_pma(table_vma) | flags,
         .page_table_vma = table_vma,
     };
-    proc_table[pid].page_tables = table_node;
+    __atomic_store_n(&proc_table[pid].page_tables, table_node, __ATOMIC_RELEASE);
 }
 
-static void proc_page_register(uintptr_t table_vma, uintptr_t vma, page_entry_t entry)
+/**
+ * Return pointer to the page table entry of vma in the address space of pid
+ *  create: allocate the page table if it does not exist yet
+ * NOTE: must be called with the lock of the address space of pid held (see
+ * vma_lock()), and with the kernel lock as well if create is true
+ * RETURN
+ *  NULL if the page table does not exist and create is false
+ */
+page_entry_t * proc_get_pte(pid_t pid, uintptr_t vma, bool create)
 {
-    ((page_entry_t*)table_vma)[vma >> 12 & 0x3ff] = entry;
+    const uintptr_t idx = vma >> 22;
+    proc_page_node_t *n = __atomic_load_n(&proc_table[pid].page_tables, __ATOMIC_ACQUIRE);
+    while (n && n->page_dir_idx != idx)
+        n = n->next;
+
+    if (!n) {
+        if (!create)
+            return NULL;
+
+        const uintptr_t table = (uintptr_t)kalloc(PAGE_GET_DEFAULT, PAGE_SIZE, PAGE_SIZE);
+        page_clear(table);
+        proc_page_table_register(pid, table, vma,
+                                 PAGE_PUBLIC | PAGE_WRITE | PAGE_PRESENT);
+        n = proc_table[pid].page_tables;
+
+        // Tables of the running process are mapped right away (a process is
+        // only given new tables on the processor it runs on)
+        if (&proc_table[pid] == percpu_get(curr))
+            page_set_dir_entry(idx, table, n->page_dir_entry);
+    }
+
+    return &((page_entry_t*)n->page_table_vma)[vma >> 12 & 0x3ff];
 }
 
-// Add pid to process queue
-static void proc_queue_add(pid_t pid)
+/**
+ * Map the 4 MiB at vma in the address space of pid with a large page (entry
+ * with PAGE_LARGE set), or map its page table again if entry is 0. The page
+ * table stays allocated but empty while the large page is mapped, so walkers
+ * of the page tables (see proc_for_each_page()) never see the large page.
+ * NOTE: must be called with the locks of proc_get_pte() (create) held, after
+ * creating the page table of vma with it
+ */
+void proc_set_large_page(pid_t pid, uintptr_t vma, page_entry_t entry)
 {
-    if (proc_queue_end) {
-        pid_node_t *old_end = proc_queue_end;
-        proc_queue_end = kmalloc(sizeof(pid_node_t));
-        old_end->next = proc_queue_end;
-    } else {
-        proc_queue_start = kmalloc(sizeof(pid_node_t));
-        proc_queue_end = proc_queue_start;
+    const uintptr_t idx = vma >> 22;
+    proc_page_node_t *n = proc_table[pid].page_tables;
+    while (n->page_dir_idx != idx)
+        n = n->next;
+
+    if (!entry)
+        entry = page_get_pma(n->page_table_vma)
+                | PAGE_PUBLIC | PAGE_WRITE | PAGE_PRESENT;
+    n->page_dir_entry = entry;
+
+    if (&proc_table[pid] == percpu_get(curr)) {
+        page_set_dir_entry(idx, n->page_table_vma, entry);
+        invlpg(vma);
     }
+}
+
+// Return the processor with the fewest runnable processes
+static size_t proc_least_loaded(void)
+{
+    size_t least = 0;
+    for (size_t cpu = 1; cpu < smp_cpu_count(); cpu++) {
+        if (proc_cpus[cpu].nr_running < proc_cpus[least].nr_running)
+            least = cpu;
+    }
+    return least;
+}
 
-    proc_queue_end->pid = pid;
-    proc_queue_end->next = NULL;
+// Make pid runnable in its scheduling class on cpu
+static void proc_queue_add(pid_t pid, size_t cpu)
+{
+    proc_t *proc = &proc_table[pid];
+
+    const flags_reg_t flags = get_flags();
+    cli();
+    proc_cpu_t *c = &proc_cpus[cpu];
+    lock_ticket(&c->lock);
+    proc->cpu = cpu;
+    proc_enqueue(proc);
+    proc_resched(cpu);
+    proc_kick_idle(cpu);
+    lock_ticket_unlock(&c->lock);
+    set_flags(flags);
 
     proc_num++;
 }
 
-// Register process for execution in process table
+// Set up process table entry and address space for a new process
 // TODO switch from entry point to inode_t parameter
-static pid_t proc_register(void (*entry_point)(void), pc_t priority)
+static pid_t proc_create(void (*entry_point)(void), pc_t priority, uint8_t level)
 {
     pid_t pid = proc_new_pid();
 
     proc_t *proc = &proc_table[pid];
 
-    proc->ctxt.eip = (uintptr_t)entry_point;
-    proc->ctxt.ss = GDT_SEL_DATA_PL3;
-    proc->ctxt.gs = GDT_SEL_DATA_PL3;
-    proc->ctxt.fs = GDT_SEL_DATA_PL3;
-    proc->ctxt.es = GDT_SEL_DATA_PL3;
-    proc->ctxt.ds = GDT_SEL_DATA_PL3;
-    proc->ctxt.cs = GDT_SEL_CODE_PL3;
-    proc->ctxt.esp = KERNEL_START_VMA;
-    proc->ctxt.eflags = 0x3202;  // Set IF flag, IOPL = 3
+    if (pid >= proc_pid_end)
+        proc_pid_end = pid + 1;
+
+    proc_stack_init(proc, entry_point, true);
 
     proc->state = PROC_ACTIVE;
+    proc->start_time = clock_get_ns();
+    proc->ready_since = rdtsc();
     proc->exec_count = priority;
     proc->priority = priority;
+    proc->level = level;
+    proc->sched = proc_sched_default;
+    proc->pid = pid;
+
+    proc->fpu = NULL;
+    proc->wss = kmalloc(sizeof(*proc->wss));
+    memset(proc->wss, 0, sizeof(*proc->wss));
+
+    // Register memory space (pages are mapped on first access by vma_fault())
+    proc->vmas = vma_space_new();
+
+    return pid;
+}
+
+// Register process for execution in process table
+pid_t proc_register(void (*entry_point)(void), pc_t priority, uint8_t level)
+{
+    const pid_t pid = proc_create(entry_point, priority, level);
+
+    // Add to the process queue of the least loaded processor
+    proc_queue_add(pid, proc_least_loaded());
+
+    return pid;
+}
+
+// Return EDF parameters in TSC cycles
+static inline proc_edf_t proc_edf_params(uint64_t runtime_us, uint64_t deadline_us,
+                                         uint64_t period_us)
+{
+    return (proc_edf_t) {
+        .runtime = clock_us_to_tsc(runtime_us),
+        .deadline = clock_us_to_tsc(deadline_us),
+        .period = clock_us_to_tsc(period_us),
+    };
+}
 
-    // Register memory space
+/**
+ * Register real-time process that needs runtime_us microseconds in every
+ * period, each time within deadline_us of its release. It is placed on the
+ * first processor that admits it.
+ * RETURN
+ *  PID of the new process, or 0 if admission was refused by every processor
+ *  (see sched_edf_admit())
+ */
+static pid_t proc_register_edf(void (*entry_point)(void), uint64_t runtime_us,
+                               uint64_t deadline_us, uint64_t period_us)
+{
+    const proc_edf_t edf = proc_edf_params(runtime_us, deadline_us, period_us);
 
-    // Map page table for user stack
-    uintptr_t table = (uintptr_t)kalloc(PAGE_GET_DEFAULT, PAGE_SIZE, PAGE_SIZE);
-    const uintptr_t stack_page_vma = proc->ctxt.esp - PAGE_SIZE;
-    const uintptr_t user_data_flags = PAGE_PUBLIC | PAGE_WRITE | PAGE_PRESENT;
+    size_t cpu = 0;
+    while (!sched_edf_admit(cpu, edf.runtime, edf.deadline, edf.period)) {
+        if (++cpu == smp_cpu_count())
+            return 0;
+    }
 
-    proc_page_table_register(pid, table, stack_page_vma, user_data_flags);
-    proc_page_register(table, stack_page_vma, PAGE_GET_DEFAULT() | user_data_flags);
+    const pid_t pid = proc_create(entry_point, 1, PROC_LEVEL_DEFAULT);
+    proc_t *proc = &proc_table[pid];
 
-    // Add to process queue
-    proc_queue_add(pid);
+    proc->sched = PROC_SCHED_EDF;
+    proc->edf = edf;
+    proc_queue_add(pid, cpu);
 
     return pid;
 }
 
+/**
+ * Move process to another scheduling class
+ * NOTE: use proc_set_edf() to move a process to the EDF class
+ * RETURN
+ *  false if pid is not alive or sched is not a valid class
+ */
+bool proc_set_sched(pid_t pid, proc_sched_t sched)
+{
+    if (sched == PROC_SCHED_EDF || sched >= PROC_SCHED_CLASSES || !proc_is_alive(pid))
+        return false;
+
+    const flags_reg_t flags = get_flags();
+    cli();
+    proc_t *proc = &proc_table[pid];
+    proc_cpu_t *c = proc_lock_rq(proc);
+    const bool runnable = proc->state != PROC_SLEEPING;
+    if (runnable)
+        proc_dequeue(proc);
+    if (proc->sched == PROC_SCHED_EDF)
+        sched_edf_leave(proc);
+    proc->sched = sched;
+    if (runnable) {
+        proc_enqueue(proc);
+        proc_resched(proc->cpu);
+    }
+    lock_ticket_unlock(&c->lock);
+    set_flags(flags);
+
+    return true;
+}
+
+/**
+ * Move process to the EDF class (see proc_register_edf())
+ * NOTE: the process stays on its processor, which must admit it
+ * RETURN
+ *  false if pid is not alive, already in the EDF class, or admission was
+ *  refused
+ */
+bool proc_set_edf(pid_t pid, uint64_t runtime_us, uint64_t deadline_us,
+                  uint64_t period_us)
+{
+    if (!proc_is_alive(pid) || proc_table[pid].sched == PROC_SCHED_EDF)
+        return false;
+
+    const proc_edf_t edf = proc_edf_params(runtime_us, deadline_us, period_us);
+
+    const flags_reg_t flags = get_flags();
+    cli();
+    proc_t *proc = &proc_table[pid];
+    proc_cpu_t *c = proc_lock_rq(proc);
+    const bool admitted = sched_edf_admit(proc->cpu, edf.runtime, edf.deadline,
+                                          edf.period);
+    if (admitted) {
+        const bool runnable = proc->state != PROC_SLEEPING;
+        if (runnable)
+            proc_dequeue(proc);
+        proc->sched = PROC_SCHED_EDF;
+        proc->edf = edf;
+        if (runnable) {
+            proc_enqueue(proc);
+            proc_resched(proc->cpu);
+        }
+    }
+    lock_ticket_unlock(&c->lock);
+    set_flags(flags);
+
+    return admitted;
+}
+
 // Test process
 static void proc1(void)
 {
+    // System calls only accept user memory, but string literals live in the
+    // kernel image, so the character is written from the user stack
+    char c = '1';
     while (1) {
-        printk("1");
+        syscall(SYSCALL_WRITE, (reg_t)&c, 1, 0);
     }
 }
 
 // Test process
 static void proc2(void)
 {
+    char c = '2';
     while (1) {
-        printk("2");
+        syscall(SYSCALL_WRITE, (reg_t)&c, 1, 0);
     }
 }
 
 // Test process
 static void proc3(void)
 {
+    char c = '3';
+    while (1) {
+        syscall(SYSCALL_WRITE, (reg_t)&c, 1, 0);
+    }
+}
+
+// Test process (real-time)
+static void proc4(void)
+{
+    char c = '4';
+    while (1) {
+        syscall(SYSCALL_WRITE, (reg_t)&c, 1, 0);
+    }
+}
+
+// Test process (system calls on its own address space)
+static void proc5(void)
+{
+    const size_t len = PROC_TEST_PAGES * PAGE_SIZE;
+    char c = '5';
     while (1) {
-        printk("3");
+        // Grow the heap, write to every page and shrink it again
+        const uintptr_t brk = syscall(SYSCALL_BRK, 0, 0, 0);
+        bool ok = syscall(SYSCALL_BRK, brk + len, 0, 0) == brk + len;
+        for (uintptr_t p = brk; ok && p < brk + len; p += PAGE_SIZE) {
+            *(volatile uintptr_t*)p = p;
+            ok = *(volatile uintptr_t*)p == p;
+        }
+        ok = syscall(SYSCALL_BRK, brk, 0, 0) == brk && ok;
+
+        // Map memory anywhere, write to it and unmap it again
+        const reg_t addr = syscall(SYSCALL_MMAP, 0, len,
+                                   VMA_PROT_READ | VMA_PROT_WRITE);
+        if (addr == (reg_t)SYSCALL_ERROR) {
+            ok = false;
+        } else {
+            for (uintptr_t p = addr; p < addr + len; p += PAGE_SIZE) {
+                *(volatile uintptr_t*)p = p;
+                ok = ok && *(volatile uintptr_t*)p == p;
+            }
+            ok = syscall(SYSCALL_MUNMAP, addr, len, 0) == 0 && ok;
+        }
+
+        // Map a large page if a block is available, touch both of its ends
+        // and unmap it again (it can only be unmapped as a whole)
+        const reg_t large = syscall(SYSCALL_MMAP, 0, PAGE_BLOCK_SIZE,
+                                    VMA_PROT_READ | VMA_PROT_WRITE | VMA_MAP_LARGE);
+        if (large != (reg_t)SYSCALL_ERROR) {
+            const uintptr_t last = large + PAGE_BLOCK_SIZE - sizeof(uintptr_t);
+            ok = ok && !(large & (PAGE_BLOCK_SIZE - 1))
+                 && *(volatile uintptr_t*)large == 0
+                 && *(volatile uintptr_t*)last == 0;
+            *(volatile uintptr_t*)last = last;
+            ok = ok && *(volatile uintptr_t*)last == last
+                 && syscall(SYSCALL_MUNMAP, large, PAGE_SIZE, 0)
+                    == (reg_t)SYSCALL_ERROR
+                 && syscall(SYSCALL_MUNMAP, large, PAGE_BLOCK_SIZE, 0) == 0;
+        }
+
+        // Misaligned, kernel and unmapped ranges are refused
+        ok = ok
+             && syscall(SYSCALL_MMAP, VMA_MMAP_BASE + 1, len, VMA_PROT_READ)
+                == (reg_t)SYSCALL_ERROR
+             && syscall(SYSCALL_MUNMAP, KERNEL_START_VMA, len, 0)
+                == (reg_t)SYSCALL_ERROR
+             && syscall(SYSCALL_WRITE, KERNEL_START_VMA, 1, 0)
+                == (reg_t)SYSCALL_ERROR
+             && syscall(SYSCALL_WRITE, addr, 1, 0) == (reg_t)SYSCALL_ERROR;
+
+        c = ok ? '5' : 'E';
+        syscall(SYSCALL_WRITE, (reg_t)&c, 1, 0);
+    }
+}
+
+// Test process (sleeps on an event until proc7 signals it, then answers)
+static void proc6(void)
+{
+    char c = '6';
+    reg_t pings = 0;
+    while (1) {
+        pings = syscall(SYSCALL_WAIT, PROC_TEST_PING, pings, 0);
+        syscall(SYSCALL_WRITE, (reg_t)&c, 1, 0);
+        syscall(SYSCALL_SIGNAL, PROC_TEST_PONG, 1, 0);
+    }
+}
+
+// Test process (wakes up proc6 and sleeps until it answers)
+static void proc7(void)
+{
+    char c = '7';
+    reg_t pongs = 0;
+    while (1) {
+        syscall(SYSCALL_SIGNAL, PROC_TEST_PING, 0, 0);
+        pongs = syscall(SYSCALL_WAIT, PROC_TEST_PONG, pongs, 0);
+        syscall(SYSCALL_WRITE, (reg_t)&c, 1, 0);
+    }
+}
+
+// Test process (moves itself through the scheduling classes and back)
+static void proc8(void)
+{
+    const proc_sched_t classes[] = {
+        PROC_SCHED_RR,
+        PROC_SCHED_CFS,
+        PROC_SCHED_RR,
+        PROC_SCHED_EDF,
+        proc_sched_default,
+    };
+    while (1) {
+        for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+            const reg_t ret = syscall(SYSCALL_SCHED, classes[i], PROC_TICK_US,
+                                      8 * PROC_TICK_US);
+            // The processor may refuse admission to the EDF class
+            const char c = !ret || classes[i] == PROC_SCHED_EDF ? '8' : 'E';
+            syscall(SYSCALL_WRITE, (reg_t)&c, 1, 0);
+        }
+    }
+}
+
+// Busy process of proc_bench_sched()
+static void proc_bench_busy(void)
+{
+    while (1) {
+        asm volatile ("");
+    }
+}
+
+/**
+ * Benchmark scheduling throughput: spawn n processes that never block and let
+ * PID 0 report after PROC_BENCH_US how much CPU time they got in total (which
+ * should approach min(n, processors) CPUs) and how evenly it was shared
+ */
+void proc_bench_sched(size_t n)
+{
+    printk("proc_bench_sched: %u processes on %u processor(s)\n", n, smp_cpu_count());
+
+    proc_bench_start = rdtsc();
+    for (size_t i = 0; i < n; i++) {
+        const pid_t pid = proc_register(&proc_bench_busy, 10, PROC_LEVEL_DEFAULT);
+        if (!i)
+            proc_bench_first = pid;
+    }
+    proc_bench_n = n;
+}
+
+// Print results of proc_bench_sched() once it has run long enough
+static void proc_bench_report(void)
+{
+    if (!proc_bench_n)
+        return;
+
+    const uint64_t elapsed = rdtsc() - proc_bench_start;
+    if (elapsed < clock_us_to_tsc(PROC_BENCH_US))
+        return;
+
+    uint64_t total = 0;
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+    for (size_t i = 0; i < proc_bench_n; i++) {
+        const uint64_t utime = proc_table[proc_bench_first + i].utime;
+        total += utime;
+        if (utime < min)
+            min = utime;
+        if (utime > max)
+            max = utime;
+    }
+
+    const size_t cpus = smp_cpu_count();
+    const size_t ideal = proc_bench_n < cpus ? proc_bench_n : cpus;
+    printk("proc_bench_sched: %lu ms: %lu%% of a CPU in total (ideal: %u%%)\n",
+           clock_tsc_to_ns(elapsed) / 1000000, total * 100 / elapsed, ideal * 100);
+    printk("proc_bench_sched: share per process: min: %lu%%, max: %lu%%\n",
+           min * 100 / elapsed, max * 100 / elapsed);
+    for (size_t cpu = 0; cpu < cpus; cpu++) {
+        printk("proc_bench_sched: CPU %u: runnable: %u, steals: %u, pulls: %u\n",
+               cpu, proc_cpus[cpu].nr_running, proc_cpus[cpu].steals,
+               proc_cpus[cpu].pulls);
     }
+    proc_bench_n = 0;
+}
+
+// Process me (0 or 1) of proc_bench_pingpong()
+static void proc_bench_pingpong_run(size_t me)
+{
+    while (1) {
+        const uint64_t now = rdtsc();
+        if (proc_pingpong_turn == !me) {
+            // The other process was switched out right after its last rdtsc
+            const uint64_t cycles = now - proc_pingpong_last[!me];
+            proc_pingpong_switches++;
+            proc_pingpong_cycles += cycles;
+            if (cycles < proc_pingpong_min)
+                proc_pingpong_min = cycles;
+        }
+        proc_pingpong_turn = me;
+        proc_pingpong_last[me] = now;
+    }
+}
+
+static void proc_bench_ping(void)
+{
+    proc_bench_pingpong_run(0);
+}
+
+static void proc_bench_pong(void)
+{
+    proc_bench_pingpong_run(1);
+}
+
+/**
+ * Benchmark context switches: pin two processes that never block to the last
+ * processor, where they preempt each other every tick, and let PID 0 report
+ * after PROC_BENCH_US the cycles from the last instruction of one to the first
+ * of the other (timer interrupt, scheduling and switch). With a single
+ * processor, switches to and from PID 0 are counted as well.
+ */
+void proc_bench_pingpong(void)
+{
+    const size_t cpu = smp_cpu_count() - 1;
+    printk("proc_bench_pingpong: 2 processes on CPU %u\n", cpu);
+
+    proc_pingpong_start = rdtsc();
+    void (* const entry_points[2])(void) = { &proc_bench_ping, &proc_bench_pong };
+    for (size_t i = 0; i < 2; i++) {
+        const pid_t pid = proc_create(entry_points[i], 1, PROC_LEVEL_DEFAULT);
+        proc_table[pid].pinned = true;
+        proc_queue_add(pid, cpu);
+    }
+    proc_pingpong_running = true;
+}
+
+// Print results of proc_bench_pingpong() once it has run long enough
+static void proc_bench_pingpong_report(void)
+{
+    if (!proc_pingpong_running
+        || rdtsc() - proc_pingpong_start < clock_us_to_tsc(PROC_BENCH_US))
+        return;
+
+    const uint64_t switches = proc_pingpong_switches;
+    if (switches) {
+        printk("proc_bench_pingpong: %lu switches, %lu cycles per switch (min: %lu)\n",
+               switches, proc_pingpong_cycles / switches, proc_pingpong_min);
+    } else {
+        printk("proc_bench_pingpong: no switches\n");
+    }
+    proc_pingpong_running = false;
 }
 
 proc_ctxt_t * proc_get_ctxt(pid_t pid)
 {
-    return &proc_table[pid].ctxt;
+    return proc_table[pid].ctxt;
 }
 
 void proc_dump_queue(void)
 {
-    pid_node_t *node = proc_queue_start;
     printk("proc_dump_queue:\n");
-    while (node) {
-        printk("    PID: %u, \n", node->pid);
-        node = node->next;
+    for (size_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        proc_cpu_t *c = &proc_cpus[cpu];
+        lock_ticket(&c->lock);
+        printk(" CPU %u: runnable: %u, load: %u, steals: %u, pulls: %u\n",
+               cpu, c->nr_running, c->load, c->steals, c->pulls);
+        for (size_t i = 0; i < PROC_SCHED_CLASSES; i++) {
+            printk("  %s:\n", proc_classes[i]->name);
+            proc_classes[i]->dump(cpu);
+        }
+        printk("  timer stops: %u\n", c->idle_stops);
+        printk("  sleeping:\n");
+        for (rb_node_t *n = rb_first(&c->sleepers); n; n = rb_next(n)) {
+            const proc_t *p = rb_entry(n, proc_t, rq_node);
+            printk("    PID: %u, wake_time: %lu\n", p->pid, p->wake_time);
+        }
+        lock_ticket_unlock(&c->lock);
     }
 }
 
 static void proc_print_ctxt(proc_ctxt_t *ctxt)
 {
     printk("proc_print_ctxt:\n");
-    printk("     ss: %p\n", ctxt->ss);
-    printk("    esp: %p\n", ctxt->esp);
+    if (!ctxt) {
+        printk("    (never switched out)\n");
+        return;
+    }
+    // Only present on privilege change
+    if (ctxt->cs & 3) {
+        printk("     ss: %p\n", ctxt->ss);
+        printk("    esp: %p\n", ctxt->esp);
+    }
     printk("  flags: %p\n", ctxt->eflags);
     printk("     cs: %p\n", ctxt->cs);
     printk("    eip: %p\n", ctxt->eip);
@@ -265,41 +1280,85 @@ void proc_info(pid_t pid)
     printk("proc_info (%u):\n", pid);
     printk("    ppid: %u\n", proc.ppid);
     printk("    inode_id: %p\n", proc.inode_id);
-    printk("    start_time: %u\n", proc.start_time);
+    printk("    start_time: %lu ns\n", proc.start_time);
     printk("    state: %s\n", state[proc.state]);
+    printk("    cpu: %u%s\n", proc.cpu, proc.pinned ? " (pinned)" : "");
     printk("    exec_count: %u\n", proc.exec_count);
-    proc_print_ctxt(&proc_table[pid].ctxt);
+    printk("    sched: %s\n", proc_classes[proc.sched]->name);
+    printk("    level: %u\n", proc.level);
+    printk("    utime: %lu ns, stime: %lu ns, wait: %lu ns\n",
+           clock_tsc_to_ns(proc.utime), clock_tsc_to_ns(proc.stime),
+           clock_tsc_to_ns(proc.wait_time));
+    printk("    vruntime: %lu\n", proc.vruntime);
+    if (proc.sched == PROC_SCHED_EDF) {
+        printk("    edf: runtime: %lu, deadline: %lu, period: %lu\n",
+               proc.edf.runtime, proc.edf.deadline, proc.edf.period);
+        printk("    edf: jobs: %u, misses: %u (total: %u)\n",
+               proc.edf.jobs, proc.edf.misses, sched_edf_misses());
+    }
+    proc_print_ctxt(proc_table[pid].ctxt);
 }
 
 void proc_init(void)
 {
     // Allocate process table
     proc_table = kmalloc(PID_MAX * sizeof(proc_t));
+    memset(proc_table, 0, PID_MAX * sizeof(proc_t));
 
-    // Initialize process queue
-    proc_queue_start = NULL;
-    proc_queue_end = NULL;
-
-    // Map page for scheduler stack
-    const void *stack_page = kalloc(PAGE_GET_DEFAULT, PAGE_SIZE, PAGE_SIZE);
-
-    // Configure TSS
-    TSS.esp0 = (uintptr_t)stack_page + PAGE_SIZE;
+    // Set up every processor to run its idle context (on the stack it booted
+    // on, see proc_loop_ap())
+    const uint64_t now = rdtsc();
+    for (size_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        proc_cpu_t *c = &proc_cpus[cpu];
+        c->idle.state = PROC_RUNNING;
+        c->idle.cpu = cpu;
+        c->idle.on_cpu = true;
+        c->idle.pinned = true;
+        c->exec_start = now;
+        lock_prof_add(&c->lock.stats, "run queue");
+        percpu_of(cpu)->curr = &c->idle;
+        percpu_of(cpu)->sched = c;
+        c->balance_last = now;
+    }
 
-    // Register kernel at PID zero
+    // Register kernel at PID zero (its background work stays on the BSP)
     proc_t *proc_kernel = &proc_table[0];
     proc_kernel->ppid = 0;
     proc_kernel->state = PROC_RUNNING;
     proc_kernel->exec_count = 1;
     proc_kernel->priority = 10;
+    proc_kernel->level = PROC_LEVEL_DEFAULT;
+    proc_kernel->sched = proc_sched_default;
+    proc_kernel->on_cpu = true;
+    proc_kernel->pinned = true;
+    proc_cpus[0].idle.on_cpu = false;
+    percpu_of(0)->curr = proc_kernel;
+
+    // The BSP boots as PID 0, so its idle context gets a stack of its own
+    proc_stack_init(&proc_cpus[0].idle, &proc_loop_ap, false);
+
+    // Initialize run queues
+    const uint64_t tick = clock_us_to_tsc(PROC_TICK_US);
+    for (size_t i = 0; i < PROC_SCHED_CLASSES; i++)
+        proc_classes[i]->init(tick);
 
     // Add kernel to execution queue
-    proc_queue_add(0);
+    proc_queue_add(0, 0);
     proc_num--; // We don't want the kernel to count as a running process
 
-    proc_register(&proc1, 30);
-    proc_register(&proc2, 10);
-    proc_register(&proc3, 10);
+#ifdef CONFIG_BENCH
+    // Benchmarks run without the test processes (see kernel_bench())
+    return;
+#endif
+
+    proc_register(&proc1, 30, PROC_LEVEL_DEFAULT);
+    proc_register(&proc2, 10, PROC_LEVEL_DEFAULT);
+    proc_register(&proc3, 10, PROC_LEVEL_DEFAULT);
+    proc_register(&proc5, 10, PROC_LEVEL_DEFAULT);
+    proc_register(&proc6, 10, PROC_LEVEL_DEFAULT);
+    proc_register(&proc7, 10, PROC_LEVEL_DEFAULT);
+    proc_register(&proc8, 10, PROC_LEVEL_DEFAULT);
+    proc_register_edf(&proc4, PROC_TICK_US, 4 * PROC_TICK_US, 8 * PROC_TICK_US);
 }
 
 // Process scheduling loop
@@ -313,6 +1372,32 @@ void proc_loop(void)
     // increased during runtime for power management
     sti();
     while (proc_num) {
+        // Merge identical user pages in the background
+        ksm_scan();
+        // Sample accessed/dirty bits of user pages
+        wss_sample();
+        // Compress cold user pages under memory pressure
+        zram_reclaim();
+        // Assemble a free 4 MiB block of physical memory
+        compact_idle();
+        proc_bench_report();
+        proc_bench_pingpong_report();
+        syscall_bench_report();
+        vdso_bench_report();
+        lock_bench_report();
+        lock_prof_report();
+        tlb_report();
+        halt();
+    }
+}
+
+// Idle loop of an application processor. It runs as the idle context of the
+// processor, which the scheduler switches to whenever none of its run queues
+// holds a runnable process.
+void proc_loop_ap(void)
+{
+    sti();
+    while (1) {
         halt();
     }
 }
@@ -5,7 +5,10 @@
 #ifndef _KERNEL_PROC_H
 #define _KERNEL_PROC_H
 
+#include "page.h"
+#include "rbtree.h"
 #include "std.h"
+#include "tlb.h"
 
 typedef uint16_t pid_t; // Process ID type
 typedef uint16_t pc_t;  // Process ID type
@@ -13,8 +16,42 @@ typedef uint16_t pc_t;  // Process ID type
 // Process constants
 enum {
     PID_MAX = 1 << (sizeof(pid_t) * BITS_PER_BYTE),
+    PROC_LEVELS = 32,           // Number of scheduling priority levels
+    PROC_LEVEL_DEFAULT = 16,    // Priority level of new processes (0 is highest)
+    PROC_TICK_US = 4000,        // Length of a scheduler tick (round-robin time
+                                // slices are a number of ticks)
+    PROC_BALANCE_US = 20000,    // Interval of periodic load balancing
+    PROC_LOAD_SCALE = 1024,     // Load of a single process that is always busy
+    PROC_BENCH_PROCS = 16,      // Busy processes spawned by proc_bench_sched()
+    PROC_BENCH_US = 2000000,    // Duration of proc_bench_sched() and
+                                // proc_bench_pingpong()
+    PROC_KSTACK_SIZE = 4096,    // Size of the kernel stack of a process
+    PROC_TEST_PAGES = 4,        // Pages mapped at a time by the test processes
+    PROC_TEST_PING = 0,         // Event signalled by proc7 (see SYSCALL_WAIT)
+    PROC_TEST_PONG = 1,         // Event signalled by proc6
 };
 
+// Scheduling classes, in order of precedence (see sched.h)
+typedef enum {
+    PROC_SCHED_EDF = 0, // Periodic real-time, earliest deadline first
+    PROC_SCHED_RR,      // Round-robin within priority levels
+    PROC_SCHED_CFS,     // Completely fair: run process with least virtual runtime
+    PROC_SCHED_CLASSES, // Number of scheduling classes
+} proc_sched_t;
+
+// EDF parameters and state of a real-time process (times in TSC cycles)
+typedef struct {
+    uint64_t runtime;       // Execution budget per period
+    uint64_t deadline;      // Deadline relative to release
+    uint64_t period;        // Time between releases
+    uint64_t release;       // Release time of current job
+    uint64_t abs_deadline;  // Absolute deadline of current job
+    uint64_t budget;        // Budget left for current job
+    size_t jobs;            // Number of jobs released
+    size_t misses;          // Number of jobs that missed their deadline
+    bool missed;            // Whether current job missed its deadline
+} proc_edf_t;
+
 typedef enum {
     PROC_DEAD = 0,      // Process is dead, i.e. non-existent
     PROC_SLEEPING,      // Process is halted, e.g. waiting for I/O
@@ -52,31 +89,87 @@ typedef struct proc_page_node {
 } proc_page_node_t;
 
 // Process table entry
-typedef struct {
+typedef struct proc {
     uint64_t inode_id;              // Inode ID of program
-    time_t start_time;              // Process start time (for elapsed execution time)
+    time_t start_time;              // Process start time (ns, see clock_get_ns())
     proc_page_node_t *page_tables;  // Linked list of process page tables
+    struct vma_space *vmas;         // Virtual memory areas (see vma.h)
+    struct wss_proc *wss;           // Working-set statistics (see wss.h)
+    struct fpu_state *fpu;          // Saved FPU state (allocated on first use,
+                                    // see fpu.c)
     proc_state_t state;             // Process state
-    proc_ctxt_t ctxt;               // Process context (saved machine state)
+    proc_ctxt_t *ctxt;              // Context saved by the last entry to the
+                                    // scheduler (on the kernel stack)
+    void *kstack;                   // Kernel stack (NULL for kernel contexts,
+                                    // which keep the stack they booted on)
+    uintptr_t ksp;                  // Kernel stack pointer while switched out
     pc_t exec_count;                // Number of execution time slices remaining
     pc_t priority;                  // Number of execution time slices allowed
+    uint8_t level;                  // Scheduling priority level (0 is highest)
+    struct proc *rq_next;           // Next process in run queue (or wait queue
+                                    // while sleeping)
+    struct proc *rq_prev;           // Previous process in run or wait queue
+    rb_node_t rq_node;              // CFS (by vruntime) or EDF (by deadline)
+                                    // run queue node (or timed sleep node)
+    uint64_t vruntime;              // CFS virtual runtime (weight-scaled cycles)
+    uint64_t utime;                 // TSC cycles spent executing in user mode
+    uint64_t stime;                 // TSC cycles spent executing in kernel mode
+    uint64_t wait_time;             // TSC cycles spent runnable but not running
+    uint64_t ready_since;           // TSC when process last became runnable
+                                    // (while not running)
+    uint32_t weight;                // CFS load weight (from level)
+    proc_sched_t sched;             // Scheduling class
+    proc_edf_t edf;                 // EDF parameters (PROC_SCHED_EDF only)
+    uint64_t wake_time;             // TSC at which a timed sleep ends
+    uint8_t cpu;                    // Processor whose run queues hold the process
+    bool on_cpu;                    // Whether the process is the current one of
+                                    // its processor (until it is switched out)
+    bool pinned;                    // Whether load balancing may not move it
+    uint8_t fpu_cpu;                // Processor whose FPU last loaded fpu
+    pid_t pid;                      // Process ID
     pid_t ppid;                     // Parent Process ID
 } proc_t;
 
-// Process queue node
-typedef struct pid_node {
-    struct pid_node *next;
-    pid_t pid;
-} pid_node_t;
+// FIFO queue of processes sleeping until an event (linked through proc_t)
+typedef struct {
+    proc_t *start;
+    proc_t *end;
+} proc_wait_queue_t;
+
+// Callback for proc_for_each_page(): invoked for every non-empty page table
+// entry of a process with the page VMA and a pointer to the entry itself
+typedef void (*proc_page_fn_t)(pid_t pid, uintptr_t vma, page_entry_t *pte, void *arg);
 
 // Global functions
+void proc_bench_pingpong(void);
+void proc_bench_sched(size_t n);
 void proc_dump_queue(void);
+void proc_finish_switch(void);
+void proc_for_each_page(pid_t pid, proc_page_fn_t fn, void *arg);
 pid_t proc_get_pid(void);
+pid_t proc_get_pid_end(void);
+page_entry_t * proc_get_pte(pid_t pid, uintptr_t vma, bool create);
+struct vma_space * proc_get_vmas(pid_t pid);
+struct wss_proc * proc_get_wss(pid_t pid);
+bool proc_hold(pid_t pid);
 void proc_info(pid_t pid);
 void proc_init(void);
-void proc_load_ctxt(proc_ctxt_t *ctxt);
+bool proc_is_alive(pid_t pid);
+bool proc_is_running(pid_t pid);
 void proc_loop(void);
-void proc_next(void);
-void proc_store_ctxt(proc_ctxt_t *ctxt);
+void proc_loop_ap(void);
+void proc_next(proc_ctxt_t *ctxt);
+pid_t proc_register(void (*entry_point)(void), pc_t priority, uint8_t level);
+void proc_release(void);
+bool proc_set_edf(pid_t pid, uint64_t runtime_us, uint64_t deadline_us,
+                  uint64_t period_us);
+void proc_set_large_page(pid_t pid, uintptr_t vma, page_entry_t entry);
+bool proc_set_sched(pid_t pid, proc_sched_t sched);
+void proc_sleep(uint64_t us);
+void proc_sleep_on(proc_wait_queue_t *queue);
+tlb_cpus_t proc_tlb_cpus(pid_t pid);
+size_t proc_wake_up(proc_wait_queue_t *queue);
+bool proc_wake_up_one(proc_wait_queue_t *queue);
+void proc_yield(void);
 
 #endif // _KERNEL_PROC_H
@@ -0,0 +1,252 @@
+/**
+ * rbtree.c: Intrusive red-black tree
+ *
+ * For documentation, see: Cormen et al., Introduction to Algorithms, ch. 13.
+ * Leaves are represented by NULL rather than by a sentinel node.
+ */
+
+#include "rbtree.h"
+
+// Replace child old of parent with new
+static inline void rb_set_child(rb_tree_t *tree, rb_node_t *parent,
+                                rb_node_t *old, rb_node_t *new)
+{
+    if (!parent)
+        tree->root = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+static void rb_rotate_left(rb_tree_t *tree, rb_node_t *x)
+{
+    rb_node_t *y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    rb_set_child(tree, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+}
+
+static void rb_rotate_right(rb_tree_t *tree, rb_node_t *x)
+{
+    rb_node_t *y = x->left;
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    y->parent = x->parent;
+    rb_set_child(tree, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+}
+
+static inline bool rb_is_red(const rb_node_t *node)
+{
+    return node && node->red;
+}
+
+// Link node into the tree at *link (a child pointer of parent) and rebalance
+void rb_insert(rb_tree_t *tree, rb_node_t *node, rb_node_t *parent, rb_node_t **link)
+{
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->red = true;
+    *link = node;
+
+    rb_node_t *p;
+    while ((p = node->parent) && p->red) {
+        // The root is black, so a red parent always has a parent itself
+        rb_node_t *g = p->parent;
+        if (p == g->left) {
+            rb_node_t *u = g->right;
+            if (rb_is_red(u)) {
+                p->red = false;
+                u->red = false;
+                g->red = true;
+                node = g;
+                continue;
+            }
+            if (node == p->right) {
+                rb_rotate_left(tree, p);
+                node = p;
+                p = node->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rb_rotate_right(tree, g);
+        } else {
+            rb_node_t *u = g->left;
+            if (rb_is_red(u)) {
+                p->red = false;
+                u->red = false;
+                g->red = true;
+                node = g;
+                continue;
+            }
+            if (node == p->left) {
+                rb_rotate_right(tree, p);
+                node = p;
+                p = node->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rb_rotate_left(tree, g);
+        }
+    }
+    tree->root->red = false;
+}
+
+// Replace subtree rooted at u with subtree rooted at v
+static inline void rb_transplant(rb_tree_t *tree, rb_node_t *u, rb_node_t *v)
+{
+    rb_set_child(tree, u->parent, u, v);
+    if (v)
+        v->parent = u->parent;
+}
+
+// Restore red-black properties after removing a black node above x
+static void rb_erase_fixup(rb_tree_t *tree, rb_node_t *x, rb_node_t *parent)
+{
+    while (x != tree->root && !rb_is_red(x)) {
+        if (x == parent->left) {
+            rb_node_t *w = parent->right;
+            if (w->red) {
+                w->red = false;
+                parent->red = true;
+                rb_rotate_left(tree, parent);
+                w = parent->right;
+            }
+            if (!rb_is_red(w->left) && !rb_is_red(w->right)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (!rb_is_red(w->right)) {
+                    w->left->red = false;
+                    w->red = true;
+                    rb_rotate_right(tree, w);
+                    w = parent->right;
+                }
+                w->red = parent->red;
+                parent->red = false;
+                if (w->right)
+                    w->right->red = false;
+                rb_rotate_left(tree, parent);
+                x = tree->root;
+            }
+        } else {
+            rb_node_t *w = parent->left;
+            if (w->red) {
+                w->red = false;
+                parent->red = true;
+                rb_rotate_right(tree, parent);
+                w = parent->left;
+            }
+            if (!rb_is_red(w->left) && !rb_is_red(w->right)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (!rb_is_red(w->left)) {
+                    w->right->red = false;
+                    w->red = true;
+                    rb_rotate_left(tree, w);
+                    w = parent->left;
+                }
+                w->red = parent->red;
+                parent->red = false;
+                if (w->left)
+                    w->left->red = false;
+                rb_rotate_right(tree, parent);
+                x = tree->root;
+            }
+        }
+    }
+    if (x)
+        x->red = false;
+}
+
+// Remove node from the tree
+void rb_erase(rb_tree_t *tree, rb_node_t *node)
+{
+    rb_node_t *x;           // Node moved into the removed position
+    rb_node_t *x_parent;    // Parent of x (x may be NULL)
+    bool removed_red;
+
+    if (!node->left) {
+        x = node->right;
+        x_parent = node->parent;
+        removed_red = node->red;
+        rb_transplant(tree, node, x);
+    } else if (!node->right) {
+        x = node->left;
+        x_parent = node->parent;
+        removed_red = node->red;
+        rb_transplant(tree, node, x);
+    } else {
+        // Replace node by its successor
+        rb_node_t *y = node->right;
+        while (y->left)
+            y = y->left;
+        removed_red = y->red;
+        x = y->right;
+        if (y->parent == node) {
+            x_parent = y;
+        } else {
+            x_parent = y->parent;
+            rb_transplant(tree, y, y->right);
+            y->right = node->right;
+            y->right->parent = y;
+        }
+        rb_transplant(tree, node, y);
+        y->left = node->left;
+        y->left->parent = y;
+        y->red = node->red;
+    }
+
+    if (!removed_red)
+        rb_erase_fixup(tree, x, x_parent);
+}
+
+// Return leftmost (smallest) node, or NULL if the tree is empty
+rb_node_t * rb_first(const rb_tree_t *tree)
+{
+    rb_node_t *node = tree->root;
+    if (node) {
+        while (node->left)
+            node = node->left;
+    }
+    return node;
+}
+
+// Return in-order successor of node, or NULL
+rb_node_t * rb_next(const rb_node_t *node)
+{
+    if (node->right) {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return (rb_node_t*)node;
+    }
+    while (node->parent && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
+}
+
+// Return in-order predecessor of node, or NULL
+rb_node_t * rb_prev(const rb_node_t *node)
+{
+    if (node->left) {
+        node = node->left;
+        while (node->right)
+            node = node->right;
+        return (rb_node_t*)node;
+    }
+    while (node->parent && node == node->parent->left)
+        node = node->parent;
+    return node->parent;
+}
@@ -0,0 +1,36 @@
+/**
+ * rbtree.h: Intrusive red-black tree
+ *
+ * Nodes are embedded in the structures they order. The tree does not compare
+ * keys itself: callers descend from the root to find the insertion point and
+ * pass the parent and the link to fill in to rb_insert(), which then
+ * rebalances. Use rb_entry() to get from a node to its containing structure.
+ */
+
+#ifndef _KERNEL_RBTREE_H
+#define _KERNEL_RBTREE_H
+
+#include "std.h"
+
+typedef struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    bool red;
+} rb_node_t;
+
+typedef struct {
+    rb_node_t *root;
+} rb_tree_t;
+
+// Return pointer to the structure containing node
+#define rb_entry(node, type, member) \
+    ((type*)((uintptr_t)(node) - offsetof(type, member)))
+
+void rb_erase(rb_tree_t *tree, rb_node_t *node);
+rb_node_t * rb_first(const rb_tree_t *tree);
+void rb_insert(rb_tree_t *tree, rb_node_t *node, rb_node_t *parent, rb_node_t **link);
+rb_node_t * rb_next(const rb_node_t *node);
+rb_node_t * rb_prev(const rb_node_t *node);
+
+#endif // _KERNEL_RBTREE_H
@@ -0,0 +1,72 @@
+/**
+ * sched.h: Scheduling classes
+ *
+ * Every process belongs to one scheduling class, which keeps its runnable
+ * processes in a run queue of its own. Classes are strictly ordered: on every
+ * scheduling event proc_next() runs the process picked by the first class that
+ * has a runnable one. A running process stays in the run queue of its class.
+ *
+ * Every processor has a run queue per class and every process is on the one of
+ * the processor in proc_t.cpu. Processes are moved between processors only by
+ * load balancing (see proc.c), which takes them from the run queue of one with
+ * the steal operation.
+ */
+
+#ifndef _KERNEL_SCHED_H
+#define _KERNEL_SCHED_H
+
+#include "proc.h"
+#include "smp.h"
+#include "std.h"
+
+// CFS tunables (defaults, in microseconds)
+enum {
+    SCHED_CFS_LATENCY_US            = 24000,    // Period in which every
+                                                // runnable process runs
+    SCHED_CFS_MIN_GRANULARITY_US    = 3000,     // Shortest time slice
+    SCHED_CFS_WEIGHT_UNIT           = 1024,     // Weight of default level
+};
+
+// Fixed-point representation of an EDF density (or utilisation) of 1
+#define SCHED_EDF_UNIT  ((uint32_t)1 << 20)
+
+// Scheduling class operations
+// NOTE: all operations are called with interrupts disabled and with the run
+// queue lock of the processors involved held (see proc.c). curr is the running
+// process if it belongs to the class, NULL otherwise.
+typedef struct {
+    const char *name;
+    // Set up class state (tick: length of the scheduler tick in TSC cycles)
+    void (*init)(uint64_t tick);
+    // Add a process that became runnable to the run queue of proc->cpu
+    void (*enqueue)(proc_t *proc);
+    // Remove a process that is no longer runnable from the run queue
+    void (*dequeue)(proc_t *proc);
+    // Return process to run next on cpu (may be curr), or NULL if none is
+    // runnable
+    proc_t * (*pick_next)(size_t cpu, proc_t *curr, uint64_t now);
+    // Charge delta cycles to the running process
+    void (*tick)(proc_t *curr, uint64_t delta, uint64_t now);
+    // Give up the rest of the time slice of the running process
+    void (*yield)(proc_t *curr);
+    // Return TSC of the next event that needs a scheduling decision on cpu, or
+    // UINT64_MAX if there is none (the timer is then stopped)
+    uint64_t (*next_event)(size_t cpu, const proc_t *curr, uint64_t now);
+    // Move a runnable process that is neither on a processor nor pinned from
+    // the run queue of from to that of to, preferring the one that would run
+    // last; return it, or NULL if there is none
+    proc_t * (*steal)(size_t from, size_t to);
+    // Print run queue of cpu
+    void (*dump)(size_t cpu);
+} sched_class_t;
+
+extern const sched_class_t sched_cfs;
+extern const sched_class_t sched_edf;
+extern const sched_class_t sched_rr;
+
+void sched_cfs_tune(uint64_t latency_us, uint64_t min_granularity_us);
+bool sched_edf_admit(size_t cpu, uint64_t runtime, uint64_t deadline, uint64_t period);
+void sched_edf_leave(const proc_t *proc);
+size_t sched_edf_misses(void);
+
+#endif // _KERNEL_SCHED_H
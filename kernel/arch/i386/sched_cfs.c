@@ -0,0 +1,230 @@
+/**
+ * sched_cfs.c: Completely fair scheduling class
+ *
+ * Every process accumulates virtual runtime: the cycles it ran, scaled by the
+ * inverse of the weight of its priority level. Runnable processes are ordered
+ * by virtual runtime in a red-black tree, and the leftmost one (the one that
+ * is furthest behind its fair share) runs next. The process picked keeps
+ * running for a slice: its share by weight of the scheduling latency.
+ * Every processor has a tree of its own, and virtual runtimes are relative to
+ * the min_vruntime of that processor.
+ */
+
+#include "clock.h"
+#include "io.h"
+#include "sched.h"
+#include "string.h"
+
+// Run queue of a processor
+typedef struct {
+    rb_tree_t tree;             // Runnable processes by vruntime
+    uint64_t min_vruntime;      // Monotonic lower bound of vruntimes
+    uint64_t ran;               // Cycles picked process ran since picked
+    proc_t *picked;             // Process picked last
+    uint32_t load;              // Total weight of runnable processes
+    size_t nr;                  // Number of runnable processes
+} sched_cfs_rq_t;
+
+static sched_cfs_rq_t sched_cfs_rqs[SMP_CPUS_MAX];
+static uint64_t sched_cfs_latency;      // Period in TSC cycles
+static uint64_t sched_cfs_min_granularity;  // Shortest slice in TSC cycles
+
+// CFS weight of each priority level: every level is worth about 10% of CPU
+// time relative to its neighbour (the Linux nice-to-weight table, with
+// PROC_LEVEL_DEFAULT at nice 0)
+static const uint32_t sched_cfs_weights[PROC_LEVELS] = {
+    36291, 29154, 23254, 18705, 14949, 11916, 9548, 7620,
+    6100, 4904, 3906, 3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423, 335, 272, 215,
+    172, 137, 110, 87, 70, 56, 45, 36,
+};
+
+static void sched_cfs_init(uint64_t tick)
+{
+    (void)tick;
+    memset(sched_cfs_rqs, 0, sizeof(sched_cfs_rqs));
+    sched_cfs_tune(SCHED_CFS_LATENCY_US, SCHED_CFS_MIN_GRANULARITY_US);
+}
+
+// Insert process into the tree (equal vruntimes are served in FIFO order)
+static void sched_cfs_insert(sched_cfs_rq_t *rq, proc_t *proc)
+{
+    rb_node_t **link = &rq->tree.root;
+    rb_node_t *parent = NULL;
+    while (*link) {
+        parent = *link;
+        if (proc->vruntime < rb_entry(parent, proc_t, rq_node)->vruntime)
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+    rb_insert(&rq->tree, &proc->rq_node, parent, link);
+}
+
+// Return runnable process with the least vruntime, or NULL
+static inline proc_t * sched_cfs_first(const sched_cfs_rq_t *rq)
+{
+    rb_node_t *node = rb_first(&rq->tree);
+    return node ? rb_entry(node, proc_t, rq_node) : NULL;
+}
+
+// Return time slice of a process: its share by weight of the scheduling
+// period, which is stretched so that no slice is below the minimum granularity
+static uint64_t sched_cfs_slice(const sched_cfs_rq_t *rq, const proc_t *proc)
+{
+    uint64_t period = sched_cfs_latency;
+    if (rq->nr * sched_cfs_min_granularity > period)
+        period = rq->nr * sched_cfs_min_granularity;
+
+    const uint64_t slice = period * proc->weight / rq->load;
+    return slice < sched_cfs_min_granularity ? sched_cfs_min_granularity : slice;
+}
+
+// Add process to the tree; processes that were not runnable for a while start
+// from min_vruntime so that they cannot monopolise the CPU to catch up
+static void sched_cfs_enqueue(proc_t *proc)
+{
+    sched_cfs_rq_t *rq = &sched_cfs_rqs[proc->cpu];
+
+    proc->weight = sched_cfs_weights[proc->level];
+    if (proc->vruntime < rq->min_vruntime)
+        proc->vruntime = rq->min_vruntime;
+
+    rq->load += proc->weight;
+    rq->nr++;
+    sched_cfs_insert(rq, proc);
+}
+
+static void sched_cfs_dequeue(proc_t *proc)
+{
+    sched_cfs_rq_t *rq = &sched_cfs_rqs[proc->cpu];
+
+    rb_erase(&rq->tree, &proc->rq_node);
+    rq->load -= proc->weight;
+    rq->nr--;
+    if (rq->picked == proc)
+        rq->picked = NULL;
+}
+
+// Let the running process finish its slice, then run the one furthest behind
+static proc_t * sched_cfs_pick_next(size_t cpu, proc_t *curr, uint64_t now)
+{
+    (void)now;
+
+    sched_cfs_rq_t *rq = &sched_cfs_rqs[cpu];
+    if (curr && curr == rq->picked && rq->ran < sched_cfs_slice(rq, curr))
+        return curr;
+
+    proc_t *first = sched_cfs_first(rq);
+    if (!first)
+        return NULL;
+
+    // A process preempted by another class resumes its slice
+    if (curr || first != rq->picked)
+        rq->ran = 0;
+    rq->picked = first;
+    return first;
+}
+
+// Charge delta cycles of weight-scaled virtual runtime
+static void sched_cfs_tick(proc_t *curr, uint64_t delta, uint64_t now)
+{
+    (void)now;
+
+    sched_cfs_rq_t *rq = &sched_cfs_rqs[curr->cpu];
+    rb_erase(&rq->tree, &curr->rq_node);
+    curr->vruntime += delta * SCHED_CFS_WEIGHT_UNIT / curr->weight;
+    sched_cfs_insert(rq, curr);
+    rq->ran += delta;
+
+    // Advance min_vruntime (new processes start from it)
+    const uint64_t min = sched_cfs_first(rq)->vruntime;
+    if (min > rq->min_vruntime)
+        rq->min_vruntime = min;
+}
+
+// Return runnable process with the greatest vruntime (the tree is not empty)
+static inline proc_t * sched_cfs_last(const sched_cfs_rq_t *rq)
+{
+    rb_node_t *node = rq->tree.root;
+    while (node->right)
+        node = node->right;
+    return rb_entry(node, proc_t, rq_node);
+}
+
+// Move process behind all other runnable processes
+static void sched_cfs_yield(proc_t *curr)
+{
+    sched_cfs_rq_t *rq = &sched_cfs_rqs[curr->cpu];
+
+    const proc_t *last = sched_cfs_last(rq);
+    if (last != curr) {
+        rb_erase(&rq->tree, &curr->rq_node);
+        curr->vruntime = last->vruntime;
+        sched_cfs_insert(rq, curr);
+    }
+    rq->picked = NULL;
+}
+
+// Return end of the slice of the running process (if anyone else is waiting)
+static uint64_t sched_cfs_next_event(size_t cpu, const proc_t *curr, uint64_t now)
+{
+    const sched_cfs_rq_t *rq = &sched_cfs_rqs[cpu];
+    if (!curr || rq->nr < 2)
+        return UINT64_MAX;
+
+    const uint64_t slice = sched_cfs_slice(rq, curr);
+    return rq->ran < slice ? now + slice - rq->ran : now;
+}
+
+// Take the movable process with the greatest vruntime. Its lag behind the
+// min_vruntime of the source is kept relative to that of the destination.
+static proc_t * sched_cfs_steal(size_t from, size_t to)
+{
+    sched_cfs_rq_t *src = &sched_cfs_rqs[from];
+    if (!src->nr)
+        return NULL;
+
+    for (rb_node_t *n = &sched_cfs_last(src)->rq_node; n; n = rb_prev(n)) {
+        proc_t *p = rb_entry(n, proc_t, rq_node);
+        if (p->on_cpu || p->pinned)
+            continue;
+
+        sched_cfs_dequeue(p);
+        const uint64_t lag = p->vruntime > src->min_vruntime
+                             ? p->vruntime - src->min_vruntime : 0;
+        p->cpu = to;
+        p->vruntime = sched_cfs_rqs[to].min_vruntime + lag;
+        sched_cfs_enqueue(p);
+        return p;
+    }
+    return NULL;
+}
+
+static void sched_cfs_dump(size_t cpu)
+{
+    for (rb_node_t *n = rb_first(&sched_cfs_rqs[cpu].tree); n; n = rb_next(n)) {
+        const proc_t *p = rb_entry(n, proc_t, rq_node);
+        printk("    PID: %u, vruntime: %lu\n", p->pid, p->vruntime);
+    }
+}
+
+// Set CFS target latency and minimum granularity (in microseconds)
+void sched_cfs_tune(uint64_t latency_us, uint64_t min_granularity_us)
+{
+    sched_cfs_latency = clock_us_to_tsc(latency_us);
+    sched_cfs_min_granularity = clock_us_to_tsc(min_granularity_us);
+}
+
+const sched_class_t sched_cfs = {
+    .name = "cfs",
+    .init = &sched_cfs_init,
+    .enqueue = &sched_cfs_enqueue,
+    .dequeue = &sched_cfs_dequeue,
+    .pick_next = &sched_cfs_pick_next,
+    .tick = &sched_cfs_tick,
+    .yield = &sched_cfs_yield,
+    .next_event = &sched_cfs_next_event,
+    .steal = &sched_cfs_steal,
+    .dump = &sched_cfs_dump,
+};
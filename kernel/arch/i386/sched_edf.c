@@ -0,0 +1,283 @@
+/**
+ * sched_edf.c: Earliest deadline first scheduling class
+ *
+ * A real-time process releases a job every period, which needs runtime cycles
+ * within deadline cycles of its release. Released jobs are ordered by absolute
+ * deadline in a red-black tree and the earliest one runs. A job whose budget
+ * is used up is complete: the process is throttled until its next release, so
+ * that a misbehaving process cannot take more than its reserved bandwidth.
+ * Admission control keeps the total density (runtime / deadline, which is at
+ * least the utilisation runtime / period) at or below 1. That is sufficient
+ * for EDF to meet every deadline even when deadlines are shorter than periods,
+ * which a bound on utilisation alone is not.
+ *
+ * A process that wakes up keeps its current job if the budget left still fits
+ * before the deadline at its reserved density, like in a constant bandwidth
+ * server. Otherwise it waits for the next period boundary, so that a process
+ * that blocks and wakes up repeatedly cannot collect a fresh budget each time.
+ *
+ * Scheduling is partitioned: every processor runs EDF over the processes
+ * admitted to it, and real-time processes are never moved by load balancing
+ * (the utilisation bound of global EDF on several processors is much lower).
+ */
+
+#include "asm.h"
+#include "io.h"
+#include "sched.h"
+#include "string.h"
+
+// Run queue of a processor
+typedef struct {
+    rb_tree_t tree;         // Released jobs by absolute deadline
+    proc_t *throttled;      // Processes waiting for their next release
+    uint32_t density;       // Total density of admitted processes
+    size_t missed;          // Number of missed deadlines
+} sched_edf_rq_t;
+
+static sched_edf_rq_t sched_edf_rqs[SMP_CPUS_MAX];
+
+static void sched_edf_init(uint64_t tick)
+{
+    (void)tick;
+    memset(sched_edf_rqs, 0, sizeof(sched_edf_rqs));
+}
+
+// Return density runtime / deadline in units of SCHED_EDF_UNIT
+static inline uint32_t sched_edf_density(uint64_t runtime, uint64_t deadline)
+{
+    return runtime * SCHED_EDF_UNIT / deadline;
+}
+
+// Add the current job of a process to the released jobs
+static void sched_edf_insert(proc_t *proc)
+{
+    sched_edf_rq_t *rq = &sched_edf_rqs[proc->cpu];
+    rb_node_t **link = &rq->tree.root;
+    rb_node_t *parent = NULL;
+    while (*link) {
+        parent = *link;
+        if (proc->edf.abs_deadline < rb_entry(parent, proc_t, rq_node)->edf.abs_deadline)
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+    rb_insert(&rq->tree, &proc->rq_node, parent, link);
+}
+
+// Start next job of a process
+static void sched_edf_release(proc_t *proc, uint64_t release)
+{
+    proc_edf_t *edf = &proc->edf;
+    edf->release = release;
+    edf->abs_deadline = release + edf->deadline;
+    edf->budget = edf->runtime;
+    edf->missed = false;
+    edf->jobs++;
+    sched_edf_insert(proc);
+}
+
+static inline void sched_edf_miss(proc_t *proc)
+{
+    if (!proc->edf.missed) {
+        proc->edf.missed = true;
+        proc->edf.misses++;
+        sched_edf_rqs[proc->cpu].missed++;
+    }
+}
+
+// Complete current job and wait for the next release
+static void sched_edf_throttle(proc_t *proc)
+{
+    sched_edf_rq_t *rq = &sched_edf_rqs[proc->cpu];
+    proc->edf.budget = 0;
+    rb_erase(&rq->tree, &proc->rq_node);
+    proc->rq_next = rq->throttled;
+    rq->throttled = proc;
+}
+
+/**
+ * Make a process runnable. It starts a new job right away if a full period has
+ * passed since its last release, and otherwise keeps its current job if the
+ * budget left fits before the deadline at the reserved density. If it does not
+ * fit, the process is throttled until the next period boundary.
+ */
+static void sched_edf_enqueue(proc_t *proc)
+{
+    const uint64_t now = rdtsc();
+    proc_edf_t *edf = &proc->edf;
+
+    if (!edf->jobs || now >= edf->release + edf->period) {
+        sched_edf_release(proc, now);
+    } else if (edf->budget && now < edf->abs_deadline
+               && sched_edf_density(edf->budget, edf->abs_deadline - now)
+                  <= sched_edf_density(edf->runtime, edf->deadline)) {
+        sched_edf_insert(proc);
+    } else {
+        sched_edf_rq_t *rq = &sched_edf_rqs[proc->cpu];
+        edf->budget = 0;
+        proc->rq_next = rq->throttled;
+        rq->throttled = proc;
+    }
+}
+
+static void sched_edf_dequeue(proc_t *proc)
+{
+    sched_edf_rq_t *rq = &sched_edf_rqs[proc->cpu];
+
+    // Released jobs always have budget left
+    if (proc->edf.budget) {
+        rb_erase(&rq->tree, &proc->rq_node);
+        return;
+    }
+
+    proc_t **p = &rq->throttled;
+    while (*p != proc)
+        p = &(*p)->rq_next;
+    *p = proc->rq_next;
+}
+
+// Release due jobs, count jobs that are past their deadline and return the
+// job with the earliest deadline
+static proc_t * sched_edf_pick_next(size_t cpu, proc_t *curr, uint64_t now)
+{
+    (void)curr;
+
+    sched_edf_rq_t *rq = &sched_edf_rqs[cpu];
+    proc_t **p = &rq->throttled;
+    while (*p) {
+        proc_t *proc = *p;
+        const uint64_t release = proc->edf.release + proc->edf.period;
+        if (now >= release) {
+            *p = proc->rq_next;
+            sched_edf_release(proc, release);
+        } else {
+            p = &proc->rq_next;
+        }
+    }
+
+    for (rb_node_t *n = rb_first(&rq->tree); n; n = rb_next(n)) {
+        proc_t *proc = rb_entry(n, proc_t, rq_node);
+        if (proc->edf.abs_deadline > now)
+            break;
+        sched_edf_miss(proc);
+    }
+
+    rb_node_t *node = rb_first(&rq->tree);
+    return node ? rb_entry(node, proc_t, rq_node) : NULL;
+}
+
+// Charge delta cycles to the budget of the running job
+static void sched_edf_tick(proc_t *curr, uint64_t delta, uint64_t now)
+{
+    // Job already completed by sched_edf_yield()
+    if (!curr->edf.budget)
+        return;
+
+    if (delta < curr->edf.budget) {
+        curr->edf.budget -= delta;
+        return;
+    }
+
+    if (now > curr->edf.abs_deadline)
+        sched_edf_miss(curr);
+    sched_edf_throttle(curr);
+}
+
+// Complete current job early
+static void sched_edf_yield(proc_t *curr)
+{
+    sched_edf_throttle(curr);
+}
+
+// Return end of the budget or deadline of the running job, or the next release
+static uint64_t sched_edf_next_event(size_t cpu, const proc_t *curr, uint64_t now)
+{
+    uint64_t next = UINT64_MAX;
+
+    if (curr) {
+        next = now + curr->edf.budget;
+        if (!curr->edf.missed && curr->edf.abs_deadline < next)
+            next = curr->edf.abs_deadline;
+    }
+    for (const proc_t *p = sched_edf_rqs[cpu].throttled; p; p = p->rq_next) {
+        const uint64_t release = p->edf.release + p->edf.period;
+        if (release < next)
+            next = release;
+    }
+
+    return next;
+}
+
+// Real-time processes stay on the processor they were admitted to
+static proc_t * sched_edf_steal(size_t from, size_t to)
+{
+    (void)from;
+    (void)to;
+    return NULL;
+}
+
+static void sched_edf_dump(size_t cpu)
+{
+    for (rb_node_t *n = rb_first(&sched_edf_rqs[cpu].tree); n; n = rb_next(n)) {
+        const proc_t *p = rb_entry(n, proc_t, rq_node);
+        printk("    PID: %u, deadline: %lu\n", p->pid, p->edf.abs_deadline);
+    }
+    for (const proc_t *p = sched_edf_rqs[cpu].throttled; p; p = p->rq_next)
+        printk("    PID: %u, throttled\n", p->pid);
+}
+
+/**
+ * Reserve bandwidth on cpu for a process that needs runtime cycles in every
+ * period, each time within deadline cycles of its release
+ * RETURN
+ *  false if the parameters are inconsistent or the total density of cpu would
+ *  exceed 1
+ */
+bool sched_edf_admit(size_t cpu, uint64_t runtime, uint64_t deadline, uint64_t period)
+{
+    if (!runtime || runtime > deadline || deadline > period) {
+        printk("sched_edf_admit: invalid parameters\n");
+        return false;
+    }
+
+    sched_edf_rq_t *rq = &sched_edf_rqs[cpu];
+    const uint32_t density = sched_edf_density(runtime, deadline);
+    if (rq->density + density > SCHED_EDF_UNIT) {
+        printk("sched_edf_admit: admission refused on CPU %u "
+               "(density: %u + %u > %u)\n", cpu, rq->density, density,
+               SCHED_EDF_UNIT);
+        return false;
+    }
+
+    rq->density += density;
+    return true;
+}
+
+// Release bandwidth reserved for a process leaving the class
+void sched_edf_leave(const proc_t *proc)
+{
+    sched_edf_rqs[proc->cpu].density -= sched_edf_density(proc->edf.runtime,
+                                                          proc->edf.deadline);
+}
+
+// Return total number of missed deadlines
+size_t sched_edf_misses(void)
+{
+    size_t missed = 0;
+    for (size_t cpu = 0; cpu < SMP_CPUS_MAX; cpu++)
+        missed += sched_edf_rqs[cpu].missed;
+    return missed;
+}
+
+const sched_class_t sched_edf = {
+    .name = "edf",
+    .init = &sched_edf_init,
+    .enqueue = &sched_edf_enqueue,
+    .dequeue = &sched_edf_dequeue,
+    .pick_next = &sched_edf_pick_next,
+    .tick = &sched_edf_tick,
+    .yield = &sched_edf_yield,
+    .next_event = &sched_edf_next_event,
+    .steal = &sched_edf_steal,
+    .dump = &sched_edf_dump,
+};
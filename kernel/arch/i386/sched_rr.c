@@ -0,0 +1,172 @@
+/**
+ * sched_rr.c: Round-robin scheduling class
+ *
+ * Runnable processes are kept in a FIFO run queue per priority level, and the
+ * first process of the highest non-empty level runs. It keeps running for
+ * priority scheduler ticks (counted down in exec_count), after which it moves
+ * to the end of its queue. A process of a higher level preempts it right away.
+ * Every processor has a set of queues of its own.
+ */
+
+#include "io.h"
+#include "sched.h"
+#include "string.h"
+
+// FIFO run queue of a single priority level (linked through proc_t)
+typedef struct {
+    proc_t *start;
+    proc_t *end;
+} sched_rr_queue_t;
+
+// Run queues of a processor
+typedef struct {
+    sched_rr_queue_t queues[PROC_LEVELS];   // Run queues by level
+    uint32_t map;           // Bit n set if queues[n] is non-empty
+    uint64_t ran;           // Cycles picked process ran in current tick
+    proc_t *picked;         // Process picked last
+} sched_rr_rq_t;
+
+static sched_rr_rq_t sched_rr_rqs[SMP_CPUS_MAX];
+static uint64_t sched_rr_tick_len;  // Length of a scheduler tick (TSC cycles)
+
+static void sched_rr_init(uint64_t tick)
+{
+    memset(sched_rr_rqs, 0, sizeof(sched_rr_rqs));
+    sched_rr_tick_len = tick;
+}
+
+// Append process to the run queue of its priority level
+static void sched_rr_enqueue(proc_t *proc)
+{
+    sched_rr_rq_t *rq = &sched_rr_rqs[proc->cpu];
+    sched_rr_queue_t *q = &rq->queues[proc->level];
+
+    proc->rq_next = NULL;
+    proc->rq_prev = q->end;
+    if (q->end)
+        q->end->rq_next = proc;
+    else
+        q->start = proc;
+    q->end = proc;
+
+    rq->map |= (uint32_t)1 << proc->level;
+}
+
+// Remove process from the run queue of its priority level
+static void sched_rr_dequeue(proc_t *proc)
+{
+    sched_rr_rq_t *rq = &sched_rr_rqs[proc->cpu];
+    sched_rr_queue_t *q = &rq->queues[proc->level];
+
+    if (proc->rq_prev)
+        proc->rq_prev->rq_next = proc->rq_next;
+    else
+        q->start = proc->rq_next;
+    if (proc->rq_next)
+        proc->rq_next->rq_prev = proc->rq_prev;
+    else
+        q->end = proc->rq_prev;
+    proc->rq_next = NULL;
+    proc->rq_prev = NULL;
+
+    if (!q->start)
+        rq->map &= ~((uint32_t)1 << proc->level);
+    if (rq->picked == proc)
+        rq->picked = NULL;
+}
+
+// Return first process of the highest non-empty level
+static proc_t * sched_rr_pick_next(size_t cpu, proc_t *curr, uint64_t now)
+{
+    (void)curr;
+    (void)now;
+
+    sched_rr_rq_t *rq = &sched_rr_rqs[cpu];
+    if (!rq->map)
+        return NULL;
+
+    proc_t *next = rq->queues[__builtin_ctz(rq->map)].start;
+    if (next != rq->picked) {
+        rq->picked = next;
+        rq->ran = 0;
+    }
+    return next;
+}
+
+// Count down the time slice once per tick and rotate the queue when it expires
+static void sched_rr_tick(proc_t *curr, uint64_t delta, uint64_t now)
+{
+    (void)now;
+
+    sched_rr_rq_t *rq = &sched_rr_rqs[curr->cpu];
+    rq->ran += delta;
+    if (rq->ran < sched_rr_tick_len)
+        return;
+
+    // A late interrupt does not count as several ticks
+    rq->ran = 0;
+    if (--curr->exec_count)
+        return;
+
+    // Reset execution count and place process at the end of its queue
+    curr->exec_count = curr->priority;
+    sched_rr_dequeue(curr);
+    sched_rr_enqueue(curr);
+}
+
+static void sched_rr_yield(proc_t *curr)
+{
+    curr->exec_count = curr->priority;
+    sched_rr_dequeue(curr);
+    sched_rr_enqueue(curr);
+}
+
+// Return end of the current tick, unless there is no other process of the
+// same level to rotate to
+static uint64_t sched_rr_next_event(size_t cpu, const proc_t *curr, uint64_t now)
+{
+    if (!curr || (!curr->rq_next && !curr->rq_prev))
+        return UINT64_MAX;
+    return now + sched_rr_tick_len - sched_rr_rqs[cpu].ran;
+}
+
+// Take the last movable process of the lowest non-empty level
+static proc_t * sched_rr_steal(size_t from, size_t to)
+{
+    const sched_rr_rq_t *rq = &sched_rr_rqs[from];
+    for (int level = PROC_LEVELS - 1; level >= 0; level--) {
+        if (!(rq->map & (uint32_t)1 << level))
+            continue;
+        for (proc_t *p = rq->queues[level].end; p; p = p->rq_prev) {
+            if (p->on_cpu || p->pinned)
+                continue;
+            sched_rr_dequeue(p);
+            p->cpu = to;
+            p->exec_count = p->priority;
+            sched_rr_enqueue(p);
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static void sched_rr_dump(size_t cpu)
+{
+    for (size_t level = 0; level < PROC_LEVELS; level++) {
+        for (proc_t *p = sched_rr_rqs[cpu].queues[level].start; p; p = p->rq_next)
+            printk("    PID: %u, level: %u\n", p->pid, level);
+    }
+}
+
+const sched_class_t sched_rr = {
+    .name = "rr",
+    .init = &sched_rr_init,
+    .enqueue = &sched_rr_enqueue,
+    .dequeue = &sched_rr_dequeue,
+    .pick_next = &sched_rr_pick_next,
+    .tick = &sched_rr_tick,
+    .yield = &sched_rr_yield,
+    .next_event = &sched_rr_next_event,
+    .steal = &sched_rr_steal,
+    .dump = &sched_rr_dump,
+};
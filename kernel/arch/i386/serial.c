@@ -0,0 +1,41 @@
+/**
+ * serial.c: Serial port (8250/16550 UART)
+ *
+ * Output only, polling the line status register: the serial console is for
+ * dumps that do not fit on the VGA screen (see serial_printk()) and is read
+ * from the host, e.g. with qemu -serial stdio.
+ */
+
+#include "io.h"
+#include "serial.h"
+
+static bool serial_ready;   // Whether COM1 has been set up
+
+// Set up COM1 for 8N1 output at SERIAL_BAUD, without interrupts
+void serial_init(void)
+{
+    const uint16_t divisor = SERIAL_BAUD_BASE / SERIAL_BAUD;
+
+    outb(SERIAL_PORT_COM1 + SERIAL_REG_IER, 0x00);
+    outb(SERIAL_PORT_COM1 + SERIAL_REG_LCR, SERIAL_LCR_DLAB);
+    outb(SERIAL_PORT_COM1 + SERIAL_REG_DATA, divisor & 0xff);
+    outb(SERIAL_PORT_COM1 + SERIAL_REG_IER, divisor >> 8);
+    outb(SERIAL_PORT_COM1 + SERIAL_REG_LCR, SERIAL_LCR_8N1);
+    outb(SERIAL_PORT_COM1 + SERIAL_REG_FCR, SERIAL_FCR_ENABLE);
+    outb(SERIAL_PORT_COM1 + SERIAL_REG_MCR, SERIAL_MCR_DTR_RTS);
+
+    serial_ready = true;
+}
+
+// Write character to COM1 (line feeds are sent as CR LF)
+void serial_putc(char c)
+{
+    if (!serial_ready)
+        return;
+
+    if (c == '\n')
+        serial_putc('\r');
+    while (!(inb(SERIAL_PORT_COM1 + SERIAL_REG_LSR) & SERIAL_LSR_THRE))
+        asm volatile ("pause\n\t");
+    outb(SERIAL_PORT_COM1 + SERIAL_REG_DATA, c);
+}
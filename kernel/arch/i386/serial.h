@@ -0,0 +1,33 @@
+/**
+ * serial.h: Serial port (8250/16550 UART)
+ */
+
+#ifndef _KERNEL_SERIAL_H
+#define _KERNEL_SERIAL_H
+
+#include "std.h"
+
+// UART constants
+enum {
+    SERIAL_PORT_COM1    = 0x3f8,    // I/O base of the first serial port
+    SERIAL_REG_DATA     = 0,        // Transmit/receive buffer (divisor low byte
+                                    // while DLAB is set)
+    SERIAL_REG_IER      = 1,        // Interrupt enable (divisor high byte while
+                                    // DLAB is set)
+    SERIAL_REG_FCR      = 2,        // FIFO control
+    SERIAL_REG_LCR      = 3,        // Line control
+    SERIAL_REG_MCR      = 4,        // Modem control
+    SERIAL_REG_LSR      = 5,        // Line status
+    SERIAL_LCR_8N1      = 0x03,     // 8 data bits, no parity, one stop bit
+    SERIAL_LCR_DLAB     = 0x80,     // Divisor latch access
+    SERIAL_FCR_ENABLE   = 0xc7,     // Enable and clear FIFOs, 14-byte threshold
+    SERIAL_MCR_DTR_RTS  = 0x03,     // Data terminal ready, request to send
+    SERIAL_LSR_THRE     = 0x20,     // Transmit buffer empty
+    SERIAL_BAUD         = 115200,
+    SERIAL_BAUD_BASE    = 115200,   // Baud rate at divisor 1
+};
+
+void serial_init(void);
+void serial_putc(char c);
+
+#endif // _KERNEL_SERIAL_H
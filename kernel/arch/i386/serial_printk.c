@@ -0,0 +1,17 @@
+/**
+ * serial_printk.c: printk function (serial console)
+ */
+
+#include "serial.h"
+#include "std.h"
+#define VGA_PUTC serial_putc
+#include "_print.c"
+
+ssize_t serial_printk(const char *format, ... )
+{
+    va_list args;
+    va_start(args, format);
+    ssize_t bytes = _print(format, &args);
+    va_end(args);
+    return bytes;
+}
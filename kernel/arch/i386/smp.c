@@ -0,0 +1,224 @@
+/**
+ * smp.c: Symmetric multiprocessing
+ *
+ * Application processors (APs) are started with the INIT-SIPI-SIPI sequence:
+ * an INIT IPI resets them into a wait-for-SIPI state, and a startup IPI makes
+ * them execute real-mode code at the page given by its vector. The startup IPI
+ * is sent twice, since the first one can be lost on some older processors.
+ * Without parsing the ACPI tables the number of processors is not known, so
+ * the IPIs are broadcast to all processors but the bootstrap processor (BSP)
+ * and every AP that comes up claims the next processor index itself.
+ *
+ * The APs run the trampoline in smp_asm.s and then smp_ap_main(), which loads
+ * their own GDT (with their TSS and per-CPU data block, see percpu.h), the
+ * kernel IDT and sets up their local APIC.
+ * Once all of them are up, every AP switches to a page directory of its own
+ * (see page_init_cpu()) and enters its idle loop, from which the scheduler
+ * takes it when it has a process to run (see proc.c).
+ *
+ * Kernel state that is not per processor, i.e. the page allocator, the heap
+ * and the tables of ksm.c and zram.c that refer to frames, is serialised by the
+ * kernel lock (see smp_lock_kernel()). The areas and page tables of a process
+ * have a lock of their own (see vma_lock()), which is taken before the kernel
+ * lock, and so do the run queues (see proc.c), whose locks are taken after it.
+ */
+
+#include "alloc.h"
+#include "apic.h"
+#include "asm.h"
+#include "clock.h"
+#include "fpu.h"
+#include "gdt.h"
+#include "int.h"
+#include "io.h"
+#include "lock.h"
+#include "page.h"
+#include "percpu.h"
+#include "proc.h"
+#include "smp.h"
+#include "syscall.h"
+#include "string.h"
+
+// Trampoline (see smp_asm.s)
+extern char smp_trampoline_start;
+extern char smp_trampoline_end;
+extern char smp_trampoline_cr3;
+
+// Next processor index to be claimed by an AP (incremented in smp_asm.s)
+volatile size_t smp_ap_next = 1;
+// Initial stack pointer of each AP (read in smp_asm.s)
+uintptr_t smp_ap_stacks[SMP_CPUS_MAX];
+
+static smp_cpu_t smp_cpus[SMP_CPUS_MAX];
+static volatile size_t smp_online = 1;      // Number of processors set up
+static volatile bool smp_released;          // Whether APs may enter their idle loop
+static lock_mcs_t smp_kernel;               // Kernel lock
+static lock_mcs_node_t smp_kernel_nodes[SMP_CPUS_MAX];  // Its waiter by processor
+
+void smp_ap_main(size_t cpu);
+
+// Return number of processors that are up
+size_t smp_cpu_count(void)
+{
+    return smp_online;
+}
+
+// Return index of the calling processor (0 is the BSP)
+size_t smp_cpu_id(void)
+{
+    return percpu_get(cpu);
+}
+
+/**
+ * Disable interrupts and take the kernel lock
+ * RETURN
+ *  flags register to pass to smp_unlock_kernel()
+ */
+flags_reg_t smp_lock_kernel(void)
+{
+    // Interrupts are disabled first, so that the caller stays on the processor
+    // whose node it queues
+    const flags_reg_t flags = get_flags();
+    cli();
+    lock_mcs_at(&smp_kernel, &smp_kernel_nodes[smp_cpu_id()], LOCK_SITE);
+    return flags;
+}
+
+// Release the kernel lock and restore the interrupt flag
+void smp_unlock_kernel(flags_reg_t flags)
+{
+    lock_mcs_irqrestore(&smp_kernel, &smp_kernel_nodes[smp_cpu_id()], flags);
+}
+
+/**
+ * Send a fixed interrupt to a processor
+ * NOTE: must be called with interrupts disabled
+ */
+void smp_send_ipi(size_t cpu, uint8_t vector)
+{
+    lapic_send_ipi(smp_cpus[cpu].apic_id, (apic_lvt_reg_t) {
+        .icr = {
+            .vector = vector,
+            .delivery = APIC_DELIVER_FIXED,
+            .assert = 1,
+            .shorthand = APIC_DEST_FIELD,
+        }
+    });
+}
+
+// Continue setting up an AP after the trampoline (never returns)
+void smp_ap_main(size_t cpu)
+{
+    gdt_init_ap(cpu);
+    int_init_ap();
+    fpu_init_ap();
+    syscall_init_ap(cpu);
+    lapic_init_ap();
+
+    smp_cpus[cpu].apic_id = lapic_get_id();
+    smp_cpus[cpu].online = true;
+    __atomic_add_fetch(&smp_online, 1, __ATOMIC_RELEASE);
+
+    // Wait for the page directory of this processor (interrupts are still
+    // disabled, see lock_relax())
+    while (!__atomic_load_n(&smp_released, __ATOMIC_ACQUIRE))
+        lock_relax();
+    page_load_cpu_dir();
+
+    proc_loop_ap();
+}
+
+// Broadcast INIT-SIPI-SIPI to all processors but the calling one
+static void smp_send_startup(void)
+{
+    lapic_send_ipi(0, (apic_lvt_reg_t) {
+        .icr = {
+            .delivery = APIC_DELIVER_INIT,
+            .assert = 1,
+            .shorthand = APIC_DEST_OTHERS,
+        }
+    });
+    clock_delay_us(SMP_INIT_DELAY_US);
+
+    for (size_t i = 0; i < 2; i++) {
+        lapic_send_ipi(0, (apic_lvt_reg_t) {
+            .icr = {
+                .vector = SMP_TRAMPOLINE_PMA >> 12,
+                .delivery = APIC_DELIVER_STARTUP,
+                .assert = 1,
+                .shorthand = APIC_DEST_OTHERS,
+            }
+        });
+        clock_delay_us(SMP_SIPI_DELAY_US);
+    }
+}
+
+/**
+ * Start application processors
+ * NOTE: must be called with interrupts disabled, after apic_init() and before
+ * any user address space is mapped (the trampoline page is identity-mapped
+ * while the APs start)
+ */
+void smp_init(void)
+{
+    smp_cpus[0].apic_id = lapic_get_id();
+    smp_cpus[0].online = true;
+    lock_prof_add(&smp_kernel.stats, "kernel");
+
+    for (size_t cpu = 1; cpu < SMP_CPUS_MAX; cpu++) {
+        smp_ap_stacks[cpu] = (uintptr_t)kalloc(PAGE_GET_DEFAULT, PAGE_SIZE,
+                                               SMP_AP_STACK_SIZE)
+                             + SMP_AP_STACK_SIZE;
+    }
+
+    // The trampoline keeps running at its physical address right after it
+    // enables paging, so its page is identity-mapped
+    page_entry_t *table = NULL;
+    if (!page_table_is_present(SMP_TRAMPOLINE_PMA)) {
+        table = kalloc(PAGE_GET_DEFAULT, PAGE_SIZE, PAGE_SIZE);
+        page_clear((uintptr_t)table);
+        page_table_map((uintptr_t)table, SMP_TRAMPOLINE_PMA,
+                       PAGE_WRITE | PAGE_PRESENT);
+    }
+    page_set_entry(SMP_TRAMPOLINE_PMA, SMP_TRAMPOLINE_PMA | PAGE_WRITE | PAGE_PRESENT);
+    invlpg(SMP_TRAMPOLINE_PMA);
+
+    const uintptr_t cr3_offset = &smp_trampoline_cr3 - &smp_trampoline_start;
+    memcpy((void*)SMP_TRAMPOLINE_PMA, &smp_trampoline_start,
+           &smp_trampoline_end - &smp_trampoline_start);
+    *(uint32_t*)(SMP_TRAMPOLINE_PMA + cr3_offset) = get_cr3();
+
+    smp_send_startup();
+
+    // Wait until APs stop arriving and every AP that claimed an index has left
+    // the trampoline (APs beyond SMP_CPUS_MAX halt in it)
+    uint64_t last = rdtsc();
+    size_t claimed = 1;
+    while (rdtsc() - last < clock_us_to_tsc(SMP_AP_WAIT_US)
+           || __atomic_load_n(&smp_online, __ATOMIC_ACQUIRE) < claimed) {
+        const size_t next = smp_ap_next < SMP_CPUS_MAX ? smp_ap_next : SMP_CPUS_MAX;
+        if (next != claimed) {
+            claimed = next;
+            last = rdtsc();
+        }
+        if (smp_online == SMP_CPUS_MAX)
+            break;
+    }
+
+    page_delete(SMP_TRAMPOLINE_PMA);
+    if (table) {
+        page_table_unmap(SMP_TRAMPOLINE_PMA);
+        kfree(table);
+    }
+
+    for (size_t cpu = 0; cpu < smp_online; cpu++)
+        page_init_cpu(cpu);
+    __atomic_store_n(&smp_released, true, __ATOMIC_RELEASE);
+
+    printk("smp_init: %u processor(s) up (BSP APIC ID: %u)\n", smp_online,
+           smp_cpus[0].apic_id);
+    for (size_t cpu = 1; cpu < smp_online; cpu++)
+        printk("smp_init: CPU %u online (APIC ID: %u)\n", cpu, smp_cpus[cpu].apic_id);
+    if (smp_ap_next > SMP_CPUS_MAX)
+        printk("smp_init: WARNING: only %u processors are used\n", SMP_CPUS_MAX);
+}
@@ -0,0 +1,36 @@
+/**
+ * smp.h: Symmetric multiprocessing
+ */
+
+#ifndef _KERNEL_SMP_H
+#define _KERNEL_SMP_H
+
+#include "asm.h"
+#include "std.h"
+
+// SMP constants
+// NOTE: SMP_CPUS_MAX and SMP_TRAMPOLINE_PMA are repeated in smp_asm.s
+enum {
+    SMP_CPUS_MAX        = 8,        // Maximum number of processors used
+    SMP_TRAMPOLINE_PMA  = 0x8000,   // Where APs start executing (page-aligned,
+                                    // below 1 MiB)
+    SMP_AP_STACK_SIZE   = 4096,     // Boot stack of each AP
+    SMP_INIT_DELAY_US   = 10000,    // Wait after the INIT IPI
+    SMP_SIPI_DELAY_US   = 200,      // Wait after each startup IPI
+    SMP_AP_WAIT_US      = 100000,   // Time for APs to check in
+};
+
+// Processor state
+typedef struct {
+    uint8_t apic_id;    // Local APIC ID
+    bool online;        // Whether the processor has finished its setup
+} smp_cpu_t;
+
+size_t smp_cpu_count(void);
+size_t smp_cpu_id(void);
+void smp_init(void);
+flags_reg_t smp_lock_kernel(void);
+void smp_send_ipi(size_t cpu, uint8_t vector);
+void smp_unlock_kernel(flags_reg_t flags);
+
+#endif // _KERNEL_SMP_H
@@ -0,0 +1,87 @@
+## smp_asm.s: Startup trampoline for application processors
+#
+# smp_init() copies the code between smp_trampoline_start and
+# smp_trampoline_end to SMP_TRAMPOLINE_PMA, where the startup IPI makes every
+# AP begin executing in real mode. The trampoline enters protected mode with a
+# temporary flat GDT, enables paging with the kernel page directory (in which
+# the trampoline page is identity-mapped during bring-up), takes the stack
+# smp_init() prepared for the AP and jumps to smp_ap_main() in the higher half.
+#
+# Addresses within the trampoline are computed relative to its copy, since the
+# linked (higher-half) addresses cannot be reached before paging is enabled.
+
+.set SMP_TRAMPOLINE_PMA, 0x8000    # See smp.h
+.set SMP_CPUS_MAX, 8               # See smp.h
+
+.section .text
+
+.code16
+.globl  smp_trampoline_start
+smp_trampoline_start:
+
+    cli
+    cld
+    xorw    %ax, %ax
+    movw    %ax, %ds
+
+    # Load temporary GDT
+    lgdtl   SMP_TRAMPOLINE_PMA + (smp_trampoline_gdtr - smp_trampoline_start)
+
+    # Enter protected mode
+    movl    %cr0, %eax
+    orl     $1, %eax
+    movl    %eax, %cr0
+    ljmpl   $8, $(SMP_TRAMPOLINE_PMA + (smp_trampoline_pm - smp_trampoline_start))
+
+.code32
+smp_trampoline_pm:
+
+    movw    $16, %ax
+    movw    %ax, %ds
+    movw    %ax, %es
+    movw    %ax, %fs
+    movw    %ax, %gs
+    movw    %ax, %ss
+
+    # Enable paging with the kernel page directory
+    movl    SMP_TRAMPOLINE_PMA + (smp_trampoline_cr3 - smp_trampoline_start), %eax
+    movl    %eax, %cr3
+    movl    %cr0, %eax
+    orl     $0x80000001, %eax
+    movl    %eax, %cr0
+
+    # Claim a processor index (APs are started all at once)
+    movl    $1, %eax
+    lock xaddl %eax, smp_ap_next
+    cmpl    $SMP_CPUS_MAX, %eax
+    jae     smp_trampoline_halt
+
+    # Switch to the stack of this processor and continue in the higher half
+    movl    smp_ap_stacks(, %eax, 4), %esp
+    pushl   %eax
+    movl    $smp_ap_main, %eax
+    call    *%eax
+
+    # Processors beyond SMP_CPUS_MAX are left halted
+smp_trampoline_halt:
+    cli
+    hlt
+    jmp     smp_trampoline_halt
+
+# Temporary GDT: null, flat ring 0 code and flat ring 0 data descriptors
+.align 8
+smp_trampoline_gdt:
+    .quad   0
+    .quad   0x00cf9a000000ffff
+    .quad   0x00cf92000000ffff
+smp_trampoline_gdtr:
+    .word   smp_trampoline_gdtr - smp_trampoline_gdt - 1
+    .long   SMP_TRAMPOLINE_PMA + (smp_trampoline_gdt - smp_trampoline_start)
+
+# Physical address of the kernel page directory (filled in by smp_init())
+.globl  smp_trampoline_cr3
+smp_trampoline_cr3:
+    .long   0
+
+.globl  smp_trampoline_end
+smp_trampoline_end:
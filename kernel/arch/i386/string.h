@@ -12,11 +12,38 @@
 
 #include "std.h"
 
-static size_t strlen(const char* str)
+static inline size_t strlen(const char* str)
 {
     size_t len = 0;
     while (str[len]) len++;
     return len;
 }
 
+static inline int memcmp(const void *a, const void *b, size_t n)
+{
+    const uint8_t *p = a, *q = b;
+    for (size_t i = 0; i < n; i++) {
+        if (p[i] != q[i])
+            return p[i] - q[i];
+    }
+    return 0;
+}
+
+static inline void * memcpy(void *dst, const void *src, size_t n)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    for (size_t i = 0; i < n; i++)
+        d[i] = s[i];
+    return dst;
+}
+
+static inline void * memset(void *dst, int c, size_t n)
+{
+    uint8_t *d = dst;
+    for (size_t i = 0; i < n; i++)
+        d[i] = (uint8_t)c;
+    return dst;
+}
+
 #endif // _KERNEL_STRING_H
@@ -0,0 +1,262 @@
+/**
+ * syscall.c: System calls
+ */
+
+#include "asm.h"
+#include "cpuid.h"
+#include "gdt.h"
+#include "io.h"
+#include "mem.h"
+#include "page.h"
+#include "proc.h"
+#include "smp.h"
+#include "string.h"
+#include "syscall.h"
+#include "vga.h"
+#include "vma.h"
+
+bool syscall_sysenter_ok;
+
+// Event of SYSCALL_WAIT and SYSCALL_SIGNAL (protected by the kernel lock)
+typedef struct {
+    proc_wait_queue_t sleepers;
+    size_t count;           // Number of times the event was signalled
+} syscall_event_t;
+
+static syscall_event_t syscall_events[SYSCALL_EVENTS];
+
+// Results of syscall_bench(), printed by syscall_bench_report()
+static uint64_t syscall_bench_int;      // Cycles per call through int 0x80
+static uint64_t syscall_bench_fast;     // Cycles per call through sysenter
+static bool syscall_bench_done;         // Whether the results are ready
+
+void syscall_sysenter_entry(void);  // See syscall_asm.s
+
+static reg_t syscall_nop(const syscall_args_t *args)
+{
+    (void)args;
+    return 0;
+}
+
+static reg_t syscall_getpid(const syscall_args_t *args)
+{
+    (void)args;
+    return proc_get_pid();
+}
+
+static reg_t syscall_write(const syscall_args_t *args)
+{
+    const char *data = (const char*)args->a1;
+    const size_t len = args->a2;
+    if (!vma_access_ok(proc_get_pid(), args->a1, len, VMA_PROT_READ))
+        return (reg_t)SYSCALL_ERROR;
+
+    // The string is copied before taking the console lock, since reading it
+    // may fault (to map or swap in its pages)
+    char buf[SYSCALL_WRITE_CHUNK];
+    for (size_t done = 0; done < len; done += sizeof(buf)) {
+        const size_t n = len - done < sizeof(buf) ? len - done : sizeof(buf);
+        memcpy(buf, data + done, n);
+        const flags_reg_t flags = vga_lock();
+        vga_write(buf, n);
+        vga_unlock(flags);
+    }
+    return len;
+}
+
+static reg_t syscall_yield(const syscall_args_t *args)
+{
+    (void)args;
+    proc_yield();
+    return 0;
+}
+
+static reg_t syscall_sleep(const syscall_args_t *args)
+{
+    proc_sleep(args->a1);
+    return 0;
+}
+
+// Map anonymous memory (processes cannot map physical memory)
+static reg_t syscall_mmap(const syscall_args_t *args)
+{
+    const uintptr_t addr = args->a1;
+    const size_t len = args->a2;
+    const uint32_t prot = args->a3;
+    if (!len || len > KERNEL_START_VMA - VMA_USER_START
+        || (addr & (PAGE_SIZE - 1)) || (prot & ~(VMA_PROT_MASK | VMA_MAP_LARGE)))
+        return (reg_t)SYSCALL_ERROR;
+
+    const vma_backing_t backing = prot & VMA_MAP_LARGE ? VMA_LARGE : VMA_ANON;
+    const uintptr_t start = vma_mmap(proc_get_pid(), addr, len,
+                                     prot & VMA_PROT_MASK, backing, 0);
+    return start ? start : (reg_t)SYSCALL_ERROR;
+}
+
+static reg_t syscall_munmap(const syscall_args_t *args)
+{
+    const uintptr_t addr = args->a1;
+    const size_t len = args->a2;
+    if (!len || len > KERNEL_START_VMA - VMA_USER_START || (addr & (PAGE_SIZE - 1))
+        || !vma_munmap(proc_get_pid(), addr, len))
+        return (reg_t)SYSCALL_ERROR;
+    return 0;
+}
+
+static reg_t syscall_brk(const syscall_args_t *args)
+{
+    return vma_brk(proc_get_pid(), args->a1);
+}
+
+/**
+ * Sleep until the count of an event differs from the one the caller last saw,
+ * so that a signal sent after that is never missed. A process woken up by a
+ * signal to another sleeper does not notice it until it is woken up itself.
+ * RETURN
+ *  new count of the event
+ */
+static reg_t syscall_wait(const syscall_args_t *args)
+{
+    if (args->a1 >= SYSCALL_EVENTS)
+        return (reg_t)SYSCALL_ERROR;
+
+    syscall_event_t *event = &syscall_events[args->a1];
+    const flags_reg_t flags = smp_lock_kernel();
+    if (event->count == args->a2)
+        proc_sleep_on(&event->sleepers);
+    const size_t count = event->count;
+    smp_unlock_kernel(flags);
+    return count;
+}
+
+static reg_t syscall_signal(const syscall_args_t *args)
+{
+    if (args->a1 >= SYSCALL_EVENTS)
+        return (reg_t)SYSCALL_ERROR;
+
+    syscall_event_t *event = &syscall_events[args->a1];
+    const flags_reg_t flags = smp_lock_kernel();
+    const size_t count = ++event->count;
+    if (args->a2)
+        proc_wake_up(&event->sleepers);
+    else
+        proc_wake_up_one(&event->sleepers);
+    smp_unlock_kernel(flags);
+    return count;
+}
+
+static reg_t syscall_sched(const syscall_args_t *args)
+{
+    const proc_sched_t sched = args->a1;
+    const uint64_t runtime_us = args->a2;
+    const uint64_t period_us = args->a3;
+    bool ok;
+    if (sched != PROC_SCHED_EDF)
+        ok = proc_set_sched(proc_get_pid(), sched);
+    else if (!runtime_us || runtime_us > period_us)
+        ok = false;
+    else
+        ok = proc_set_edf(proc_get_pid(), runtime_us, period_us, period_us);
+    return ok ? 0 : (reg_t)SYSCALL_ERROR;
+}
+
+static const syscall_fn_t syscall_table[SYSCALL_COUNT] = {
+    [SYSCALL_NOP]       = &syscall_nop,
+    [SYSCALL_GETPID]    = &syscall_getpid,
+    [SYSCALL_WRITE]     = &syscall_write,
+    [SYSCALL_YIELD]     = &syscall_yield,
+    [SYSCALL_SLEEP]     = &syscall_sleep,
+    [SYSCALL_MMAP]      = &syscall_mmap,
+    [SYSCALL_MUNMAP]    = &syscall_munmap,
+    [SYSCALL_BRK]       = &syscall_brk,
+    [SYSCALL_WAIT]      = &syscall_wait,
+    [SYSCALL_SIGNAL]    = &syscall_signal,
+    [SYSCALL_SCHED]     = &syscall_sched,
+};
+
+/**
+ * Run the system call in args (called by the entry points in syscall_asm.s)
+ * NOTE: called with interrupts disabled
+ * RETURN
+ *  result of the system call, or SYSCALL_ERROR if there is no such call
+ */
+reg_t syscall_dispatch(const syscall_args_t *args)
+{
+    if (args->nr >= SYSCALL_COUNT)
+        return (reg_t)SYSCALL_ERROR;
+    return syscall_table[args->nr](args);
+}
+
+/**
+ * Check for sysenter support and set up the BSP
+ * NOTE: must be called after gdt_init()
+ */
+void syscall_init(void)
+{
+    cpuid_version_t ver;
+    cpuid_version(&ver);
+
+    // Early Pentium Pro processors report sysenter without supporting it
+    const bool broken = ver.family_id == 6 && ver.model < 3 && ver.stepping_id < 3;
+    syscall_sysenter_ok = ver.sep && !broken;
+    if (!syscall_sysenter_ok)
+        printk("syscall_init: sysenter not supported, using int 0x80\n");
+
+    syscall_init_ap(0);
+}
+
+// Point sysenter on cpu to its entry point and kernel stack
+void syscall_init_ap(size_t cpu)
+{
+    if (!syscall_sysenter_ok)
+        return;
+
+    // The kernel stack changes with every process, so the entry point loads it
+    // from the TSS (see gdt_set_kernel_stack())
+    set_msr(GDT_SEL_CODE_PL0, IA32_SYSENTER_CS_MSR);
+    set_msr((uintptr_t)gdt_kernel_stack(cpu), IA32_SYSENTER_ESP_MSR);
+    set_msr((uintptr_t)&syscall_sysenter_entry, IA32_SYSENTER_EIP_MSR);
+}
+
+// Process of syscall_bench(). It runs in user mode, so the results are left
+// for the idle loop to print (see syscall_bench_report()).
+static void syscall_bench_proc(void)
+{
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < SYSCALL_BENCH_ITERS; i++)
+        syscall_int(SYSCALL_NOP, 0, 0, 0);
+    syscall_bench_int = (rdtsc() - start) / SYSCALL_BENCH_ITERS;
+
+    if (syscall_sysenter_ok) {
+        start = rdtsc();
+        for (size_t i = 0; i < SYSCALL_BENCH_ITERS; i++)
+            syscall_fast(SYSCALL_NOP, 0, 0, 0);
+        syscall_bench_fast = (rdtsc() - start) / SYSCALL_BENCH_ITERS;
+    }
+    __atomic_store_n(&syscall_bench_done, true, __ATOMIC_RELEASE);
+
+    while (1) {
+        asm volatile ("pause\n\t");
+    }
+}
+
+/**
+ * Benchmark system call round trips: a process measures the cycles per null
+ * system call through each entry point from user mode
+ */
+void syscall_bench(void)
+{
+    proc_register(&syscall_bench_proc, 10, PROC_LEVEL_DEFAULT);
+}
+
+// Print results of syscall_bench() once its process is done
+void syscall_bench_report(void)
+{
+    if (!__atomic_load_n(&syscall_bench_done, __ATOMIC_ACQUIRE))
+        return;
+
+    printk("syscall_bench: int 0x80: %lu cycles per call\n", syscall_bench_int);
+    if (syscall_sysenter_ok)
+        printk("syscall_bench: sysenter: %lu cycles per call\n", syscall_bench_fast);
+    syscall_bench_done = false;
+}
@@ -0,0 +1,104 @@
+/**
+ * syscall.h: System calls
+ *
+ * A system call passes its number in eax and up to five arguments in ebx, ecx,
+ * edx, esi and edi, and returns its result in eax (every other register is
+ * preserved). Processes enter with sysenter where the processor supports it
+ * and with int 0x80 otherwise; syscall() picks the entry.
+ */
+
+#ifndef _KERNEL_SYSCALL_H
+#define _KERNEL_SYSCALL_H
+
+#include "std.h"
+
+// System call numbers
+enum {
+    SYSCALL_NOP = 0,    // Do nothing (measures the entry and return path)
+    SYSCALL_GETPID,     // Return the PID of the calling process
+    SYSCALL_WRITE,      // Write ebx (string in readable user memory) of length
+                        // ecx to the console
+    SYSCALL_YIELD,      // Give up the rest of the time slice
+    SYSCALL_SLEEP,      // Sleep for ebx microseconds
+    SYSCALL_MMAP,       // Map ecx bytes of zeroed memory with protection edx
+                        // (VMA_PROT_* bits) at ebx, or anywhere if ebx is 0;
+                        // with VMA_MAP_LARGE in edx, ecx must be 4 MiB
+    SYSCALL_MUNMAP,     // Unmap ecx bytes at ebx
+    SYSCALL_BRK,        // Set the program break to ebx (0 returns it)
+    SYSCALL_WAIT,       // Sleep while event ebx has been signalled ecx times
+                        // (see syscall_wait()) and return the count
+    SYSCALL_SIGNAL,     // Signal event ebx, waking the longest sleeper (or
+                        // every sleeper if ecx is not 0), and return the count
+    SYSCALL_SCHED,      // Move the calling process to scheduling class ebx;
+                        // the EDF class takes a runtime of ecx microseconds in
+                        // every period (and deadline) of edx microseconds
+    SYSCALL_COUNT,      // Number of system calls
+};
+
+// System call constants
+enum {
+    SYSCALL_ERROR           = -1,       // Returned for invalid calls
+    SYSCALL_BENCH_ITERS     = 100000,   // Round trips per entry in syscall_bench()
+    SYSCALL_WRITE_CHUNK     = 64,       // Bytes written to the console at once
+    SYSCALL_EVENTS          = 8,        // Events of SYSCALL_WAIT and SYSCALL_SIGNAL
+    IA32_SYSENTER_CS_MSR    = 0x174,
+    IA32_SYSENTER_ESP_MSR   = 0x175,
+    IA32_SYSENTER_EIP_MSR   = 0x176,
+};
+
+// Registers of a system call (pushed by the entry points in syscall_asm.s)
+typedef struct {
+    reg_t nr;           // eax
+    reg_t a1;           // ebx
+    reg_t a2;           // ecx
+    reg_t a3;           // edx
+    reg_t a4;           // esi
+    reg_t a5;           // edi
+} syscall_args_t;
+
+typedef reg_t (*syscall_fn_t)(const syscall_args_t *args);
+
+extern bool syscall_sysenter_ok;    // Whether sysenter may be used
+
+// Enter system call nr through int 0x80
+static inline reg_t syscall_int(reg_t nr, reg_t a1, reg_t a2, reg_t a3)
+{
+    reg_t ret;
+    asm volatile (
+        "int $0x80\n\t"
+        : "=a" (ret)
+        : "a" (nr), "b" (a1), "c" (a2), "d" (a3)
+        : "memory"
+    );
+    return ret;
+}
+
+// Enter system call nr through sysenter (see syscall_sysenter_ok), by way of
+// syscall_sysenter in syscall_asm.s, to which sysexit returns
+static inline reg_t syscall_fast(reg_t nr, reg_t a1, reg_t a2, reg_t a3)
+{
+    reg_t ret;
+    asm volatile (
+        "call syscall_sysenter\n\t"
+        : "=a" (ret)
+        : "a" (nr), "b" (a1), "c" (a2), "d" (a3)
+        : "memory"
+    );
+    return ret;
+}
+
+// Enter system call nr (from user mode)
+static inline reg_t syscall(reg_t nr, reg_t a1, reg_t a2, reg_t a3)
+{
+    if (syscall_sysenter_ok)
+        return syscall_fast(nr, a1, a2, a3);
+    return syscall_int(nr, a1, a2, a3);
+}
+
+void syscall_bench(void);
+void syscall_bench_report(void);
+reg_t syscall_dispatch(const syscall_args_t *args);
+void syscall_init(void);
+void syscall_init_ap(size_t cpu);
+
+#endif // _KERNEL_SYSCALL_H
@@ -0,0 +1,86 @@
+# syscall_asm.s: System call entry points (see syscall.h)
+
+# NOTE: must match GDT_SEL_PERCPU in gdt.h
+.set PERCPU_SEL, 0x38
+
+# int 0x80 (through an interrupt gate, so interrupts are disabled)
+.globl  int_handle_syscall
+.type   int_handle_syscall, @function
+int_handle_syscall:
+    # Save registers the handler may clobber (besides eax, the result)
+    pushl   %gs
+    pushl   %ecx
+    pushl   %edx
+
+    # Push syscall_args_t and a pointer to it
+    pushl   %edi
+    pushl   %esi
+    pushl   %edx
+    pushl   %ecx
+    pushl   %ebx
+    pushl   %eax
+    pushl   %esp
+
+    # Load the per-CPU segment (user mode runs with a flat GS)
+    movw    $PERCPU_SEL, %cx
+    movw    %cx, %gs
+
+    call    syscall_dispatch
+    addl    $28, %esp
+
+    popl    %edx
+    popl    %ecx
+    popl    %gs
+    iret
+
+# sysenter (interrupts are disabled). The stack pointer is the address of
+# TSS.esp0 (see syscall_init_ap()), and ebp the user stack pointer.
+.globl  syscall_sysenter_entry
+.type   syscall_sysenter_entry, @function
+syscall_sysenter_entry:
+    # Switch to the kernel stack of the current process
+    movl    (%esp), %esp
+
+    pushl   %ebp
+    pushl   %gs
+
+    # Push syscall_args_t and a pointer to it (ecx and edx are restored by
+    # syscall_sysenter)
+    pushl   %edi
+    pushl   %esi
+    pushl   %edx
+    pushl   %ecx
+    pushl   %ebx
+    pushl   %eax
+    pushl   %esp
+
+    movw    $PERCPU_SEL, %cx
+    movw    %cx, %gs
+
+    call    syscall_dispatch
+    addl    $28, %esp
+
+    # sysexit continues at edx with the stack pointer in ecx
+    popl    %gs
+    popl    %ecx
+    movl    $syscall_sysexit_return, %edx
+    sysexit
+
+# User side of sysenter, called with the arguments in registers (see
+# syscall_fast()). The flags are saved here, since sysenter clears IF and
+# sysexit leaves it clear.
+.globl  syscall_sysenter
+.type   syscall_sysenter, @function
+syscall_sysenter:
+    pushfl
+    pushl   %ecx
+    pushl   %edx
+    pushl   %ebp
+    movl    %esp, %ebp
+    sysenter
+syscall_sysexit_return:
+    popl    %ebp
+    popl    %edx
+    popl    %ecx
+    popfl
+    ret
@@ -0,0 +1,261 @@
+/**
+ * tlb.c: TLB shootdown
+ *
+ * invlpg only invalidates the TLB of the calling processor. When a mapping
+ * that other processors may cache changes (kernel mappings, which every
+ * processor shares, or user mappings of a process running on another
+ * processor), the initiator queues the pages in the request mailbox of each
+ * such processor, sends it an IDT_VECTOR_TLB interrupt and waits until all of
+ * them have acknowledged the request. Requests to the same processor are
+ * merged until it handles them, and a processor that receives more than
+ * TLB_RANGES ranges (or more than TLB_FLUSH_PAGES pages) flushes its entire
+ * TLB instead (no mapping is global, so reloading CR3 is enough).
+ *
+ * The initiator usually holds the kernel lock with interrupts disabled, and a
+ * target may be waiting for that same lock with interrupts disabled, where the
+ * interrupt cannot reach it. Processors therefore handle their mailbox
+ * whenever they wait for a lock or an acknowledgement with interrupts disabled
+ * (see lock_relax()).
+ */
+
+#include <stdatomic.h>
+
+#include "asm.h"
+#include "clock.h"
+#include "gdt.h"
+#include "int.h"
+#include "io.h"
+#include "lock.h"
+#include "page.h"
+#include "smp.h"
+#include "tlb.h"
+
+// Request mailbox and statistics of a processor
+typedef struct __attribute__((aligned(64))) {
+    lock_ticket_t lock;         // Protects n, all and ranges
+    size_t n;                   // Number of pending ranges
+    bool all;                   // Whether the entire TLB must be flushed
+    tlb_range_t ranges[TLB_RANGES];
+    atomic_uint queued;         // Number of requests queued
+    atomic_uint done;           // Number of requests handled
+    tlb_stats_t stats;          // Updated by the processor itself only
+} tlb_cpu_t;
+
+static tlb_cpu_t tlb_cpus[SMP_CPUS_MAX];
+static uint64_t tlb_report_last;        // TSC of the last tlb_report()
+static size_t tlb_reported;             // Shootdowns at the last tlb_report()
+
+// Return the set of all processors but the calling one
+tlb_cpus_t tlb_cpus_others(void)
+{
+    // Paging is set up before the per-CPU data of the BSP
+    if (smp_cpu_count() == 1)
+        return 0;
+
+    const tlb_cpus_t online = ((tlb_cpus_t)1 << smp_cpu_count()) - 1;
+    return online & ~((tlb_cpus_t)1 << smp_cpu_id());
+}
+
+// Add pages to ranges, merging them with an adjacent range if possible
+static void tlb_add_range(tlb_range_t *ranges, size_t *n, bool *all,
+                          uintptr_t vma, size_t pages)
+{
+    if (*all)
+        return;
+
+    for (size_t i = 0; i < *n; i++) {
+        tlb_range_t *r = &ranges[i];
+        if (vma + pages * PAGE_SIZE == r->vma) {
+            r->vma = vma;
+            r->pages += pages;
+            return;
+        }
+        if (r->vma + r->pages * PAGE_SIZE == vma) {
+            r->pages += pages;
+            return;
+        }
+    }
+
+    if (*n == TLB_RANGES) {
+        *all = true;
+        return;
+    }
+    ranges[(*n)++] = (tlb_range_t) { .vma = vma, .pages = pages };
+}
+
+// Add pages to batch (to be invalidated on the processors of the batch)
+void tlb_batch_add(tlb_batch_t *batch, uintptr_t vma, size_t pages)
+{
+    tlb_add_range(batch->ranges, &batch->n, &batch->all, vma, pages);
+}
+
+// Invalidate the ranges of a request on the calling processor
+static void tlb_invalidate(tlb_stats_t *stats, const tlb_range_t *ranges,
+                           size_t n, bool all)
+{
+    size_t pages = 0;
+    for (size_t i = 0; i < n; i++)
+        pages += ranges[i].pages;
+
+    if (all || pages > TLB_FLUSH_PAGES) {
+        set_cr3(get_cr3());
+        stats->full_flushes++;
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < ranges[i].pages; j++)
+            invlpg(ranges[i].vma + j * PAGE_SIZE);
+    }
+    stats->pages_flushed += pages;
+}
+
+/**
+ * Handle the pending requests of the calling processor, if any
+ * NOTE: must be called with interrupts disabled
+ */
+void tlb_poll(void)
+{
+    // User processes run with a flat GS, so they cannot find their mailbox
+    // (the interrupt handles it once they enable interrupts again)
+    if ((get_cs() & 3) != RING0)
+        return;
+
+    tlb_cpu_t *c = &tlb_cpus[smp_cpu_id()];
+    if (atomic_load_explicit(&c->queued, memory_order_acquire)
+        == atomic_load_explicit(&c->done, memory_order_relaxed))
+        return;
+
+    // An initiator holds the mailbox only briefly, so the next poll (or the
+    // interrupt handler) will get it
+    if (!lock_ticket_try(&c->lock))
+        return;
+    tlb_range_t ranges[TLB_RANGES];
+    const size_t n = c->n;
+    const bool all = c->all;
+    for (size_t i = 0; i < n; i++)
+        ranges[i] = c->ranges[i];
+    const unsigned int queued = atomic_load_explicit(&c->queued, memory_order_relaxed);
+    c->n = 0;
+    c->all = false;
+    lock_ticket_unlock(&c->lock);
+
+    tlb_invalidate(&c->stats, ranges, n, all);
+    atomic_store_explicit(&c->done, queued, memory_order_release);
+}
+
+// Queue ranges in the mailbox of cpu and return the number of the request
+static unsigned int tlb_queue(size_t cpu, const tlb_range_t *ranges, size_t n,
+                              bool all)
+{
+    tlb_cpu_t *c = &tlb_cpus[cpu];
+
+    lock_ticket(&c->lock);
+    for (size_t i = 0; i < n; i++)
+        tlb_add_range(c->ranges, &c->n, &c->all, ranges[i].vma, ranges[i].pages);
+    c->all |= all;
+    const unsigned int request = atomic_fetch_add_explicit(&c->queued, 1,
+                                                           memory_order_relaxed) + 1;
+    lock_ticket_unlock(&c->lock);
+
+    return request;
+}
+
+// Invalidate ranges on the processors in cpus (except the calling one) and
+// wait until they have done so
+static void tlb_send(tlb_cpus_t cpus, const tlb_range_t *ranges, size_t n, bool all)
+{
+    cpus &= tlb_cpus_others();
+    if (!cpus)
+        return;
+
+    const flags_reg_t flags = get_flags();
+    cli();
+    tlb_cpu_t *self = &tlb_cpus[smp_cpu_id()];
+
+    unsigned int requests[SMP_CPUS_MAX];
+    for (size_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (!(cpus & (tlb_cpus_t)1 << cpu))
+            continue;
+        requests[cpu] = tlb_queue(cpu, ranges, n, all);
+        smp_send_ipi(cpu, IDT_VECTOR_TLB);
+        self->stats.ipis++;
+    }
+
+    // Keep handling requests to this processor, whose initiators may be
+    // waiting for it just like it waits for them
+    for (size_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (!(cpus & (tlb_cpus_t)1 << cpu))
+            continue;
+        while ((int)(atomic_load_explicit(&tlb_cpus[cpu].done, memory_order_acquire)
+                     - requests[cpu]) < 0) {
+            tlb_poll();
+            asm volatile ("pause\n\t");
+        }
+    }
+    self->stats.shootdowns++;
+
+    set_flags(flags);
+}
+
+/**
+ * Invalidate the ranges of batch on its processors (except the calling one)
+ * and empty it
+ * NOTE: the caller invalidates its own TLB, e.g. with invlpg
+ */
+void tlb_batch_flush(tlb_batch_t *batch)
+{
+    if (batch->n || batch->all)
+        tlb_send(batch->cpus, batch->ranges, batch->n, batch->all);
+    batch->n = 0;
+    batch->all = false;
+}
+
+/**
+ * Invalidate pages starting at vma on the processors in cpus (except the
+ * calling one), which may cache them
+ * NOTE: the caller invalidates its own TLB, e.g. with invlpg
+ */
+void tlb_shootdown(tlb_cpus_t cpus, uintptr_t vma, size_t pages)
+{
+    const tlb_range_t range = { .vma = vma, .pages = pages };
+    tlb_send(cpus, &range, 1, false);
+}
+
+// Sum the statistics of every processor
+static tlb_stats_t tlb_stats(void)
+{
+    tlb_stats_t total = { 0 };
+    for (size_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        const tlb_stats_t *s = &tlb_cpus[cpu].stats;
+        total.shootdowns += s->shootdowns;
+        total.ipis += s->ipis;
+        total.pages_flushed += s->pages_flushed;
+        total.full_flushes += s->full_flushes;
+    }
+    return total;
+}
+
+// Print TLB shootdown statistics
+void tlb_info(void)
+{
+    const tlb_stats_t total = tlb_stats();
+    printk("tlb_info: %u shootdowns, %u IPIs, %u pages flushed, %u full flushes\n",
+           total.shootdowns, total.ipis, total.pages_flushed, total.full_flushes);
+}
+
+// Print statistics if shootdowns were sent since the last report (at most
+// every TLB_REPORT_US)
+void tlb_report(void)
+{
+    const uint64_t now = rdtsc();
+    if (now - tlb_report_last < clock_us_to_tsc(TLB_REPORT_US))
+        return;
+    tlb_report_last = now;
+
+    const size_t shootdowns = tlb_stats().shootdowns;
+    if (shootdowns != tlb_reported) {
+        tlb_reported = shootdowns;
+        tlb_info();
+    }
+}
@@ -0,0 +1,53 @@
+/**
+ * tlb.h: TLB shootdown
+ */
+
+#ifndef _KERNEL_TLB_H
+#define _KERNEL_TLB_H
+
+#include "std.h"
+
+// TLB constants
+enum {
+    TLB_RANGES          = 8,    // Ranges a batch or request holds before it
+                                // falls back to flushing the entire TLB
+    TLB_FLUSH_PAGES     = 32,   // Pages above which the entire TLB is flushed
+                                // rather than page by page
+    TLB_REPORT_US       = 5000000,  // Minimum interval of tlb_report()
+};
+
+// Set of processors (bit i stands for processor i)
+typedef uint32_t tlb_cpus_t;
+
+// Range of pages to invalidate
+typedef struct {
+    uintptr_t vma;          // First page
+    size_t pages;           // Number of pages
+} tlb_range_t;
+
+// Ranges to invalidate on a set of processors with a single shootdown (see
+// tlb_batch_add() and tlb_batch_flush())
+typedef struct {
+    tlb_cpus_t cpus;        // Processors that may cache the ranges
+    size_t n;               // Number of ranges
+    bool all;               // Whether the ranges overflowed (flush everything)
+    tlb_range_t ranges[TLB_RANGES];
+} tlb_batch_t;
+
+// TLB shootdown statistics
+typedef struct {
+    size_t shootdowns;      // Shootdowns sent (each waits for all its targets)
+    size_t ipis;            // Interrupts sent to target processors
+    size_t pages_flushed;   // Pages invalidated for other processors
+    size_t full_flushes;    // Entire TLB flushes for other processors
+} tlb_stats_t;
+
+void tlb_batch_add(tlb_batch_t *batch, uintptr_t vma, size_t pages);
+void tlb_batch_flush(tlb_batch_t *batch);
+tlb_cpus_t tlb_cpus_others(void);
+void tlb_info(void);
+void tlb_poll(void);
+void tlb_report(void);
+void tlb_shootdown(tlb_cpus_t cpus, uintptr_t vma, size_t pages);
+
+#endif // _KERNEL_TLB_H
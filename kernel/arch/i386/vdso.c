@@ -0,0 +1,132 @@
+/**
+ * vdso.c: Shared read-only kernel data page
+ */
+
+#include "alloc.h"
+#include "clock.h"
+#include "io.h"
+#include "page.h"
+#include "proc.h"
+#include "string.h"
+#include "syscall.h"
+#include "vdso.h"
+
+const vdso_data_t *vdso_data;   // Read-only view (for processes)
+static vdso_data_t *vdso_page;  // Writable mapping (for the kernel)
+
+_Static_assert(sizeof(vdso_data_t) <= PAGE_SIZE, "vDSO data exceeds a page");
+
+// Results of vdso_bench(), printed by vdso_bench_report()
+static struct {
+    uint64_t getpid_syscall;    // Cycles per getpid system call
+    uint64_t getpid_vdso;       // Cycles per vdso_getpid()
+    uint64_t clock;             // Cycles per vdso_clock_ns()
+    pid_t pid;                  // PID read from the data page
+    pid_t pid_syscall;          // PID returned by the system call
+    size_t backwards;           // Clock reads that went backwards
+    bool done;                  // Whether the results are ready
+} vdso_bench_result;
+
+/**
+ * Allocate the page, map its read-only view and publish the clock parameters
+ * NOTE: must be called after clock_init() and before smp_init()
+ */
+void vdso_init(void)
+{
+    vdso_page = kalloc(PAGE_GET_DEFAULT, PAGE_SIZE, PAGE_SIZE);
+    memset(vdso_page, 0, PAGE_SIZE);
+    vdso_data = (const vdso_data_t*)page_map_public((uintptr_t)vdso_page);
+
+    vdso_update_clock();
+    printk("vdso_init: data page at %p\n", vdso_data);
+}
+
+// Publish the current parameters of the monotonic clock
+void vdso_update_clock(void)
+{
+    const unsigned int seq = atomic_load_explicit(&vdso_page->seq, memory_order_relaxed);
+    atomic_store_explicit(&vdso_page->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    vdso_page->tsc_khz = clock_tsc_khz();
+    clock_get_params(&vdso_page->base, &vdso_page->mult, &vdso_page->shift);
+
+    atomic_store_explicit(&vdso_page->seq, seq + 2, memory_order_release);
+}
+
+/**
+ * Publish the scheduling state of cpu
+ * NOTE: must be called by cpu itself with its run queue lock held (see
+ * proc_switch())
+ */
+void vdso_update_cpu(size_t cpu, pid_t pid, size_t nr_running)
+{
+    vdso_cpu_t *c = &vdso_page->cpus[cpu];
+    const unsigned int seq = atomic_load_explicit(&c->seq, memory_order_relaxed);
+    atomic_store_explicit(&c->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    c->pid = pid;
+    c->nr_running = nr_running;
+
+    atomic_store_explicit(&c->seq, seq + 2, memory_order_release);
+}
+
+// Process of vdso_bench(). It runs in user mode, so the results are left for
+// the idle loop to print (see vdso_bench_report()).
+static void vdso_bench_proc(void)
+{
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < VDSO_BENCH_ITERS; i++)
+        syscall(SYSCALL_GETPID, 0, 0, 0);
+    vdso_bench_result.getpid_syscall = (rdtsc() - start) / VDSO_BENCH_ITERS;
+
+    pid_t pid = 0;
+    start = rdtsc();
+    for (size_t i = 0; i < VDSO_BENCH_ITERS; i++)
+        pid = vdso_getpid();
+    vdso_bench_result.getpid_vdso = (rdtsc() - start) / VDSO_BENCH_ITERS;
+    vdso_bench_result.pid = pid;
+    vdso_bench_result.pid_syscall = syscall(SYSCALL_GETPID, 0, 0, 0);
+
+    uint64_t last = 0;
+    size_t backwards = 0;
+    start = rdtsc();
+    for (size_t i = 0; i < VDSO_BENCH_ITERS; i++) {
+        const uint64_t ns = vdso_clock_ns();
+        backwards += ns < last;
+        last = ns;
+    }
+    vdso_bench_result.clock = (rdtsc() - start) / VDSO_BENCH_ITERS;
+    vdso_bench_result.backwards = backwards;
+    __atomic_store_n(&vdso_bench_result.done, true, __ATOMIC_RELEASE);
+
+    while (1) {
+        asm volatile ("pause\n\t");
+    }
+}
+
+/**
+ * Benchmark reads of the data page against system calls: a process measures
+ * the cycles per PID and clock read from user mode
+ */
+void vdso_bench(void)
+{
+    proc_register(&vdso_bench_proc, 10, PROC_LEVEL_DEFAULT);
+}
+
+// Print results of vdso_bench() once its process is done
+void vdso_bench_report(void)
+{
+    if (!__atomic_load_n(&vdso_bench_result.done, __ATOMIC_ACQUIRE))
+        return;
+
+    printk("vdso_bench: getpid (system call): %lu cycles per call\n",
+           vdso_bench_result.getpid_syscall);
+    printk("vdso_bench: getpid (vDSO): %lu cycles per call (PID %u, system "
+           "call: %u)\n", vdso_bench_result.getpid_vdso, vdso_bench_result.pid,
+           vdso_bench_result.pid_syscall);
+    printk("vdso_bench: clock: %lu cycles per call (%u went backwards)\n",
+           vdso_bench_result.clock, vdso_bench_result.backwards);
+    vdso_bench_result.done = false;
+}
@@ -0,0 +1,105 @@
+/**
+ * vdso.h: Shared read-only kernel data page
+ *
+ * The kernel publishes the parameters of the monotonic clock (see clock.c) and
+ * the scheduling state of every processor in a page that processes may read
+ * but not write, so that reading the time or the current PID costs no system
+ * call. The page is a read-only view in the kernel half of the address space,
+ * which every process shares (see page_map_public()); the kernel updates it
+ * through a writable mapping of its own.
+ *
+ * Every part of the page is guarded by a sequence count, which the writer makes
+ * odd while it updates the part. Readers retry while the count is odd or has
+ * changed during the read, so they never take a lock and the writer never
+ * waits. A process finds the processor it runs on with lsl on GDT_SEL_CPU,
+ * whose limit is the processor index (see gdt.c); the count of that processor
+ * changes at every switch, so a reader that migrated in between retries.
+ */
+
+#ifndef _KERNEL_VDSO_H
+#define _KERNEL_VDSO_H
+
+#include <stdatomic.h>
+
+#include "asm.h"
+#include "clock.h"
+#include "gdt.h"
+#include "proc.h"
+#include "smp.h"
+#include "std.h"
+
+// vDSO constants
+enum {
+    VDSO_BENCH_ITERS = 100000,  // Reads per kind in vdso_bench()
+};
+
+// Scheduling state of a processor (cache-line aligned, since each one is
+// written by its processor at every switch)
+typedef struct __attribute__((aligned(64))) vdso_cpu {
+    atomic_uint seq;        // Sequence count (odd while being updated)
+    pid_t pid;              // Current process
+    uint32_t nr_running;    // Runnable processes in the run queues
+} vdso_cpu_t;
+
+// Layout of the page
+typedef struct vdso_data {
+    atomic_uint seq;        // Sequence count of the clock parameters
+    uint32_t tsc_khz;       // TSC frequency in kHz
+    uint32_t mult;          // Nanoseconds per cycle, scaled by 2^shift
+    uint32_t shift;
+    uint64_t base;          // TSC at time zero of the monotonic clock
+    vdso_cpu_t cpus[SMP_CPUS_MAX];
+} vdso_data_t;
+
+extern const vdso_data_t *vdso_data;    // Read-only view of the page
+
+// Return index of the processor the caller runs on (from user mode)
+static inline size_t vdso_getcpu(void)
+{
+    size_t cpu;
+    asm volatile (
+        "lsl %1, %0\n\t"
+        : "=r" (cpu)
+        : "r" ((uint32_t)GDT_SEL_CPU)
+    );
+    return cpu;
+}
+
+// Return nanoseconds since boot, like clock_get_ns() (from user mode)
+static inline uint64_t vdso_clock_ns(void)
+{
+    const vdso_data_t *vd = vdso_data;
+    unsigned int seq;
+    uint64_t ns;
+    do {
+        seq = atomic_load_explicit(&vd->seq, memory_order_acquire);
+        ns = clock_scale_ns(rdtsc() - vd->base, vd->mult, vd->shift);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || atomic_load_explicit(&vd->seq, memory_order_relaxed) != seq);
+    return ns;
+}
+
+// Return PID of the calling process, like SYSCALL_GETPID (from user mode)
+static inline pid_t vdso_getpid(void)
+{
+    const vdso_data_t *vd = vdso_data;
+    size_t cpu;
+    unsigned int seq;
+    pid_t pid;
+    do {
+        cpu = vdso_getcpu();
+        seq = atomic_load_explicit(&vd->cpus[cpu].seq, memory_order_acquire);
+        pid = vd->cpus[cpu].pid;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || vdso_getcpu() != cpu
+             || atomic_load_explicit(&vd->cpus[cpu].seq, memory_order_relaxed) != seq);
+    return pid;
+}
+
+void vdso_bench(void);
+void vdso_bench_report(void);
+void vdso_init(void);
+void vdso_update_clock(void);
+void vdso_update_cpu(size_t cpu, pid_t pid, size_t nr_running);
+
+#endif // _KERNEL_VDSO_H
@@ -4,6 +4,7 @@
  * For documentation, see: http://www.osdever.net/FreeVGA/vga/vga.htm
  */
 
+#include "lock.h"
 #include "std.h"
 #include "string.h"
 #include "vga.h"
@@ -18,6 +19,8 @@ static vga_color_t vga_color = VGA_COLOR_DEFAULT;
 //static volatile uint8_t *vga_crtc_data = VGA_PADDR_CRTC_DATA;
 static vga_entry_t *vga_buffer = VGA_PADDR_BUFFER;
 
+static lock_ticket_t vga_console_lock;  // Serialises output of all processors
+
 static inline vga_color_t vga_entry_color(int fg, int bg)
 {
     return fg | (vga_color_t)bg << 4;
@@ -52,6 +55,23 @@ static inline void vga_linebreak(void)
 
 // GLOBAL FUNCTIONS
 
+/**
+ * Disable interrupts and take the console lock, so that output of different
+ * processors (e.g. printk() and SYSCALL_WRITE) is not interleaved
+ * RETURN
+ *  flags register to pass to vga_unlock()
+ */
+flags_reg_t vga_lock(void)
+{
+    return lock_ticket_irqsave(&vga_console_lock);
+}
+
+// Release the console lock and restore the interrupt flag
+void vga_unlock(flags_reg_t flags)
+{
+    lock_ticket_irqrestore(&vga_console_lock, flags);
+}
+
 void vga_putc(char c)
 {
     // Handle the condition when printing was interrupted in another context
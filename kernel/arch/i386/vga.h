@@ -5,6 +5,7 @@
 #ifndef _KERNEL_VGA_H
 #define _KERNEL_VGA_H
 
+#include "asm.h"
 #include "std.h"
 
 // Important physical addresses
@@ -40,11 +41,13 @@ enum {
 #define VGA_COLOR_DEFAULT   ((vga_color_t)(VGA_COLOR_LIGHT_GREY | VGA_COLOR_BLACK << 4))
 
 void vga_clear(void);
+flags_reg_t vga_lock(void);
 void vga_map_buffer(uintptr_t new_buffer);
 void vga_putc(char c);
 void vga_puts(const char *data);
 void vga_reset(void);
 void vga_set_position(size_t row, size_t col);
+void vga_unlock(flags_reg_t flags);
 void vga_write(const char *data, size_t size);
 
 // VGA methods for init section
@@ -0,0 +1,592 @@
+/**
+ * vma.c: Per-process virtual memory areas
+ *
+ * Each process owns a red-black tree of non-overlapping areas ordered by start
+ * address. Areas only describe what may be mapped: page table entries are
+ * filled in lazily by vma_fault() on first access, so lookups on the fault path
+ * are a single O(log n) descent (or a hit in the one-entry cache).
+ *
+ * Anonymous areas are backed by zero-filled frames owned by the process.
+ * Physical areas map a fixed range of physical memory; their pages are mapped
+ * uncached (PAGE_DISABLE_CACHE), which also keeps ksm.c and zram.c away from
+ * them, and are never returned to the page allocator.
+ *
+ * Large areas cover a single 4 MiB block of physical memory (see
+ * compact_alloc_block()), which is zeroed and mapped right away by one large
+ * page directory entry. The page table of its range stays empty (see
+ * proc_set_large_page()), so the scanners never see the block. Large areas are
+ * only unmapped as a whole.
+ *
+ * The areas and page tables of a process are serialised by the lock of its
+ * address space (see vma_lock()), which faults, system calls and the scanners
+ * of ksm.c and zram.c take before the kernel lock. The kernel lock is only
+ * taken around the allocators, so faults of different processes proceed in
+ * parallel; frames are zeroed through the windows of the processor (see
+ * page_map_window()) after it is released.
+ */
+
+#include <stdatomic.h>
+
+#include "alloc.h"
+#include "asm.h"
+#include "compact.h"
+#include "io.h"
+#include "ksm.h"
+#include "mem.h"
+#include "page.h"
+#include "proc.h"
+#include "smp.h"
+#include "string.h"
+#include "tlb.h"
+#include "vma.h"
+#include "zram.h"
+
+// Round addr up to a page boundary
+static inline uintptr_t vma_page_up(uintptr_t addr)
+{
+    return (addr + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+}
+
+// Return whether [addr, addr + len) is a valid, page-aligned user range
+static inline bool vma_range_valid(uintptr_t addr, size_t len)
+{
+    return len && !(addr & (PAGE_SIZE - 1)) && addr >= VMA_USER_START
+           && addr < KERNEL_START_VMA && KERNEL_START_VMA - addr >= len;
+}
+
+static inline vma_area_t * vma_next(vma_area_t *area)
+{
+    rb_node_t *node = rb_next(&area->node);
+    return node ? rb_entry(node, vma_area_t, node) : NULL;
+}
+
+// Return first area ending above addr, or NULL
+static vma_area_t * vma_lower_bound(vma_space_t *space, uintptr_t addr)
+{
+    rb_node_t *node = space->tree.root;
+    vma_area_t *found = NULL;
+    while (node) {
+        vma_area_t *area = rb_entry(node, vma_area_t, node);
+        if (area->end > addr) {
+            found = area;
+            node = node->left;
+        } else {
+            node = node->right;
+        }
+    }
+    return found;
+}
+
+// Return area containing addr, or NULL
+vma_area_t * vma_find(vma_space_t *space, uintptr_t addr)
+{
+    vma_area_t *area = space->cache;
+    if (area && area->start <= addr && addr < area->end)
+        return area;
+
+    area = vma_lower_bound(space, addr);
+    if (!area || area->start > addr)
+        return NULL;
+
+    space->cache = area;
+    return area;
+}
+
+// Return whether no area overlaps [start, end)
+static inline bool vma_range_free(vma_space_t *space, uintptr_t start, uintptr_t end)
+{
+    const vma_area_t *area = vma_lower_bound(space, start);
+    return !area || area->start >= end;
+}
+
+// Return lowest free range of len bytes at or above VMA_MMAP_BASE that starts
+// at a multiple of align (a power of two), or 0
+static uintptr_t vma_find_gap(vma_space_t *space, size_t len, uintptr_t align)
+{
+    uintptr_t addr = VMA_MMAP_BASE;
+    for (vma_area_t *a = vma_lower_bound(space, addr); a; a = vma_next(a)) {
+        if (a->start > addr && a->start - addr >= len)
+            break;
+        if (a->end > addr)
+            addr = (a->end + align - 1) & ~(align - 1);
+    }
+    if (addr >= KERNEL_START_VMA || KERNEL_START_VMA - addr < len)
+        return 0;
+    return addr;
+}
+
+static void vma_insert(vma_space_t *space, vma_area_t *area)
+{
+    rb_node_t **link = &space->tree.root;
+    rb_node_t *parent = NULL;
+    while (*link) {
+        parent = *link;
+        if (area->start < rb_entry(parent, vma_area_t, node)->start)
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+    rb_insert(&space->tree, &area->node, parent, link);
+}
+
+// Allocate area (the heap is serialised by the kernel lock)
+static vma_area_t * vma_area_new(void)
+{
+    const flags_reg_t flags = smp_lock_kernel();
+    vma_area_t *area = kmalloc(sizeof(*area));
+    smp_unlock_kernel(flags);
+    return area;
+}
+
+static void vma_remove(vma_space_t *space, vma_area_t *area)
+{
+    rb_erase(&space->tree, &area->node);
+    if (space->cache == area)
+        space->cache = NULL;
+
+    const flags_reg_t flags = smp_lock_kernel();
+    kfree(area);
+    smp_unlock_kernel(flags);
+}
+
+// Return whether an anonymous area can be extended to cover a range of prot
+static inline bool vma_mergeable(const vma_area_t *area, uint32_t prot)
+{
+    return area && area->backing == VMA_ANON && area->prot == prot;
+}
+
+// Add area for free range [start, end). Anonymous areas are merged with
+// adjacent anonymous areas of equal protection to keep the tree small.
+static void vma_add(vma_space_t *space, uintptr_t start, uintptr_t end,
+                    uint32_t prot, vma_backing_t backing, uintptr_t phys)
+{
+    if (backing == VMA_ANON) {
+        vma_area_t *prev = vma_find(space, start - 1);
+        vma_area_t *next = vma_find(space, end);
+        const bool merge_prev = vma_mergeable(prev, prot);
+        const bool merge_next = vma_mergeable(next, prot);
+
+        if (merge_prev && merge_next) {
+            prev->end = next->end;
+            vma_remove(space, next);
+            return;
+        } else if (merge_prev) {
+            prev->end = end;
+            return;
+        } else if (merge_next) {
+            next->start = start;
+            return;
+        }
+    }
+
+    vma_area_t *area = vma_area_new();
+    *area = (vma_area_t) {
+        .start = start,
+        .end = end,
+        .prot = prot,
+        .backing = backing,
+        .phys = phys,
+    };
+    vma_insert(space, area);
+}
+
+// Zero the frames of a block through the windows of the processor
+static void vma_zero_block(uintptr_t pma)
+{
+    const flags_reg_t flags = get_flags();
+    cli();
+    for (uintptr_t off = 0; off < PAGE_BLOCK_SIZE; off += PAGE_SIZE) {
+        memset(page_map_window(PAGE_WINDOW_DST, pma + off), 0, PAGE_SIZE);
+        page_unmap_window(PAGE_WINDOW_DST);
+    }
+    set_flags(flags);
+}
+
+// Map large area of pid (see proc_set_large_page())
+static void vma_map_large(pid_t pid, const vma_area_t *area)
+{
+    page_entry_t entry = area->phys | PAGE_LARGE | PAGE_PUBLIC | PAGE_PRESENT;
+    if (area->prot & VMA_PROT_WRITE)
+        entry |= PAGE_WRITE;
+
+    const flags_reg_t flags = smp_lock_kernel();
+    proc_get_pte(pid, area->start, true);
+    proc_set_large_page(pid, area->start, entry);
+    smp_unlock_kernel(flags);
+}
+
+// Unmap large area of pid and free its block
+static void vma_release_large(pid_t pid, const vma_area_t *area)
+{
+    // As in vma_release(), the block is freed once no TLB caches it
+    tlb_batch_t batch = { 0 };
+    const flags_reg_t flags = smp_lock_kernel();
+    proc_set_large_page(pid, area->start, (page_entry_t)0);
+    tlb_batch_add(&batch, area->start, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    batch.cpus = proc_tlb_cpus(pid);
+    tlb_batch_flush(&batch);
+    page_free_block(area->phys);
+    smp_unlock_kernel(flags);
+}
+
+// Clear page table entries of pid in [start, end) and release what they map
+static void vma_release(pid_t pid, uintptr_t start, uintptr_t end,
+                        vma_backing_t backing)
+{
+    uintptr_t vma = start;
+    while (vma < end) {
+        const uintptr_t table_end = (vma | (PAGE_SIZE * PAGE_ENTRIES - 1)) + 1;
+        const uintptr_t stop = end < table_end ? end : table_end;
+        page_entry_t *pte = proc_get_pte(pid, vma, false);
+        if (!pte) {
+            // Skip to the next page table
+            vma = table_end;
+            continue;
+        }
+
+        // The working-set sampler (see wss.c) changes entries without locks,
+        // so each one is read and cleared atomically. The kernel lock is held
+        // until the TLB of the processor running pid (if any) is flushed as
+        // well, so that freed frames are not reused before.
+        tlb_batch_t batch = { 0 };
+        const flags_reg_t flags = smp_lock_kernel();
+        for (; vma < stop; vma += PAGE_SIZE, pte++) {
+            const page_entry_t entry = *pte;
+            if (entry & PAGE_PRESENT) {
+                if (backing == VMA_ANON)
+                    ksm_release(entry & ~(uintptr_t)0xfff);
+                tlb_batch_add(&batch, vma, 1);
+            } else if (entry & PAGE_SWAPPED) {
+                zram_discard(entry);
+            }
+            if (entry)
+                page_set_pte(pte, vma, (page_entry_t)0);
+        }
+        atomic_thread_fence(memory_order_seq_cst);
+        batch.cpus = proc_tlb_cpus(pid);
+        tlb_batch_flush(&batch);
+        smp_unlock_kernel(flags);
+    }
+}
+
+/**
+ * Map len bytes of user memory into the address space of pid
+ *  addr:       page-aligned address, or 0 to let the kernel choose
+ *  prot:       VMA_PROT_* bits
+ *  backing:    VMA_ANON for zero-filled memory, VMA_PHYS to map phys,
+ *              VMA_LARGE for a zeroed block of PAGE_BLOCK_SIZE bytes (addr
+ *              must be a multiple of it)
+ *  phys:       page-aligned physical address (VMA_PHYS only)
+ * NOTE: must be called without the kernel lock (and, for VMA_LARGE, without
+ * the lock of any address space, see compact_alloc_block())
+ * RETURN
+ *  address of the new area, or 0 if addr is invalid or overlaps an existing
+ *  area, or no free range (or block) is large enough
+ */
+uintptr_t vma_mmap(pid_t pid, uintptr_t addr, size_t len, uint32_t prot,
+                   vma_backing_t backing, uintptr_t phys)
+{
+    vma_space_t *space = proc_get_vmas(pid);
+    uintptr_t align = PAGE_SIZE;
+
+    len = vma_page_up(len);
+    if (!len || (phys & (PAGE_SIZE - 1)))
+        return 0;
+
+    // Compaction takes the locks of all address spaces, so the block is
+    // allocated (and zeroed) before taking the lock. Like other user memory,
+    // it may not take the frames reserved for the kernel (see page_new_user()).
+    if (backing == VMA_LARGE) {
+        align = PAGE_BLOCK_SIZE;
+        if (len != PAGE_BLOCK_SIZE || (addr & (PAGE_BLOCK_SIZE - 1))
+            || !page_large_supported()
+            || page_frames_free() < PAGE_BLOCK_FRAMES + PAGE_RESERVE)
+            return 0;
+        phys = compact_alloc_block();
+        if (!phys)
+            return 0;
+        vma_zero_block(phys);
+    }
+
+    const flags_reg_t flags = lock_write_irqsave(&space->lock);
+    if (addr) {
+        if (!vma_range_valid(addr, len) || !vma_range_free(space, addr, addr + len))
+            addr = 0;
+    } else {
+        addr = vma_find_gap(space, len, align);
+    }
+
+    if (addr) {
+        vma_add(space, addr, addr + len, prot, backing, phys);
+        if (backing == VMA_LARGE)
+            vma_map_large(pid, vma_find(space, addr));
+    } else if (backing == VMA_LARGE) {
+        const flags_reg_t kernel = smp_lock_kernel();
+        page_free_block(phys);
+        smp_unlock_kernel(kernel);
+    }
+    lock_write_irqrestore(&space->lock, flags);
+    return addr;
+}
+
+// Unmap [addr, addr + len) from space of pid (see vma_munmap())
+// NOTE: must be called with the lock of space held
+static bool vma_unmap(vma_space_t *space, pid_t pid, uintptr_t addr, size_t len)
+{
+    len = vma_page_up(len);
+    if (!vma_range_valid(addr, len))
+        return false;
+
+    const uintptr_t end = addr + len;
+
+    // Large areas cannot be split
+    for (vma_area_t *a = vma_lower_bound(space, addr); a && a->start < end;
+         a = vma_next(a)) {
+        if (a->backing == VMA_LARGE && (a->start < addr || a->end > end))
+            return false;
+    }
+
+    vma_area_t *area = vma_lower_bound(space, addr);
+    while (area && area->start < end) {
+        vma_area_t *next = vma_next(area);
+
+        if (area->backing == VMA_LARGE) {
+            vma_release_large(pid, area);
+            vma_remove(space, area);
+            area = next;
+            continue;
+        }
+
+        const uintptr_t from = area->start > addr ? area->start : addr;
+        const uintptr_t to = area->end < end ? area->end : end;
+        vma_release(pid, from, to, area->backing);
+
+        // Offset of the first remaining page for physical areas
+        const uintptr_t phys_skip = area->backing == VMA_PHYS ? end - area->start : 0;
+
+        if (area->start < addr && area->end > end) {
+            // Split into head (area) and tail
+            vma_area_t *tail = vma_area_new();
+            *tail = *area;
+            tail->start = end;
+            tail->phys += phys_skip;
+            area->end = addr;
+            vma_insert(space, tail);
+        } else if (area->start < addr) {
+            area->end = addr;
+        } else if (area->end > end) {
+            area->phys += phys_skip;
+            area->start = end;
+        } else {
+            vma_remove(space, area);
+        }
+
+        area = next;
+    }
+
+    return true;
+}
+
+/**
+ * Unmap [addr, addr + len) from the address space of pid, trimming or
+ * splitting the areas it overlaps. Anonymous pages and blocks of large areas
+ * are freed.
+ * RETURN
+ *  false if the range is invalid or covers part of a large area, true
+ *  otherwise (even if nothing was mapped)
+ */
+bool vma_munmap(pid_t pid, uintptr_t addr, size_t len)
+{
+    vma_space_t *space = proc_get_vmas(pid);
+
+    const flags_reg_t flags = lock_write_irqsave(&space->lock);
+    const bool valid = vma_unmap(space, pid, addr, len);
+    lock_write_irqrestore(&space->lock, flags);
+    return valid;
+}
+
+/**
+ * Set program break of pid. The heap grows upwards from VMA_BRK_START and
+ * is backed by an anonymous read/write area; shrinking it frees the pages.
+ * RETURN
+ *  new program break, or the current one if brk is 0 or cannot be set
+ */
+uintptr_t vma_brk(pid_t pid, uintptr_t brk)
+{
+    vma_space_t *space = proc_get_vmas(pid);
+
+    const flags_reg_t flags = lock_write_irqsave(&space->lock);
+    if (brk < space->brk_start || brk > VMA_MMAP_BASE)
+        goto out;
+
+    const uintptr_t old_end = vma_page_up(space->brk);
+    const uintptr_t new_end = vma_page_up(brk);
+
+    if (new_end > old_end) {
+        if (!vma_range_free(space, old_end, new_end))
+            goto out;
+        vma_add(space, old_end, new_end, VMA_PROT_READ | VMA_PROT_WRITE,
+                VMA_ANON, 0);
+    } else if (new_end < old_end) {
+        vma_unmap(space, pid, new_end, old_end - new_end);
+    }
+
+    space->brk = brk;
+
+out:
+    brk = space->brk;
+    lock_write_irqrestore(&space->lock, flags);
+    return brk;
+}
+
+/**
+ * Return whether [addr, addr + len) lies entirely in areas of pid that permit
+ * prot (VMA_PROT_* bits), e.g. memory passed to a system call. Pages need not
+ * be present: faults of the kernel on user addresses are resolved like those
+ * of the process (see int_handle_page_fault()).
+ */
+bool vma_access_ok(pid_t pid, uintptr_t addr, size_t len, uint32_t prot)
+{
+    if (addr < VMA_USER_START || addr >= KERNEL_START_VMA
+        || KERNEL_START_VMA - addr < len)
+        return false;
+
+    vma_space_t *space = proc_get_vmas(pid);
+    const uintptr_t end = addr + len;
+    bool ok = true;
+
+    const flags_reg_t flags = lock_read_irqsave(&space->lock);
+    vma_area_t *area = vma_lower_bound(space, addr);
+    for ( ; addr < end; area = vma_next(area)) {
+        if (!area || area->start > addr || (area->prot & prot) != prot) {
+            ok = false;
+            break;
+        }
+        addr = area->end;
+    }
+    lock_read_irqrestore(&space->lock, flags);
+    return ok;
+}
+
+/**
+ * Handle fault on an unmapped page of the current process
+ * NOTE: called from the page fault handler with the lock of the address space
+ * held (see vma_lock())
+ * RETURN
+ *  true if the fault was resolved, false if addr lies outside of all areas
+ *  or the access is not permitted
+ */
+bool vma_fault(uintptr_t addr, bool write)
+{
+    const pid_t pid = proc_get_pid();
+    vma_space_t *space = proc_get_vmas(pid);
+    if (!space)
+        return false;
+
+    const vma_area_t *area = vma_find(space, addr);
+    if (!area || (write && !(area->prot & VMA_PROT_WRITE)))
+        return false;
+
+    // Page tables and frames come from the allocators, which need the kernel
+    // lock; the new frame is zeroed after releasing it
+    const uintptr_t vma = addr & ~(uintptr_t)(PAGE_SIZE - 1);
+    const flags_reg_t kernel = smp_lock_kernel();
+    page_entry_t *pte = proc_get_pte(pid, vma, true);
+    if (*pte) {
+        smp_unlock_kernel(kernel);
+        return false;
+    }
+
+    page_entry_t flags = PAGE_PUBLIC | PAGE_PRESENT;
+    if (area->prot & VMA_PROT_WRITE)
+        flags |= PAGE_WRITE;
+
+    uintptr_t pma;
+    if (area->backing == VMA_PHYS) {
+        smp_unlock_kernel(kernel);
+        pma = area->phys + (vma - area->start);
+        flags |= PAGE_DISABLE_CACHE;
+    } else {
+        pma = page_new_user();
+        smp_unlock_kernel(kernel);
+        if (!pma)
+            return false;
+        memset(page_map_window(PAGE_WINDOW_DST, pma), 0, PAGE_SIZE);
+        page_unmap_window(PAGE_WINDOW_DST);
+    }
+
+    page_set_pte(pte, vma, pma | flags);
+    return true;
+}
+
+/**
+ * Take the lock of the address space of pid, which serialises changes to its
+ * areas and page table entries (except for the accessed and idle bits, see
+ * wss.c). Release with vma_unlock().
+ * NOTE: must be called with interrupts disabled and without the kernel lock
+ * (which is taken after it)
+ */
+void vma_lock(pid_t pid)
+{
+    lock_write(&proc_get_vmas(pid)->lock);
+}
+
+/**
+ * Take the lock of the address space of pid if it is free, e.g. while holding
+ * the lock of another address space
+ * NOTE: must be called with interrupts disabled
+ * RETURN
+ *  false (without the lock) if the lock is held
+ */
+bool vma_lock_try(pid_t pid)
+{
+    return lock_write_try(&proc_get_vmas(pid)->lock);
+}
+
+void vma_unlock(pid_t pid)
+{
+    lock_write_unlock(&proc_get_vmas(pid)->lock);
+}
+
+// Print areas of a process
+void vma_info(pid_t pid)
+{
+    vma_space_t *space = proc_get_vmas(pid);
+    const char *backing[] = {
+        "anon",
+        "phys",
+        "large",
+    };
+
+    const flags_reg_t flags = lock_read_irqsave(&space->lock);
+    printk("vma_info (%u): brk: %p\n", pid, space->brk);
+    for (rb_node_t *n = rb_first(&space->tree); n; n = rb_next(n)) {
+        const vma_area_t *a = rb_entry(n, vma_area_t, node);
+        const char prot[] = {
+            a->prot & VMA_PROT_READ ? 'r' : '-',
+            a->prot & VMA_PROT_WRITE ? 'w' : '-',
+            a->prot & VMA_PROT_EXEC ? 'x' : '-',
+            '\0',
+        };
+        printk("    %p-%p %s %s\n", a->start, a->end, prot, backing[a->backing]);
+    }
+    lock_read_irqrestore(&space->lock, flags);
+}
+
+// Create address space containing only the user stack
+vma_space_t * vma_space_new(void)
+{
+    vma_space_t *space = kmalloc(sizeof(*space));
+    *space = (vma_space_t) {
+        .tree = { .root = NULL },
+        .cache = NULL,
+        .brk_start = VMA_BRK_START,
+        .brk = VMA_BRK_START,
+    };
+
+    vma_add(space, KERNEL_START_VMA - VMA_STACK_SIZE, KERNEL_START_VMA,
+            VMA_PROT_READ | VMA_PROT_WRITE, VMA_ANON, 0);
+
+    return space;
+}
@@ -0,0 +1,68 @@
+/**
+ * vma.h: Per-process virtual memory areas
+ */
+
+#ifndef _KERNEL_VMA_H
+#define _KERNEL_VMA_H
+
+#include "lock.h"
+#include "proc.h"
+#include "rbtree.h"
+#include "std.h"
+
+// User address space layout
+// NOTE: the user stack ends at KERNEL_START_VMA (see mem.h)
+#define VMA_USER_START      ((uintptr_t)0x00400000) // Lowest mappable address
+#define VMA_BRK_START       ((uintptr_t)0x10000000) // Start of brk heap
+#define VMA_MMAP_BASE       ((uintptr_t)0x40000000) // First address tried by mmap
+#define VMA_STACK_SIZE      ((uintptr_t)64 << 10)   // Size of user stack area
+
+// Protection bits
+#define VMA_PROT_READ       ((uint32_t)1 << 0)
+#define VMA_PROT_WRITE      ((uint32_t)1 << 1)
+#define VMA_PROT_EXEC       ((uint32_t)1 << 2)
+#define VMA_PROT_MASK       (VMA_PROT_READ | VMA_PROT_WRITE | VMA_PROT_EXEC)
+#define VMA_MAP_LARGE       ((uint32_t)1 << 3)  // Map with a large page
+                                                // (SYSCALL_MMAP only)
+
+// Backing types
+typedef enum {
+    VMA_ANON = 0,   // Zero-filled on first access, owned by the process
+    VMA_PHYS,       // Fixed physical range (e.g. device memory), never freed
+    VMA_LARGE,      // Zeroed 4 MiB block mapped by a single large page
+} vma_backing_t;
+
+// Contiguous range of user pages with uniform protection and backing
+typedef struct vma_area {
+    rb_node_t node;         // Tree node (ordered by start)
+    uintptr_t start;        // First address (page aligned)
+    uintptr_t end;          // One past the last address (page aligned)
+    uint32_t prot;          // VMA_PROT_* bits
+    vma_backing_t backing;  // Backing type
+    uintptr_t phys;         // PMA mapped at start (VMA_PHYS and VMA_LARGE)
+} vma_area_t;
+
+// Address space of a process
+typedef struct vma_space {
+    lock_rw_t lock;         // Serialises changes to the areas and page tables
+                            // (see vma_lock())
+    rb_tree_t tree;         // Non-overlapping areas
+    vma_area_t *cache;      // Area of the most recent lookup
+    uintptr_t brk_start;    // Start of brk heap
+    uintptr_t brk;          // Current program break
+} vma_space_t;
+
+bool vma_access_ok(pid_t pid, uintptr_t addr, size_t len, uint32_t prot);
+uintptr_t vma_brk(pid_t pid, uintptr_t brk);
+bool vma_fault(uintptr_t addr, bool write);
+vma_area_t * vma_find(vma_space_t *space, uintptr_t addr);
+void vma_info(pid_t pid);
+void vma_lock(pid_t pid);
+bool vma_lock_try(pid_t pid);
+uintptr_t vma_mmap(pid_t pid, uintptr_t addr, size_t len, uint32_t prot,
+                   vma_backing_t backing, uintptr_t phys);
+bool vma_munmap(pid_t pid, uintptr_t addr, size_t len);
+vma_space_t * vma_space_new(void);
+void vma_unlock(pid_t pid);
+
+#endif // _KERNEL_VMA_H
@@ -0,0 +1,170 @@
+/**
+ * wss.c: Working-set sampling from page table accessed/dirty bits
+ *
+ * The sampler runs from the idle loop (PID 0). Once every WSS_INTERVAL_US
+ * microseconds it starts a round that visits one process per call, reading and
+ * clearing the accessed bits of all user pages. A page not accessed since the
+ * previous sample is flagged PAGE_IDLE, which zram.c uses to pick cold pages
+ * for reclaim. A processor that caches a TLB entry never sets its accessed bit
+ * again, so the cleared pages are invalidated on the processor running the
+ * process, if any, once the process is sampled (see tlb.c). Dirty bits are only
+ * read, so the dirty count is the number of resident pages written since they
+ * were mapped.
+ *
+ * Hot pages are tracked with a small decaying score list per process: scores
+ * are halved at every sample, accessed pages gain WSS_HOT_WEIGHT, and an
+ * accessed page not on the list replaces the lowest-scoring entry if that
+ * entry has decayed below the score of a single access.
+ */
+
+#include "asm.h"
+#include "clock.h"
+#include "io.h"
+#include "page.h"
+#include "proc.h"
+#include "tlb.h"
+#include "wss.h"
+
+static pid_t wss_cursor;                // Next PID to sample
+static uint64_t wss_round_start;        // TSC value at start of current round
+static size_t wss_rounds;               // Number of rounds started
+
+// Counters for the sample in progress
+typedef struct {
+    wss_proc_t *proc;
+    size_t rss;
+    size_t wss;
+    size_t dirty;
+    size_t swapped;
+    tlb_batch_t batch;      // Pages whose accessed bit was cleared
+} wss_sample_t;
+
+// Credit an access to the hot-page list
+static void wss_hot_access(wss_proc_t *w, uintptr_t vma)
+{
+    wss_hot_t *min = &w->hot[0];
+    for (size_t i = 0; i < WSS_HOT_PAGES; i++) {
+        if (w->hot[i].score && w->hot[i].vma == vma) {
+            w->hot[i].score += WSS_HOT_WEIGHT;
+            return;
+        }
+        if (w->hot[i].score < min->score)
+            min = &w->hot[i];
+    }
+    if (min->score < WSS_HOT_WEIGHT) {
+        min->vma = vma;
+        min->score = WSS_HOT_WEIGHT;
+    }
+}
+
+// Read and clear the accessed bit of one page (proc_for_each_page() callback)
+static void wss_sample_page(pid_t pid, uintptr_t vma, page_entry_t *pte, void *arg)
+{
+    (void)pid;
+    wss_sample_t *s = arg;
+
+    // The process may run on any processor, whose MMU sets accessed and dirty
+    // bits without taking any lock, so the entry is only changed with a locked
+    // compare-and-exchange (which fails if the MMU set a bit in between). The
+    // process is not held: its TLB entries are invalidated afterwards (see
+    // wss_sample_proc()).
+    page_entry_t entry = __atomic_load_n(pte, __ATOMIC_RELAXED);
+    page_entry_t sampled;
+    do {
+        if (!(entry & PAGE_PRESENT)) {
+            if (entry & PAGE_SWAPPED)
+                s->swapped++;
+            return;
+        }
+        if (!(entry & PAGE_PUBLIC))
+            return;
+
+        if (entry & PAGE_ACCESSED)
+            sampled = entry & ~(PAGE_ACCESSED | PAGE_IDLE);
+        else
+            sampled = entry | PAGE_IDLE;
+    } while (sampled != entry
+             && !__atomic_compare_exchange_n(pte, &entry, sampled, false,
+                                             __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    s->rss++;
+    if (entry & PAGE_DIRTY)
+        s->dirty++;
+    if (entry & PAGE_ACCESSED) {
+        s->wss++;
+        wss_hot_access(s->proc, vma);
+        invlpg(vma);
+        tlb_batch_add(&s->batch, vma, 1);
+    }
+}
+
+// Sample the working set of a single process
+static void wss_sample_proc(pid_t pid)
+{
+    wss_proc_t *w = proc_get_wss(pid);
+
+    for (size_t i = 0; i < WSS_HOT_PAGES; i++)
+        w->hot[i].score >>= 1;
+
+    wss_sample_t s = { .proc = w };
+    proc_for_each_page(pid, &wss_sample_page, &s);
+
+    // Without a flush, a processor running pid would keep using the cached
+    // entries, and hot pages would look idle from the next sample on
+    s.batch.cpus = proc_tlb_cpus(pid);
+    tlb_batch_flush(&s.batch);
+
+    w->rss = s.rss;
+    w->wss = s.wss;
+    w->dirty = s.dirty;
+    w->swapped = s.swapped;
+    if (w->samples++)
+        w->wss_avg += s.wss - (w->wss_avg >> WSS_AVG_SHIFT);
+    else
+        w->wss_avg = s.wss << WSS_AVG_SHIFT;
+}
+
+// Sample the next user process (rounds start every WSS_INTERVAL_US)
+void wss_sample(void)
+{
+    if (!wss_cursor || wss_cursor >= proc_get_pid_end()) {
+        const uint64_t now = rdtsc();
+        if (wss_cursor && now - wss_round_start < clock_us_to_tsc(WSS_INTERVAL_US))
+            return;
+
+        if (wss_rounds && wss_rounds % WSS_REPORT_ROUNDS == 0)
+            wss_dump();
+
+        wss_round_start = now;
+        wss_rounds++;
+        wss_cursor = 1;
+    }
+
+    const pid_t pid = wss_cursor++;
+    if (proc_is_alive(pid))
+        wss_sample_proc(pid);
+}
+
+// Print working-set statistics of a process
+void wss_info(pid_t pid)
+{
+    const wss_proc_t *w = proc_get_wss(pid);
+
+    printk("wss_info (%u): rss: %u, wss: %u, avg: %u, dirty: %u, swapped: %u\n",
+           pid, w->rss, w->wss, w->wss_avg >> WSS_AVG_SHIFT, w->dirty,
+           w->swapped);
+    for (size_t i = 0; i < WSS_HOT_PAGES; i++) {
+        if (w->hot[i].score)
+            printk("    hot: %p, score: %u\n", w->hot[i].vma, w->hot[i].score);
+    }
+}
+
+// Print working-set statistics of all user processes
+void wss_dump(void)
+{
+    printk("wss_dump: round %u\n", wss_rounds);
+    for (pid_t pid = 1; pid < proc_get_pid_end(); pid++) {
+        if (proc_is_alive(pid))
+            wss_info(pid);
+    }
+}
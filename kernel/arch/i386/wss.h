@@ -0,0 +1,43 @@
+/**
+ * wss.h: Working-set sampling from page table accessed/dirty bits
+ */
+
+#ifndef _KERNEL_WSS_H
+#define _KERNEL_WSS_H
+
+#include "proc.h"
+#include "std.h"
+
+// Sampler constants
+enum {
+    WSS_HOT_PAGES       = 8,        // Length of per-process hot-page list
+    WSS_HOT_WEIGHT      = 16,       // Score added to a hot page per access
+    WSS_AVG_SHIFT       = 3,        // Weight of the moving average (1 / 2^n)
+    WSS_REPORT_ROUNDS   = 64,       // Print a report every this many rounds
+};
+
+// Minimum microseconds between the start of two sampling rounds
+#define WSS_INTERVAL_US 25000
+
+// Hot-page list entry
+typedef struct {
+    uintptr_t vma;      // Page VMA
+    size_t score;       // Decaying access score
+} wss_hot_t;
+
+// Per-process working-set statistics
+typedef struct wss_proc {
+    size_t rss;                     // Resident user pages
+    size_t wss;                     // Pages accessed during the last interval
+    size_t wss_avg;                 // Moving average of wss (scaled by 2^WSS_AVG_SHIFT)
+    size_t dirty;                   // Resident pages written since mapped
+    size_t swapped;                 // Pages swapped out to zram
+    size_t samples;                 // Number of samples taken
+    wss_hot_t hot[WSS_HOT_PAGES];   // Most frequently accessed pages
+} wss_proc_t;
+
+void wss_dump(void);
+void wss_info(pid_t pid);
+void wss_sample(void);
+
+#endif // _KERNEL_WSS_H
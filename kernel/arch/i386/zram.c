@@ -0,0 +1,420 @@
+/**
+ * zram.c: Compressed in-memory swap for cold user pages
+ *
+ * The reclaimer runs from the idle loop (PID 0) and visits the user pages of
+ * one process per call. Pages flagged PAGE_IDLE by the working-set sampler
+ * (see wss.c) and not accessed since are cold. While free memory is below
+ * ZRAM_LOW_WATERMARK, cold pages are compressed into the kernel heap and their
+ * page table entries replaced by a PAGE_SWAPPED slot reference until free
+ * memory is back above ZRAM_HIGH_WATERMARK. Faults on swapped pages decompress
+ * them into a fresh frame (see zram_fault()). Since the idle loop does not run
+ * on a busy system, page faults also reclaim directly while memory is below
+ * ZRAM_LOW_WATERMARK (see zram_reclaim_direct()).
+ *
+ * The compressor is a byte-oriented LZ77 variant in the spirit of LZ4. The
+ * compressed stream is a sequence of
+ *
+ *  token           high nibble: literal length, low nibble: match length - 4
+ *  [length bytes]  if the literal length nibble is 15, further bytes are added
+ *                  to it until a byte other than 255 is read
+ *  literals
+ *  offset          2 bytes, little endian (omitted in the final sequence)
+ *  [length bytes]  extra match length, encoded as for literals
+ *
+ * where the final sequence consists only of literals.
+ */
+
+#include "alloc.h"
+#include "asm.h"
+#include "io.h"
+#include "page.h"
+#include "proc.h"
+#include "smp.h"
+#include "string.h"
+#include "vma.h"
+#include "zram.h"
+
+static zram_slot_t zram_slots[ZRAM_SLOTS];
+static uint16_t zram_free_slots[ZRAM_SLOTS];    // Stack of free slot indexes
+static size_t zram_free_top;                    // Number of free slots
+static uint8_t zram_buffer[PAGE_SIZE];          // Compression output buffer
+static uint16_t zram_lz_table[1 << ZRAM_LZ_HASH_BITS];
+static zram_stats_t zram_stats;
+static pid_t zram_cursor = 1;                   // Next PID to scan
+static bool zram_reclaiming = false;            // Whether below low watermark
+
+static inline uint32_t zram_read32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16
+           | (uint32_t)p[3] << 24;
+}
+
+// Append extended length bytes for a length nibble of 15
+static inline size_t zram_lz_put_len(uint8_t *dst, size_t op, size_t len)
+{
+    for ( ; len >= 255; len -= 255)
+        dst[op++] = 255;
+    dst[op++] = len;
+    return op;
+}
+
+// Append one sequence (match_len of zero denotes the final sequence)
+// RETURN new output offset, or zero if the output would exceed dst_max
+static size_t zram_lz_put_seq(uint8_t *dst, size_t op, size_t dst_max,
+                              const uint8_t *lit, size_t lit_len,
+                              size_t offset, size_t match_len)
+{
+    const size_t worst = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+    if (op + worst > dst_max)
+        return 0;
+
+    const size_t ml = match_len ? match_len - 4 : 0;
+    dst[op++] = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+    if (lit_len >= 15)
+        op = zram_lz_put_len(dst, op, lit_len - 15);
+    memcpy(&dst[op], lit, lit_len);
+    op += lit_len;
+
+    if (match_len) {
+        dst[op++] = offset & 0xff;
+        dst[op++] = offset >> 8;
+        if (ml >= 15)
+            op = zram_lz_put_len(dst, op, ml - 15);
+    }
+    return op;
+}
+
+// Compress one page
+// RETURN compressed size, or zero if it would exceed dst_max
+static size_t zram_compress(const uint8_t *src, uint8_t *dst, size_t dst_max)
+{
+    size_t ip = 0;      // Input position
+    size_t anchor = 0;  // Start of pending literals
+    size_t op = 0;      // Output position
+
+    while (ip + 4 <= PAGE_SIZE) {
+        const uint32_t seq = zram_read32(&src[ip]);
+        const size_t h = (seq * 2654435761u) >> (32 - ZRAM_LZ_HASH_BITS);
+        const size_t cand = zram_lz_table[h];
+        zram_lz_table[h] = ip;
+
+        // Table entries left over from other pages are weeded out here
+        if (cand >= ip || zram_read32(&src[cand]) != seq) {
+            ip++;
+            continue;
+        }
+
+        size_t len = 4;
+        while (ip + len < PAGE_SIZE && src[cand + len] == src[ip + len])
+            len++;
+
+        op = zram_lz_put_seq(dst, op, dst_max, &src[anchor], ip - anchor,
+                             ip - cand, len);
+        if (!op)
+            return 0;
+        ip += len;
+        anchor = ip;
+    }
+
+    return zram_lz_put_seq(dst, op, dst_max, &src[anchor], PAGE_SIZE - anchor, 0, 0);
+}
+
+// Read extended length bytes
+static inline bool zram_lz_get_len(const uint8_t *src, size_t src_len,
+                                   size_t *ip, size_t *len)
+{
+    uint8_t b;
+    do {
+        if (*ip >= src_len)
+            return false;
+        b = src[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decompress one page
+// RETURN whether the compressed stream was well-formed
+static bool zram_decompress(const uint8_t *src, size_t src_len, uint8_t *dst)
+{
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < src_len) {
+        const uint8_t token = src[ip++];
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !zram_lz_get_len(src, src_len, &ip, &lit_len))
+            return false;
+        if (ip + lit_len > src_len || op + lit_len > PAGE_SIZE)
+            return false;
+        memcpy(&dst[op], &src[ip], lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // Final sequence has no match
+        if (ip == src_len)
+            break;
+
+        if (ip + 2 > src_len)
+            return false;
+        const size_t offset = (size_t)src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+
+        size_t match_len = token & 0xf;
+        if (match_len == 15 && !zram_lz_get_len(src, src_len, &ip, &match_len))
+            return false;
+        match_len += 4;
+        if (offset == 0 || offset > op || op + match_len > PAGE_SIZE)
+            return false;
+
+        // Matches may overlap their own output, so copy bytewise
+        for (size_t i = 0; i < match_len; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+
+    return op == PAGE_SIZE;
+}
+
+static inline bool zram_page_is_zero(const uint32_t *page)
+{
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(*page); i++) {
+        if (page[i])
+            return false;
+    }
+    return true;
+}
+
+// Compress user page into a zram slot and release its frame
+// NOTE: must be called with interrupts disabled
+static void zram_swap_out(page_entry_t *pte, uintptr_t vma)
+{
+    if (!zram_free_top)
+        return;
+
+    const uintptr_t pma = *pte & ~(uintptr_t)0xfff;
+    const uint8_t *page = page_map_window(PAGE_WINDOW_SRC, pma);
+    size_t len = 0;
+
+    if (!zram_page_is_zero((const uint32_t*)page)) {
+        len = zram_compress(page, zram_buffer, ZRAM_MAX_COMPRESSED);
+        if (!len) {
+            // Not worth storing; wait until the sampler finds it idle again
+            page_unmap_window(PAGE_WINDOW_SRC);
+            *pte &= ~PAGE_IDLE;
+            zram_stats.incompressible++;
+            return;
+        }
+    }
+    page_unmap_window(PAGE_WINDOW_SRC);
+
+    const uint16_t idx = zram_free_slots[--zram_free_top];
+    zram_slot_t *slot = &zram_slots[idx];
+    *slot = (zram_slot_t) {
+        .data = NULL,
+        .len = len,
+        .flags = *pte & 0xfff & ~(PAGE_IDLE | PAGE_ACCESSED | PAGE_DIRTY),
+    };
+    if (len) {
+        slot->data = kmalloc(len);
+        memcpy(slot->data, zram_buffer, len);
+        zram_stats.compressed_bytes += len;
+    } else {
+        zram_stats.pages_zero++;
+    }
+
+    page_set_pte(pte, vma, (page_entry_t)idx << 12 | PAGE_SWAPPED);
+    page_free_pma(pma);
+
+    zram_stats.pages_stored++;
+    zram_stats.swap_outs++;
+}
+
+// Swap out a single user page if cold (proc_for_each_page() callback). Direct
+// reclaim (arg non-NULL, see zram_reclaim_direct()) cannot wait for the
+// working-set sampler, so it ages pages itself: pages accessed since its last
+// visit lose the accessed bit, the others are cold.
+static void zram_reclaim_page(pid_t pid, uintptr_t vma, page_entry_t *pte, void *arg)
+{
+    const bool direct = arg != NULL;
+    if (direct && page_frames_free() >= ZRAM_LOW_WATERMARK)
+        return;
+
+    // Shared and physical (uncached, see vma.c) mappings are never swapped
+    const page_entry_t mask = PAGE_COW | PAGE_DISABLE_CACHE | PAGE_PUBLIC
+                              | PAGE_PRESENT;
+    const page_entry_t user = PAGE_PUBLIC | PAGE_PRESENT;
+
+    // The entries of pid only change with the lock of its address space held.
+    // The process may still run (and set the accessed bit) whenever it is not
+    // held, so the entry is rechecked atomically. Pages of a process running
+    // on another processor are left for the next pass.
+    const flags_reg_t flags = get_flags();
+    cli();
+    vma_lock(pid);
+    smp_lock_kernel();
+    if (proc_hold(pid)) {
+        const page_entry_t entry = *pte;
+        if ((entry & mask) == user) {
+            if (!(entry & PAGE_ACCESSED) && (direct || (entry & PAGE_IDLE)))
+                zram_swap_out(pte, vma);
+            else if (direct && (entry & PAGE_ACCESSED))
+                page_set_pte(pte, vma, entry & ~PAGE_ACCESSED);
+        }
+        proc_release();
+    }
+    smp_unlock_kernel(get_flags());
+    vma_unlock(pid);
+    set_flags(flags);
+}
+
+// Swap out cold pages of the next user process if memory is low
+void zram_reclaim(void)
+{
+    const size_t frames = page_frames_free();
+
+    if (!zram_reclaiming && frames < ZRAM_LOW_WATERMARK) {
+        zram_reclaiming = true;
+    } else if (zram_reclaiming && frames >= ZRAM_HIGH_WATERMARK) {
+        zram_reclaiming = false;
+        zram_info();
+    }
+
+    if (!zram_reclaiming)
+        return;
+
+    if (zram_cursor >= proc_get_pid_end())
+        zram_cursor = 1;
+
+    const pid_t pid = zram_cursor++;
+    if (proc_is_alive(pid))
+        proc_for_each_page(pid, &zram_reclaim_page, NULL);
+}
+
+/**
+ * Swap out user pages until free memory is back at ZRAM_LOW_WATERMARK, for
+ * allocations that cannot wait for the idle loop (see int_handle_page_fault())
+ * NOTE: must be called with interrupts disabled and without locks held
+ */
+void zram_reclaim_direct(void)
+{
+    bool direct = true;
+    __atomic_fetch_add(&zram_stats.direct_reclaims, 1, __ATOMIC_RELAXED);
+
+    // Pages accessed during the first pass are skipped by the second one
+    for (size_t pass = 0; pass < ZRAM_DIRECT_PASSES; pass++) {
+        for (pid_t pid = 1; pid < proc_get_pid_end(); pid++) {
+            if (page_frames_free() >= ZRAM_LOW_WATERMARK)
+                return;
+            if (proc_is_alive(pid))
+                proc_for_each_page(pid, &zram_reclaim_page, &direct);
+        }
+    }
+}
+
+// Release slot and its compressed data
+static void zram_slot_free(uint16_t idx)
+{
+    zram_slot_t *slot = &zram_slots[idx];
+    if (slot->len) {
+        kfree(slot->data);
+        zram_stats.compressed_bytes -= slot->len;
+    } else {
+        zram_stats.pages_zero--;
+    }
+    zram_free_slots[zram_free_top++] = idx;
+    zram_stats.pages_stored--;
+}
+
+/**
+ * Handle fault on a swapped-out page of the current process
+ * NOTE: called from the page fault handler with the lock of the address space
+ * held (see vma_lock())
+ * RETURN
+ *  true if the fault was resolved, false if vma is not a zram page
+ */
+bool zram_fault(uintptr_t vma)
+{
+    const uint64_t start = rdtsc();
+
+    vma &= ~(uintptr_t)(PAGE_SIZE - 1);
+
+    if (!page_table_is_present(vma))
+        return false;
+
+    const page_entry_t entry = page_get_entry(vma);
+    if ((entry & PAGE_PRESENT) || !(entry & PAGE_SWAPPED))
+        return false;
+
+    // The slot belongs to the entry, so only the allocators and the free
+    // slots need the kernel lock
+    const uint16_t idx = entry >> 12;
+    zram_slot_t *slot = &zram_slots[idx];
+    flags_reg_t kernel = smp_lock_kernel();
+    const uintptr_t pma = page_new_user();
+    smp_unlock_kernel(kernel);
+    if (!pma)
+        return false;
+    uint8_t *page = page_map_window(PAGE_WINDOW_DST, pma);
+
+    if (slot->len) {
+        if (!zram_decompress(slot->data, slot->len, page)) {
+            printk("zram_fault: FATAL: corrupt slot %u (%p)\n", idx, vma);
+            die();
+        }
+    } else {
+        memset(page, 0, PAGE_SIZE);
+    }
+    page_unmap_window(PAGE_WINDOW_DST);
+
+    page_set_entry(vma, pma | slot->flags);
+    invlpg(vma);
+
+    kernel = smp_lock_kernel();
+    zram_slot_free(idx);
+    zram_stats.faults++;
+
+    const uint64_t cycles = rdtsc() - start;
+    zram_stats.fault_cycles += cycles;
+    if (cycles > zram_stats.fault_cycles_max)
+        zram_stats.fault_cycles_max = cycles;
+    smp_unlock_kernel(kernel);
+
+    return true;
+}
+
+// Drop swapped-out page referenced by a PAGE_SWAPPED page table entry
+// NOTE: must be called with interrupts disabled
+void zram_discard(page_entry_t entry)
+{
+    zram_slot_free(entry >> 12);
+}
+
+// Print zram statistics
+void zram_info(void)
+{
+    const size_t compressed_pages = zram_stats.pages_stored - zram_stats.pages_zero;
+    size_t ratio = 0;   // Compression ratio in hundredths
+    if (zram_stats.compressed_bytes)
+        ratio = compressed_pages * PAGE_SIZE * 100 / zram_stats.compressed_bytes;
+
+    uint64_t fault_avg = 0;
+    if (zram_stats.faults)
+        fault_avg = zram_stats.fault_cycles / zram_stats.faults;
+
+    printk("zram_info: stored: %u (zero: %u), compressed: %u B, ratio: %u.%u%u\n",
+           zram_stats.pages_stored, zram_stats.pages_zero,
+           zram_stats.compressed_bytes, ratio / 100, ratio / 10 % 10, ratio % 10);
+    printk("zram_info: swap outs: %u, incompressible: %u, direct reclaims: %u, "
+           "faults: %u, fault cycles avg: %lu, max: %lu\n",
+           zram_stats.swap_outs, zram_stats.incompressible,
+           zram_stats.direct_reclaims, zram_stats.faults, fault_avg,
+           zram_stats.fault_cycles_max);
+}
+
+void zram_init(void)
+{
+    for (size_t i = 0; i < ZRAM_SLOTS; i++)
+        zram_free_slots[i] = ZRAM_SLOTS - 1 - i;
+    zram_free_top = ZRAM_SLOTS;
+}
@@ -0,0 +1,48 @@
+/**
+ * zram.h: Compressed in-memory swap for cold user pages
+ */
+
+#ifndef _KERNEL_ZRAM_H
+#define _KERNEL_ZRAM_H
+
+#include "page.h"
+#include "std.h"
+
+// zram constants
+enum {
+    ZRAM_SLOTS          = 4096,             // Maximum number of swapped pages
+    ZRAM_MAX_COMPRESSED = PAGE_SIZE * 3 / 4,// Larger pages are not worth storing
+    ZRAM_LOW_WATERMARK  = 256,              // Start reclaim below this many free pages
+    ZRAM_HIGH_WATERMARK = 512,              // Stop reclaim above this many free pages
+    ZRAM_LZ_HASH_BITS   = 12,               // Size of compressor match table
+    ZRAM_DIRECT_PASSES  = 2,                // Passes of zram_reclaim_direct()
+};
+
+// Swapped-out page
+typedef struct {
+    void *data;         // Compressed contents (NULL for zero-filled pages)
+    uint16_t len;       // Compressed size (0 for zero-filled pages)
+    uint16_t flags;     // Page table entry flags to restore on fault
+} zram_slot_t;
+
+// zram statistics
+typedef struct {
+    size_t pages_stored;        // Number of pages currently swapped out
+    size_t pages_zero;          // Number of stored pages that are zero-filled
+    size_t compressed_bytes;    // Total compressed size of stored pages
+    size_t swap_outs;           // Number of pages ever swapped out
+    size_t incompressible;      // Number of pages rejected by the compressor
+    size_t direct_reclaims;     // Number of zram_reclaim_direct() calls
+    size_t faults;              // Number of pages swapped back in
+    uint64_t fault_cycles;      // Total TSC cycles spent on fault-in
+    uint64_t fault_cycles_max;  // Slowest fault-in in TSC cycles
+} zram_stats_t;
+
+void zram_discard(page_entry_t entry);
+bool zram_fault(uintptr_t vma);
+void zram_info(void);
+void zram_init(void);
+void zram_reclaim(void);
+void zram_reclaim_direct(void);
+
+#endif // _KERNEL_ZRAM_H